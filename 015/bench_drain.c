@@ -0,0 +1,234 @@
+/*
+    Input drain benchmark
+
+    Feeds a stream of input records for randomly chosen players through two ways of processing them on one core:
+
+        per-record      look up each player as its record arrives and add it to a simulation batch of up to
+                        SIMULATE_BATCH_SIZE players, like process_input used to
+        pipelined       stage DRAIN_BATCH_SIZE records, hash and prefetch their index entries, look up each player and
+                        prefetch its state, then step them as one simulation batch, like the worker does now
+
+    Both use the same map.h table and simulate.h kernel. Each record carries one new input, which is the steady
+    state for a player sending 100 packets per-second. Reports cycles per input as measured by rdtsc, for a range
+    of players per-cpu, so the difference is the time spent stalled on cache misses.
+
+    USAGE:
+
+        make bench_drain && ./bench_drain [records]
+*/
+
+#define _GNU_SOURCE
+
+#include <memory.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <unistd.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <x86intrin.h>
+#include <linux/types.h>
+
+#include "map.h"
+#include "simulate.h"
+#include "drain.h"
+
+#define BENCH_PASSES 5
+
+struct bench_player_t
+{
+    struct player_state state;
+    uint64_t batch_generation;
+};
+
+struct bench_record_t
+{
+    struct input_header header;
+    struct input_data inputs[1];
+};
+
+static simulate_function_t simulate;
+
+static uint64_t random_uint64()
+{
+    return ( (uint64_t) rand() << 62 ) ^ ( (uint64_t) rand() << 31 ) ^ (uint64_t) rand();
+}
+
+static uint64_t run_per_record( struct map_t * map, struct simulate_batch_t * batch, const struct bench_record_t * records, int num_records )
+{
+    uint64_t generation = 1;
+
+    const uint64_t start = __rdtsc();
+
+    simulate_batch_reset( batch );
+
+    for ( int i = 0; i < num_records; i++ )
+    {
+        const struct bench_record_t * record = &records[i];
+
+        struct bench_player_t * player = (struct bench_player_t*) map_get( map, record->header.session_id );
+        if ( !player )
+        {
+            simulate( batch );
+            simulate_batch_reset( batch );
+            generation++;
+            player = (struct bench_player_t*) map_insert( map, record->header.session_id );
+        }
+
+        if ( player->batch_generation == generation || batch->count == SIMULATE_BATCH_SIZE )
+        {
+            simulate( batch );
+            simulate_batch_reset( batch );
+            generation++;
+        }
+
+        simulate_batch_add( batch, &player->state, record->inputs, (int) record->header.num_inputs );
+
+        player->batch_generation = generation;
+    }
+
+    simulate( batch );
+
+    return __rdtsc() - start;
+}
+
+static uint64_t run_pipelined( struct map_t * map, struct simulate_batch_t * batch, struct drain_batch_t * drain, const struct bench_record_t * records, int num_records )
+{
+    uint64_t generation = 1;
+
+    const uint64_t start = __rdtsc();
+
+    for ( int i = 0; i < num_records; i += DRAIN_BATCH_SIZE )
+    {
+        const int count = ( num_records - i < DRAIN_BATCH_SIZE ) ? num_records - i : DRAIN_BATCH_SIZE;
+
+        drain->count = 0;
+        for ( int j = 0; j < count; j++ )
+        {
+            drain_batch_stage( drain, map, &records[i+j].header, records[i+j].inputs );
+        }
+
+        drain_batch_resolve( drain, map );
+
+        simulate_batch_reset( batch );
+
+        for ( int j = 0; j < count; j++ )
+        {
+            struct bench_player_t * player = (struct bench_player_t*) map_slot_value( map, drain->slot[j] );
+            if ( player->batch_generation == generation )
+            {
+                simulate( batch );
+                simulate_batch_reset( batch );
+                generation++;
+            }
+            simulate_batch_add_dt( batch, &player->state, drain->records[j].dt, drain->records[j].num_inputs );
+            player->batch_generation = generation;
+        }
+
+        simulate( batch );
+
+        generation++;
+    }
+
+    return __rdtsc() - start;
+}
+
+int main( int argc, char *argv[] )
+{
+    int num_records = 1000000;
+
+    if ( argc == 2 )
+    {
+        num_records = atoi( argv[1] );
+    }
+
+    if ( argc > 2 || num_records <= 0 )
+    {
+        printf( "\nusage: bench_drain [records]\n\n" );
+        return 1;
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO( &cpuset );
+    CPU_SET( 0, &cpuset );
+    sched_setaffinity( 0, sizeof(cpuset), &cpuset );
+
+    const int kernel = simulate_init();
+    simulate = simulate_functions[kernel];
+
+    struct simulate_batch_t * batch = (struct simulate_batch_t*) aligned_alloc( 64, sizeof(struct simulate_batch_t) );
+    struct drain_batch_t * drain = (struct drain_batch_t*) malloc( sizeof(struct drain_batch_t) );
+    struct bench_record_t * records = (struct bench_record_t*) malloc( num_records * sizeof(struct bench_record_t) );
+    assert( batch && drain && records );
+
+    printf( "%d records, one input each, %s kernel, drain batch size %d\n\n", num_records, simulate_kernel_names[kernel], DRAIN_BATCH_SIZE );
+
+    printf( "%10s %12s %12s %12s %10s\n", "players", "state (MB)", "per-record", "pipelined", "speedup" );
+
+    const int player_counts[] = { 1000, 4000, 16000, 64000, 256000, 1000000 };
+
+    for ( int p = 0; p < (int) ( sizeof(player_counts) / sizeof(player_counts[0]) ); p++ )
+    {
+        const int num_players = player_counts[p];
+
+        srand( 1 );
+
+        uint64_t * session_ids = (uint64_t*) malloc( num_players * sizeof(uint64_t) );
+        assert( session_ids );
+
+        struct map_t * map = map_create( sizeof(struct bench_player_t), num_players, -1 );
+
+        for ( int i = 0; i < num_players; i++ )
+        {
+            session_ids[i] = random_uint64();
+            map_insert( map, session_ids[i] );
+        }
+
+        for ( int i = 0; i < num_records; i++ )
+        {
+            memset( &records[i], 0, sizeof(struct bench_record_t) );
+            records[i].header.session_id = session_ids[rand() % num_players];
+            records[i].header.num_inputs = 1;
+            records[i].inputs[0].dt = 1000000000 / 100;
+        }
+
+        // best of several passes each way, so other work on the machine doesn't count against either
+
+        uint64_t per_record_cycles = UINT64_MAX;
+        uint64_t pipelined_cycles = UINT64_MAX;
+
+        for ( int pass = 0; pass < BENCH_PASSES; pass++ )
+        {
+            const uint64_t per_record_pass = run_per_record( map, batch, records, num_records );
+            if ( per_record_pass < per_record_cycles )
+            {
+                per_record_cycles = per_record_pass;
+            }
+
+            const uint64_t pipelined_pass = run_pipelined( map, batch, drain, records, num_records );
+            if ( pipelined_pass < pipelined_cycles )
+            {
+                pipelined_cycles = pipelined_pass;
+            }
+        }
+
+        const double per_record = per_record_cycles / (double) num_records;
+        const double pipelined = pipelined_cycles / (double) num_records;
+
+        printf( "%10d %12.1f %12.1f %12.1f %9.2fx\n", num_players, map->arena_bytes / ( 1024.0 * 1024.0 ), per_record, pipelined, per_record / pipelined );
+
+        map_destroy( map );
+        free( session_ids );
+    }
+
+    printf( "\ncycles per input\n" );
+
+    free( batch );
+    free( drain );
+    free( records );
+
+    return 0;
+}
@@ -0,0 +1,370 @@
+/*
+    Player table micro-benchmark
+
+    Compares map.h against the bucket map it replaced. The bucket map had PLAYERS_PER_CPU buckets of 32 pointers
+    to separately malloc'd player states, and dropped players when a bucket filled up. It is kept here as the
+    baseline.
+
+    For each player count we insert that many random session ids, then time lookups in random order the way
+    process_input does them (find the player, then step its state), lookups for sessions that don't exist, and
+    deleting every player.
+
+    USAGE:
+
+        make bench_map && ./bench_map [iterations]
+*/
+
+#define _GNU_SOURCE
+
+#include <memory.h>
+#include <stdio.h>
+#include <errno.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <time.h>
+#include <stdlib.h>
+#include <linux/types.h>
+
+#include "map.h"
+
+// ---------------------------------------------------------------------------------------------------
+
+#define BUCKET_MAP_BUCKET_SIZE                   32
+#define BUCKET_MAP_NUM_BUCKETS      PLAYERS_PER_CPU
+
+struct bucket_map_element_t
+{
+    uint64_t session_id;
+    uint8_t * player_data;
+};
+
+struct bucket_map_bucket_t
+{
+    int size;
+    struct bucket_map_element_t elements[BUCKET_MAP_BUCKET_SIZE];
+};
+
+struct bucket_map_t
+{
+    int size;
+    struct bucket_map_bucket_t buckets[BUCKET_MAP_NUM_BUCKETS];
+};
+
+static struct bucket_map_t * bucket_map_create()
+{
+    struct bucket_map_t * map = (struct bucket_map_t*) malloc( sizeof( struct bucket_map_t ) );
+    assert( map );
+    memset( map, 0, sizeof(struct bucket_map_t) );
+    return map;
+}
+
+static void bucket_map_destroy( struct bucket_map_t * map )
+{
+    for ( int i = 0; i < BUCKET_MAP_NUM_BUCKETS; i++ )
+    {
+        for ( int j = 0; j < map->buckets[i].size; j++ )
+        {
+            free( map->buckets[i].elements[j].player_data );
+        }
+    }
+    free( map );
+}
+
+static int bucket_map_set( struct bucket_map_t * map, uint64_t session_id, void * player_data )
+{
+    struct bucket_map_bucket_t * bucket = map->buckets + ( session_id % BUCKET_MAP_NUM_BUCKETS );
+    if ( bucket->size == BUCKET_MAP_BUCKET_SIZE )
+    {
+        return 0;
+    }
+    struct bucket_map_element_t * element = bucket->elements + bucket->size;
+    element->session_id = session_id;
+    element->player_data = player_data;
+    ++bucket->size;
+    ++map->size;
+    return 1;
+}
+
+static struct bucket_map_element_t * bucket_map_find( struct bucket_map_bucket_t * bucket, uint64_t session_id )
+{
+    for ( int i = 0; i < bucket->size; i++ )
+    {
+        if ( bucket->elements[i].session_id == session_id )
+        {
+            return &bucket->elements[i];
+        }
+    }
+    return NULL;
+}
+
+static void * bucket_map_get( struct bucket_map_t * map, uint64_t session_id )
+{
+    struct bucket_map_bucket_t * bucket = map->buckets + ( session_id % BUCKET_MAP_NUM_BUCKETS );
+    struct bucket_map_element_t * element = bucket_map_find( bucket, session_id );
+    return element ? element->player_data : NULL;
+}
+
+static int bucket_map_delete( struct bucket_map_t * map, uint64_t session_id )
+{
+    struct bucket_map_bucket_t * bucket = map->buckets + ( session_id % BUCKET_MAP_NUM_BUCKETS );
+    struct bucket_map_element_t * element = bucket_map_find( bucket, session_id );
+    if ( !element )
+    {
+        return 0;
+    }
+    free( element->player_data );
+    struct bucket_map_element_t * last = bucket->elements + ( bucket->size - 1 );
+    *element = *last;
+    last->session_id = 0;
+    last->player_data = NULL;
+    --bucket->size;
+    --map->size;
+    return 1;
+}
+
+// ---------------------------------------------------------------------------------------------------
+
+struct bench_result_t
+{
+    double insert_ns;
+    double get_ns;
+    double step_ns;
+    double miss_ns;
+    double delete_ns;
+    int dropped;
+};
+
+static double platform_time()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+    return ts.tv_sec + ( (double) ( ts.tv_nsec ) ) / 1000000000.0;
+}
+
+static uint64_t random_uint64()
+{
+    return ( (uint64_t) rand() << 62 ) ^ ( (uint64_t) rand() << 31 ) ^ (uint64_t) rand();
+}
+
+static void shuffle( uint64_t * values, int count )
+{
+    for ( int i = count - 1; i > 0; i-- )
+    {
+        int j = rand() % ( i + 1 );
+        uint64_t temp = values[i];
+        values[i] = values[j];
+        values[j] = temp;
+    }
+}
+
+static void step_player( struct player_state * state )
+{
+    // the part of process_input that touches the player: advance t and write the first cache line of state
+
+    state->t += 1000000000 / 100;
+    for ( int i = 0; i < 64 - 8; i++ )
+    {
+        state->data[i] = (uint8_t) state->t + (uint8_t) i;
+    }
+}
+
+static volatile uint64_t sink;
+
+static void bench_bucket_map( const uint64_t * session_ids, const uint64_t * lookup_order, const uint64_t * missing, int count, int iterations, struct bench_result_t * result )
+{
+    memset( result, 0, sizeof(struct bench_result_t) );
+
+    struct bucket_map_t * map = bucket_map_create();
+
+    double start = platform_time();
+    for ( int i = 0; i < count; i++ )
+    {
+        struct player_state * state = (struct player_state*) malloc( sizeof(struct player_state) );
+        memset( state, 0, sizeof(struct player_state) );
+        if ( !bucket_map_set( map, session_ids[i], state ) )
+        {
+            free( state );
+            result->dropped++;
+        }
+    }
+    result->insert_ns = ( platform_time() - start ) * 1000000000.0 / count;
+
+    uint64_t found = 0;
+    start = platform_time();
+    for ( int j = 0; j < iterations; j++ )
+    {
+        for ( int i = 0; i < count; i++ )
+        {
+            found += bucket_map_get( map, lookup_order[i] ) != NULL;
+        }
+    }
+    result->get_ns = ( platform_time() - start ) * 1000000000.0 / ( (double) count * iterations );
+
+    start = platform_time();
+    for ( int j = 0; j < iterations; j++ )
+    {
+        for ( int i = 0; i < count; i++ )
+        {
+            struct player_state * state = (struct player_state*) bucket_map_get( map, lookup_order[i] );
+            if ( state )
+            {
+                step_player( state );
+            }
+        }
+    }
+    result->step_ns = ( platform_time() - start ) * 1000000000.0 / ( (double) count * iterations );
+
+    start = platform_time();
+    for ( int j = 0; j < iterations; j++ )
+    {
+        for ( int i = 0; i < count; i++ )
+        {
+            found += bucket_map_get( map, missing[i] ) != NULL;
+        }
+    }
+    result->miss_ns = ( platform_time() - start ) * 1000000000.0 / ( (double) count * iterations );
+
+    start = platform_time();
+    for ( int i = 0; i < count; i++ )
+    {
+        bucket_map_delete( map, lookup_order[i] );
+    }
+    result->delete_ns = ( platform_time() - start ) * 1000000000.0 / count;
+
+    sink = found;
+
+    bucket_map_destroy( map );
+}
+
+static void bench_map( const uint64_t * session_ids, const uint64_t * lookup_order, const uint64_t * missing, int count, int iterations, struct bench_result_t * result )
+{
+    memset( result, 0, sizeof(struct bench_result_t) );
+
+    struct map_t * map = map_create( sizeof(struct player_state), PLAYERS_PER_CPU, -1 );
+
+    double start = platform_time();
+    for ( int i = 0; i < count; i++ )
+    {
+        if ( !map_insert( map, session_ids[i] ) )
+        {
+            result->dropped++;
+        }
+    }
+    result->insert_ns = ( platform_time() - start ) * 1000000000.0 / count;
+
+    uint64_t found = 0;
+    start = platform_time();
+    for ( int j = 0; j < iterations; j++ )
+    {
+        for ( int i = 0; i < count; i++ )
+        {
+            found += map_get( map, lookup_order[i] ) != NULL;
+        }
+    }
+    result->get_ns = ( platform_time() - start ) * 1000000000.0 / ( (double) count * iterations );
+
+    start = platform_time();
+    for ( int j = 0; j < iterations; j++ )
+    {
+        for ( int i = 0; i < count; i++ )
+        {
+            struct player_state * state = (struct player_state*) map_get( map, lookup_order[i] );
+            if ( state )
+            {
+                step_player( state );
+            }
+        }
+    }
+    result->step_ns = ( platform_time() - start ) * 1000000000.0 / ( (double) count * iterations );
+
+    start = platform_time();
+    for ( int j = 0; j < iterations; j++ )
+    {
+        for ( int i = 0; i < count; i++ )
+        {
+            found += map_get( map, missing[i] ) != NULL;
+        }
+    }
+    result->miss_ns = ( platform_time() - start ) * 1000000000.0 / ( (double) count * iterations );
+
+    start = platform_time();
+    for ( int i = 0; i < count; i++ )
+    {
+        map_delete( map, lookup_order[i] );
+    }
+    result->delete_ns = ( platform_time() - start ) * 1000000000.0 / count;
+
+    sink = found;
+
+    map_destroy( map );
+}
+
+static void print_result( const char * name, int count, const struct bench_result_t * result )
+{
+    printf( "%-8s %8d %10.1f %10.1f %10.1f %10.1f %10.1f %10d\n", name, count, result->insert_ns, result->get_ns, result->step_ns, result->miss_ns, result->delete_ns, result->dropped );
+}
+
+int main( int argc, char *argv[] )
+{
+    int iterations = 100;
+
+    if ( argc == 2 )
+    {
+        iterations = atoi( argv[1] );
+    }
+
+    if ( argc > 2 || iterations <= 0 )
+    {
+        printf( "\nusage: bench_map [iterations]\n\n" );
+        return 1;
+    }
+
+    srand( 1 );
+
+    const int player_counts[] = { PLAYERS_PER_CPU, PLAYERS_PER_CPU * 4, PLAYERS_PER_CPU * 16, PLAYERS_PER_CPU * 64, PLAYERS_PER_CPU * 256 };
+    const int num_player_counts = sizeof(player_counts) / sizeof(player_counts[0]);
+
+    printf( "ns per operation, %d iterations\n\n", iterations );
+
+    printf( "%-8s %8s %10s %10s %10s %10s %10s %10s\n", "map", "players", "insert", "get", "get+step", "miss", "delete", "dropped" );
+
+    for ( int i = 0; i < num_player_counts; i++ )
+    {
+        const int count = player_counts[i];
+
+        uint64_t * session_ids = (uint64_t*) malloc( count * sizeof(uint64_t) );
+        uint64_t * lookup_order = (uint64_t*) malloc( count * sizeof(uint64_t) );
+        uint64_t * missing = (uint64_t*) malloc( count * sizeof(uint64_t) );
+        assert( session_ids && lookup_order && missing );
+
+        for ( int j = 0; j < count; j++ )
+        {
+            session_ids[j] = random_uint64();
+            missing[j] = random_uint64();
+        }
+
+        memcpy( lookup_order, session_ids, count * sizeof(uint64_t) );
+        shuffle( lookup_order, count );
+
+        struct bench_result_t result;
+
+        const int scaled_iterations = iterations * PLAYERS_PER_CPU / count > 0 ? iterations * PLAYERS_PER_CPU / count : 1;
+
+        bench_bucket_map( session_ids, lookup_order, missing, count, scaled_iterations, &result );
+        print_result( "bucket", count, &result );
+
+        bench_map( session_ids, lookup_order, missing, count, scaled_iterations, &result );
+        print_result( "map", count, &result );
+
+        printf( "\n" );
+
+        free( session_ids );
+        free( lookup_order );
+        free( missing );
+    }
+
+    return 0;
+}
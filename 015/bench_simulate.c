@@ -0,0 +1,166 @@
+/*
+    Batch player simulation benchmark
+
+    Steps a set of players with random inputs (1..INPUTS_PER_PACKET per player per batch, like input records from
+    XDP) through each simulate.h kernel the cpu supports, on a single pinned core. Reports player steps per second,
+    where one step is one input applied to one player, and checks every kernel is bit-identical to the scalar one.
+
+    USAGE:
+
+        make bench_simulate && ./bench_simulate [players] [seconds]
+*/
+
+#define _GNU_SOURCE
+
+#include <memory.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <assert.h>
+#include <inttypes.h>
+#include <time.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <linux/types.h>
+
+#include "simulate.h"
+
+struct bench_input_t
+{
+    int num_inputs;
+    struct input_data inputs[INPUTS_PER_PACKET];
+};
+
+static double platform_time()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+    return ts.tv_sec + ( (double) ( ts.tv_nsec ) ) / 1000000000.0;
+}
+
+static uint64_t run_pass( simulate_function_t simulate, struct simulate_batch_t * batch, struct player_state * players, const struct bench_input_t * inputs, int num_players )
+{
+    // one pass steps every player once, in batches of up to SIMULATE_BATCH_SIZE
+
+    uint64_t steps = 0;
+
+    simulate_batch_reset( batch );
+
+    for ( int i = 0; i < num_players; i++ )
+    {
+        if ( batch->count == SIMULATE_BATCH_SIZE )
+        {
+            simulate( batch );
+            simulate_batch_reset( batch );
+        }
+        simulate_batch_add( batch, &players[i], inputs[i].inputs, inputs[i].num_inputs );
+        steps += inputs[i].num_inputs;
+    }
+
+    simulate( batch );
+
+    return steps;
+}
+
+int main( int argc, char *argv[] )
+{
+    int num_players = PLAYERS_PER_CPU;
+    double seconds = 5.0;
+
+    if ( argc > 1 ) num_players = atoi( argv[1] );
+    if ( argc > 2 ) seconds = atof( argv[2] );
+
+    if ( argc > 3 || num_players <= 0 || seconds <= 0.0 )
+    {
+        printf( "\nusage: bench_simulate [players] [seconds]\n\n" );
+        return 1;
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO( &cpuset );
+    CPU_SET( 0, &cpuset );
+    sched_setaffinity( 0, sizeof(cpuset), &cpuset );
+
+    const int best_kernel = simulate_init();
+
+    struct simulate_batch_t * batch = (struct simulate_batch_t*) aligned_alloc( 64, sizeof(struct simulate_batch_t) );
+    struct bench_input_t * inputs = (struct bench_input_t*) malloc( num_players * sizeof(struct bench_input_t) );
+    struct player_state * players = (struct player_state*) malloc( num_players * sizeof(struct player_state) );
+    struct player_state * reference = (struct player_state*) malloc( num_players * sizeof(struct player_state) );
+    assert( batch && inputs && players && reference );
+
+    srand( 1 );
+
+    uint64_t steps_per_pass = 0;
+
+    for ( int i = 0; i < num_players; i++ )
+    {
+        inputs[i].num_inputs = 1 + rand() % INPUTS_PER_PACKET;
+        for ( int j = 0; j < inputs[i].num_inputs; j++ )
+        {
+            inputs[i].inputs[j].dt = 1000000000 / 100 + rand() % 1000;
+        }
+        steps_per_pass += inputs[i].num_inputs;
+    }
+
+    // reference result from the scalar kernel
+
+    memset( reference, 0, num_players * sizeof(struct player_state) );
+    for ( int i = 0; i < 3; i++ )
+    {
+        run_pass( simulate_batch_scalar, batch, reference, inputs, num_players );
+    }
+
+    printf( "%d players, %.1f steps per player per pass, best kernel is %s\n\n", num_players, steps_per_pass / (double) num_players, simulate_kernel_names[best_kernel] );
+
+    printf( "%-8s %18s %12s %10s %10s\n", "kernel", "player steps/sec", "ns/step", "speedup", "identical" );
+
+    double scalar_steps_per_second = 0.0;
+
+    for ( int kernel = 0; kernel < SIMULATE_NUM_KERNELS; kernel++ )
+    {
+        if ( !simulate_kernel_supported( kernel ) )
+        {
+            printf( "%-8s %18s\n", simulate_kernel_names[kernel], "not supported" );
+            continue;
+        }
+
+        simulate_function_t simulate = simulate_functions[kernel];
+
+        memset( players, 0, num_players * sizeof(struct player_state) );
+        for ( int i = 0; i < 3; i++ )
+        {
+            run_pass( simulate, batch, players, inputs, num_players );
+        }
+
+        const bool identical = memcmp( players, reference, num_players * sizeof(struct player_state) ) == 0;
+
+        uint64_t steps = 0;
+        const double start = platform_time();
+        double finish = start;
+        while ( finish - start < seconds )
+        {
+            for ( int i = 0; i < 10; i++ )
+            {
+                steps += run_pass( simulate, batch, players, inputs, num_players );
+            }
+            finish = platform_time();
+        }
+
+        const double steps_per_second = steps / ( finish - start );
+
+        if ( kernel == SIMULATE_KERNEL_SCALAR )
+        {
+            scalar_steps_per_second = steps_per_second;
+        }
+
+        printf( "%-8s %18.0f %12.2f %9.2fx %10s\n", simulate_kernel_names[kernel], steps_per_second, 1000000000.0 / steps_per_second, steps_per_second / scalar_steps_per_second, identical ? "yes" : "NO" );
+    }
+
+    free( batch );
+    free( inputs );
+    free( players );
+    free( reference );
+
+    return 0;
+}
@@ -0,0 +1,91 @@
+
+#include "shared.h"
+
+/*
+    Prefetch pipelined input drain.
+
+    Instead of looking up and stepping each player as its input record comes out of the ring buffer, the worker
+    stages up to DRAIN_BATCH_SIZE records, then steps them together, so the cache misses of different players
+    overlap instead of being paid one after the other:
+
+        1. staging a record hashes its session id and prefetches the index entries the lookup will start at
+        2. resolving finds (or inserts) each player, now mostly hitting the prefetched index lines, and prefetches
+           its player state row for write
+        3. by the time the simulation steps the batch, the first rows have arrived
+
+    Staged records keep just what the simulation needs, so the ring buffer can advance past them.
+
+    The batch is small on purpose: every player state row prefetched has to still be in L1 when it is stepped, and
+    16 rows of ~1k is a third of L1. Bigger batches evict their own prefetches (see bench_drain).
+*/
+
+#define DRAIN_BATCH_SIZE                                                                   16
+
+struct drain_record_t
+{
+    uint64_t session_id;
+    uint64_t player_state_slot;
+    int num_inputs;
+    uint64_t submit_time;                           // when xdp submitted the record, CLOCK_MONOTONIC ns
+    uint64_t dt[INPUTS_PER_PACKET];                 // oldest first
+};
+
+struct drain_batch_t
+{
+    int count;
+    struct drain_record_t records[DRAIN_BATCH_SIZE];
+    uint64_t hash[DRAIN_BATCH_SIZE];
+    int slot[DRAIN_BATCH_SIZE];                     // arena slot of the player, or -1 if it could not be added
+};
+
+static void drain_batch_stage( struct drain_batch_t * batch, struct map_t * map, const struct input_header * header, const struct input_data * inputs )
+{
+    assert( batch->count < DRAIN_BATCH_SIZE );
+    assert( header->num_inputs <= INPUTS_PER_PACKET );
+
+    const int index = batch->count++;
+
+    struct drain_record_t * record = &batch->records[index];
+
+    record->session_id = header->session_id;
+    record->player_state_slot = header->player_state_slot;
+    record->num_inputs = (int) header->num_inputs;
+    record->submit_time = header->submit_time;
+
+    // inputs are most recent first
+
+    for ( int j = 0; j < record->num_inputs; j++ )
+    {
+        record->dt[j] = inputs[record->num_inputs-1-j].dt;
+    }
+
+    batch->hash[index] = map_hash( record->session_id );
+    map_prefetch( map, batch->hash[index] );
+}
+
+static void drain_batch_resolve( struct drain_batch_t * batch, struct map_t * map )
+{
+    // inserting can move the arena, which is why we keep slots and not pointers here
+
+    for ( int i = 0; i < batch->count; i++ )
+    {
+        const uint64_t session_id = batch->records[i].session_id;
+
+        int slot = map_get_slot_hashed( map, session_id, batch->hash[i] );
+        if ( slot < 0 && map_insert( map, session_id ) )
+        {
+            slot = map_get_slot_hashed( map, session_id, batch->hash[i] );
+        }
+
+        batch->slot[i] = slot;
+
+        if ( slot < 0 )
+            continue;
+
+        const uint8_t * value = (const uint8_t*) map_slot_value( map, slot );
+        for ( int offset = 0; offset < map->value_size; offset += 64 )
+        {
+            __builtin_prefetch( value + offset, 1 );
+        }
+    }
+}
@@ -20,13 +20,17 @@
 #include <xdp/libxdp.h>
 #include <sys/resource.h>
 #include <sys/types.h>
+#include <sys/mman.h>
 #include <inttypes.h>
 #include <time.h>
 #include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
+#include <numa.h>
 #include "shared.h"
 #include "map.h"
+#include "simulate.h"
+#include "drain.h"
 
 struct bpf_t
 {
@@ -40,8 +44,15 @@ struct bpf_t
     int input_buffer_inner_fd[MAX_CPUS];
     int player_state_outer_fd;
     int player_state_inner_fd[MAX_CPUS];
+    int worker_poll_fd;
+    size_t worker_poll_size;
+    struct worker_poll_state * worker_poll;
     struct ring_buffer * input_buffer[MAX_CPUS];
     int ring_buffer_cpus[MAX_CPUS];
+#if PLAYER_STATE_MMAP
+    size_t player_state_slots_size;
+    struct player_state_slot * player_state_slots[MAX_CPUS];
+#endif // #if PLAYER_STATE_MMAP
 };
 
 static struct bpf_t bpf;
@@ -49,47 +60,381 @@ static struct bpf_t bpf;
 static uint64_t inputs_processed[MAX_CPUS];
 static uint64_t inputs_lost[MAX_CPUS];
 
+static const char * worker_poll_mode_names[] = { "epoll", "busy", "adaptive" };
+
+static uint64_t worker_wakeups[MAX_CPUS];
+
 static struct map_t * cpu_player_map[MAX_CPUS];
 
-static int process_input( void * ctx, void * data, size_t data_sz )
+struct player_t
 {
-    int cpu = *(int*) ctx;
+    struct player_state state;
+    uint64_t batch_generation;                      // equal to the worker generation while the player is in its batch
+#if WORKER_TICK_RATE
+    int num_queued_inputs;
+    uint64_t queued_dt[SIMULATE_MAX_INPUTS];        // oldest first
+    uint64_t player_state_slot;
+#endif // #if WORKER_TICK_RATE
+};
 
-    struct input_header * header = (struct input_header*) data;
+struct worker_t
+{
+    struct simulate_batch_t batch;
+    uint64_t session_id[SIMULATE_BATCH_SIZE];
+    uint64_t player_state_slot[SIMULATE_BATCH_SIZE];
+    uint64_t generation;
+    struct drain_batch_t drain;
+#if WORKER_TICK_RATE
+    int num_queued_players;
+    int queued_players_capacity;
+    uint64_t * queued_players;                      // session ids of players with queued inputs this tick
+    int num_tick_durations;
+    double tick_durations[WORKER_TICK_RATE];
+#else // #if WORKER_TICK_RATE
+    int num_input_latencies;
+    uint64_t input_latencies[INPUT_LATENCY_SAMPLES];   // ns from xdp submitting a record to its player being committed
+#endif // #if WORKER_TICK_RATE
+};
 
-    struct input_data * input = (struct input_data*) data + sizeof(struct input_header);
+#if WORKER_TICK_RATE
 
-    struct player_state * state = map_get( cpu_player_map[cpu], header->session_id );
-    if ( !state )
-    {
-        // first player update
-        state = malloc( sizeof(struct player_state) );
-        map_set( cpu_player_map[cpu], header->session_id, state );
-    }
+struct tick_stats_t
+{
+    double p50;
+    double p90;
+    double p99;
+    double max;
+};
+
+static struct tick_stats_t tick_stats[MAX_CPUS];
+
+#else // #if WORKER_TICK_RATE
+
+struct input_latency_stats_t
+{
+    uint64_t p50;
+    uint64_t p99;
+    uint64_t p999;
+};
+
+static struct input_latency_stats_t input_latency_stats[MAX_CPUS];
+
+#endif // #if WORKER_TICK_RATE
 
-    // todo: handle multiple inputs
+static struct worker_t worker[MAX_CPUS];
 
-    state->t += input->dt;
+static int simulate_kernel;
 
-    for ( int i = 0; i < PLAYER_STATE_SIZE; i++ )
+#if PLAYER_STATE_MMAP
+
+static void publish_player_state( struct player_state_slot * slot, uint64_t session_id, const struct player_state * state )
+{
+    // latch: while the sequence is odd xdp reads state[1], while it is even xdp reads state[0], so xdp never sees a torn state.
+    // xdp owns slot->session_id. each copy of the state records the session it belongs to, and is only written inside the
+    // latch, so when a slot passes to a new session xdp can't send it the previous session's state
+
+    if ( slot->session_id != session_id )
+        return;
+
+    uint64_t * sequence = (uint64_t*) ( (uint8_t*) slot + offsetof( struct player_state_slot, sequence ) );
+
+    __atomic_fetch_add( sequence, 1, __ATOMIC_SEQ_CST );
+
+    slot->owner[0] = session_id;
+    memcpy( &slot->state[0], state, sizeof(struct player_state) );
+
+    __atomic_fetch_add( sequence, 1, __ATOMIC_SEQ_CST );
+
+    slot->owner[1] = session_id;
+    memcpy( &slot->state[1], state, sizeof(struct player_state) );
+}
+
+#endif // #if PLAYER_STATE_MMAP
+
+static void commit_player_state( int cpu, uint64_t session_id, uint64_t player_state_slot, const struct player_state * state )
+{
+#if PLAYER_STATE_MMAP
+
+    if ( player_state_slot >= PLAYERS_PER_CPU )
     {
-        state->data[i] = (uint8_t) state->t + (uint8_t) i;
+        printf( "error: player state slot %d is out of range\n", (int) player_state_slot );
+        return;
     }
 
+    publish_player_state( bpf.player_state_slots[cpu] + player_state_slot, session_id, state );
+
+#else // #if PLAYER_STATE_MMAP
+
     int player_state_fd = bpf.player_state_inner_fd[cpu];
 
-    int err = bpf_map_update_elem( player_state_fd, &header->session_id, state, BPF_ANY );
+    int err = bpf_map_update_elem( player_state_fd, &session_id, state, BPF_ANY );
     if ( err != 0 )
     {
         printf( "error: failed to update player state: %s\n", strerror(errno) );
+    }
+
+#endif // #if PLAYER_STATE_MMAP
+}
+
+static void flush_batch( int cpu )
+{
+    // step every player in the batch in one pass, then commit them all
+
+    struct worker_t * w = &worker[cpu];
+
+    struct simulate_batch_t * batch = &w->batch;
+
+    if ( batch->count == 0 )
+        return;
+
+    simulate_functions[simulate_kernel]( batch );
+
+    uint64_t num_inputs = 0;
+
+    for ( int i = 0; i < batch->count; i++ )
+    {
+        commit_player_state( cpu, w->session_id[i], w->player_state_slot[i], batch->state[i] );
+        num_inputs += batch->num_inputs[i];
+    }
+
+    __sync_fetch_and_add( &inputs_processed[cpu], num_inputs );
+
+    simulate_batch_reset( batch );
+
+    w->generation++;
+}
+
+#if !WORKER_TICK_RATE
+
+static int compare_uint64( const void * a, const void * b )
+{
+    const uint64_t x = *(const uint64_t*) a;
+    const uint64_t y = *(const uint64_t*) b;
+    return ( x > y ) - ( x < y );
+}
+
+static void update_input_latency_stats( int cpu, uint64_t latency )
+{
+    // once we have INPUT_LATENCY_SAMPLES, publish percentiles for the main thread to print
+
+    struct worker_t * w = &worker[cpu];
+
+    w->input_latencies[w->num_input_latencies++] = latency;
+
+    if ( w->num_input_latencies < INPUT_LATENCY_SAMPLES )
+        return;
+
+    qsort( w->input_latencies, INPUT_LATENCY_SAMPLES, sizeof(uint64_t), compare_uint64 );
+
+    input_latency_stats[cpu].p50 = w->input_latencies[INPUT_LATENCY_SAMPLES * 50 / 100];
+    input_latency_stats[cpu].p99 = w->input_latencies[INPUT_LATENCY_SAMPLES * 99 / 100];
+    input_latency_stats[cpu].p999 = w->input_latencies[INPUT_LATENCY_SAMPLES * 999 / 1000];
+
+    w->num_input_latencies = 0;
+}
+
+#endif // #if !WORKER_TICK_RATE
+
+static void drain( int cpu )
+{
+    // look up all staged players with their cache misses overlapped, then step and commit them together
+
+    struct worker_t * w = &worker[cpu];
+
+    if ( w->drain.count == 0 )
+        return;
+
+    struct map_t * map = cpu_player_map[cpu];
+
+    drain_batch_resolve( &w->drain, map );
+
+    for ( int i = 0; i < w->drain.count; i++ )
+    {
+        struct drain_record_t * record = &w->drain.records[i];
+
+        if ( w->drain.slot[i] < 0 )
+        {
+            printf( "error: could not add player to map\n" );
+            continue;
+        }
+
+        struct player_t * player = (struct player_t*) map_slot_value( map, w->drain.slot[i] );
+
+        // a player is only stepped once per batch, so if this player is already in it, or the batch is full, flush it
+
+        if ( player->batch_generation == w->generation || w->batch.count == SIMULATE_BATCH_SIZE )
+        {
+            flush_batch( cpu );
+        }
+
+        int index = simulate_batch_add_dt( &w->batch, &player->state, record->dt, record->num_inputs );
+
+        w->session_id[index] = record->session_id;
+        w->player_state_slot[index] = record->player_state_slot;
+
+        player->batch_generation = w->generation;
+    }
+
+    flush_batch( cpu );
+
+#if !WORKER_TICK_RATE
+
+    // input latency is from xdp submitting the record to its player state being committed. xdp stamps records with
+    // bpf_ktime_get_ns(), which is CLOCK_MONOTONIC
+
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC, &ts );
+    const uint64_t commit_time = (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+
+    for ( int i = 0; i < w->drain.count; i++ )
+    {
+        if ( w->drain.slot[i] < 0 )
+            continue;
+
+        const uint64_t submit_time = w->drain.records[i].submit_time;
+
+        update_input_latency_stats( cpu, commit_time > submit_time ? commit_time - submit_time : 0 );
+    }
+
+#endif // #if !WORKER_TICK_RATE
+
+    w->drain.count = 0;
+}
+
+static int process_input( void * ctx, void * data, size_t data_sz )
+{
+    int cpu = *(int*) ctx;
+
+    struct input_header * header = (struct input_header*) data;
+
+    if ( data_sz < sizeof(struct input_header) || data_sz != INPUT_RECORD_SIZE( header->num_inputs ) || header->num_inputs > INPUTS_PER_PACKET )
+    {
+        printf( "error: input record has bad size (%d bytes)\n", (int) data_sz );
         return 0;
     }
 
-    __sync_fetch_and_add( &inputs_processed[cpu], 1 );
+    struct input_data * inputs = (struct input_data*) ( (uint8_t*) data + sizeof(struct input_header) );
+
+    struct worker_t * w = &worker[cpu];
+
+#if WORKER_TICK_RATE
+
+    // queue the inputs on the player. they are stepped together with every other player on the next tick
+
+    struct player_t * player = map_get( cpu_player_map[cpu], header->session_id );
+    if ( !player )
+    {
+        player = map_insert( cpu_player_map[cpu], header->session_id );
+        if ( !player )
+        {
+            printf( "error: could not add player to map\n" );
+            return 0;
+        }
+    }
+
+    if ( player->num_queued_inputs == 0 )
+    {
+        if ( w->num_queued_players == w->queued_players_capacity )
+        {
+            w->queued_players_capacity = w->queued_players_capacity ? w->queued_players_capacity * 2 : PLAYERS_PER_CPU;
+            w->queued_players = (uint64_t*) realloc( w->queued_players, w->queued_players_capacity * sizeof(uint64_t) );
+            assert( w->queued_players );
+        }
+        w->queued_players[w->num_queued_players++] = header->session_id;
+    }
+
+    for ( int j = (int) header->num_inputs - 1; j >= 0; j-- )
+    {
+        if ( player->num_queued_inputs == SIMULATE_MAX_INPUTS )
+        {
+            __sync_fetch_and_add( &inputs_lost[cpu], j + 1 );
+            break;
+        }
+        player->queued_dt[player->num_queued_inputs++] = inputs[j].dt;
+    }
+
+    player->player_state_slot = header->player_state_slot;
+
+    return 0;
+
+#else // #if WORKER_TICK_RATE
+
+    // stage the record. once we have a full drain batch, resolve and step it
+
+    drain_batch_stage( &w->drain, cpu_player_map[cpu], header, inputs );
+
+    if ( w->drain.count == DRAIN_BATCH_SIZE )
+    {
+        drain( cpu );
+    }
 
     return 0;
+
+#endif // #if WORKER_TICK_RATE
+}
+
+#if WORKER_TICK_RATE
+
+static void tick( int cpu )
+{
+    // step every player with queued inputs in one pass and commit them all
+
+    struct worker_t * w = &worker[cpu];
+
+    for ( int i = 0; i < w->num_queued_players; i++ )
+    {
+        struct player_t * player = map_get( cpu_player_map[cpu], w->queued_players[i] );
+        if ( !player || player->num_queued_inputs == 0 )
+            continue;
+
+        if ( w->batch.count == SIMULATE_BATCH_SIZE )
+        {
+            flush_batch( cpu );
+        }
+
+        int index = simulate_batch_add_dt( &w->batch, &player->state, player->queued_dt, player->num_queued_inputs );
+
+        w->session_id[index] = w->queued_players[i];
+        w->player_state_slot[index] = player->player_state_slot;
+
+        player->num_queued_inputs = 0;
+    }
+
+    flush_batch( cpu );
+
+    w->num_queued_players = 0;
+}
+
+static int compare_double( const void * a, const void * b )
+{
+    const double x = *(const double*) a;
+    const double y = *(const double*) b;
+    return ( x > y ) - ( x < y );
+}
+
+static void update_tick_stats( int cpu, double duration )
+{
+    // once a second worth of ticks are in, publish percentiles for the main thread to print
+
+    struct worker_t * w = &worker[cpu];
+
+    w->tick_durations[w->num_tick_durations++] = duration;
+
+    if ( w->num_tick_durations < WORKER_TICK_RATE )
+        return;
+
+    qsort( w->tick_durations, WORKER_TICK_RATE, sizeof(double), compare_double );
+
+    tick_stats[cpu].p50 = w->tick_durations[WORKER_TICK_RATE * 50 / 100];
+    tick_stats[cpu].p90 = w->tick_durations[WORKER_TICK_RATE * 90 / 100];
+    tick_stats[cpu].p99 = w->tick_durations[WORKER_TICK_RATE * 99 / 100];
+    tick_stats[cpu].max = w->tick_durations[WORKER_TICK_RATE - 1];
+
+    w->num_tick_durations = 0;
 }
 
+#endif // #if WORKER_TICK_RATE
+
 static double time_start;
 
 void platform_init()
@@ -257,6 +602,56 @@ int bpf_init( struct bpf_t * bpf, const char * interface_name )
         printf( "player state for cpu %d = %d\n", i, bpf->player_state_inner_fd[i] );
     }
 
+#if PLAYER_STATE_MMAP
+
+    // map the player state arrays into our address space, so workers can commit player state without a syscall
+
+    size_t page_size = sysconf( _SC_PAGESIZE );
+
+    bpf->player_state_slots_size = ( ( sizeof(struct player_state_slot) * PLAYERS_PER_CPU + page_size - 1 ) / page_size ) * page_size;
+
+    for ( int i = 0; i < MAX_CPUS; i++ )
+    {
+        void * slots = mmap( NULL, bpf->player_state_slots_size, PROT_READ | PROT_WRITE, MAP_SHARED, bpf->player_state_inner_fd[i], 0 );
+        if ( slots == MAP_FAILED )
+        {
+            printf( "\nerror: could not mmap player state for cpu %d: %s\n\n", i, strerror(errno) );
+            return 1;
+        }
+        bpf->player_state_slots[i] = (struct player_state_slot*) slots;
+    }
+
+#endif // #if PLAYER_STATE_MMAP
+
+    // map the worker poll states into our address space. xdp reads them to decide when a worker needs a wakeup
+
+    bpf->worker_poll_fd = bpf_obj_get( "/sys/fs/bpf/worker_poll_map" );
+    if ( bpf->worker_poll_fd <= 0 )
+    {
+        printf( "\nerror: could not get worker poll map: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    const size_t worker_poll_page_size = sysconf( _SC_PAGESIZE );
+
+    bpf->worker_poll_size = ( ( sizeof(struct worker_poll_state) * MAX_CPUS + worker_poll_page_size - 1 ) / worker_poll_page_size ) * worker_poll_page_size;
+
+    void * worker_poll = mmap( NULL, bpf->worker_poll_size, PROT_READ | PROT_WRITE, MAP_SHARED, bpf->worker_poll_fd, 0 );
+    if ( worker_poll == MAP_FAILED )
+    {
+        printf( "\nerror: could not mmap worker poll map: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    bpf->worker_poll = (struct worker_poll_state*) worker_poll;
+
+    // the map is pinned, so it can still hold the states of a previous run in another poll mode
+
+    for ( int i = 0; i < MAX_CPUS; i++ )
+    {
+        bpf->worker_poll[i].state = WORKER_POLL_STATE_DEFAULT;
+    }
+
     // get the file handle to the outer input buffer map
 
     bpf->input_buffer_outer_fd = bpf_obj_get( "/sys/fs/bpf/input_buffer_map" );
@@ -313,6 +708,27 @@ void bpf_shutdown( struct bpf_t * bpf )
         }
     }
 
+    if ( bpf->worker_poll )
+    {
+        for ( int i = 0; i < MAX_CPUS; i++ )
+        {
+            bpf->worker_poll[i].state = WORKER_POLL_STATE_DEFAULT;
+        }
+        munmap( bpf->worker_poll, bpf->worker_poll_size );
+        bpf->worker_poll = NULL;
+    }
+
+#if PLAYER_STATE_MMAP
+    for ( int i = 0; i < MAX_CPUS; i++ )
+    {
+        if ( bpf->player_state_slots[i] )
+        {
+            munmap( bpf->player_state_slots[i], bpf->player_state_slots_size );
+            bpf->player_state_slots[i] = NULL;
+        }
+    }
+#endif // #if PLAYER_STATE_MMAP
+
     if ( bpf->program != NULL )
     {
         if ( bpf->attached_native )
@@ -361,6 +777,13 @@ int pin_thread_to_cpu( int cpu )
     return pthread_setaffinity_np( current_thread, sizeof(cpu_set_t), &cpuset );
 }
 
+static void set_worker_poll_state( int cpu, uint64_t state )
+{
+    // a full barrier, so the ring buffer reads that follow can't be reordered before xdp can see the new state
+
+    __atomic_store_n( &bpf.worker_poll[cpu].state, state, __ATOMIC_SEQ_CST );
+}
+
 void * worker_thread_function( void * context )
 {
     int cpu = *( (int*) context );
@@ -369,11 +792,145 @@ void * worker_thread_function( void * context )
 
     pin_thread_to_cpu( cpu );
 
+#if WORKER_TICK_RATE
+
+    // each tick, drain the ring buffer into per-player input queues, then step and commit every player with inputs
+
+    const double tick_interval = 1.0 / WORKER_TICK_RATE;
+
+    double next_tick_time = platform_time();
+
+    while ( !quit )
+    {
+        next_tick_time += tick_interval;
+
+        double current_time = platform_time();
+        if ( current_time < next_tick_time )
+        {
+            platform_sleep( next_tick_time - current_time );
+        }
+        else
+        {
+            // we fell behind. don't try to catch up with a burst of ticks
+            next_tick_time = current_time;
+        }
+
+        const double tick_start_time = platform_time();
+
+        int err = ring_buffer__consume( bpf.input_buffer[cpu] );
+        if ( err < 0 )
+        {
+            printf( "\nerror: could not consume input buffer: %d\n\n", err );
+            quit = true;
+            break;
+        }
+
+        tick( cpu );
+
+        update_tick_stats( cpu, platform_time() - tick_start_time );
+    }
+
+#elif WORKER_POLL_MODE == WORKER_POLL_BUSY
+
+    // spin on the ring buffer and never sleep, so xdp never has to wake us up
+
+    set_worker_poll_state( cpu, WORKER_POLL_STATE_SPINNING );
+
+    while ( !quit )
+    {
+        int err = ring_buffer__consume( bpf.input_buffer[cpu] );
+        if ( err < 0 )
+        {
+            printf( "\nerror: could not consume input buffer: %d\n\n", err );
+            quit = true;
+            break;
+        }
+
+        drain( cpu );
+    }
+
+#elif WORKER_POLL_MODE == WORKER_POLL_ADAPTIVE
+
+    // spin on the ring buffer while inputs keep coming. once there have been none for WORKER_POLL_SPIN_US, sleep in epoll
+
+    set_worker_poll_state( cpu, WORKER_POLL_STATE_SPINNING );
+
+    double last_input_time = platform_time();
+
+    while ( !quit )
+    {
+        int err = ring_buffer__consume( bpf.input_buffer[cpu] );
+        if ( err < 0 )
+        {
+            printf( "\nerror: could not consume input buffer: %d\n\n", err );
+            quit = true;
+            break;
+        }
+
+        if ( err > 0 )
+        {
+            drain( cpu );
+            last_input_time = platform_time();
+            continue;
+        }
+
+        if ( platform_time() - last_input_time < WORKER_POLL_SPIN_US / 1000000.0 )
+        {
+            __builtin_ia32_pause();
+            continue;
+        }
+
+        // tell xdp we are going to sleep, then look once more. xdp may have read that we were spinning just before,
+        // and submitted without a wakeup. the short poll timeout bounds how long a record that slipped past both can wait
+
+        set_worker_poll_state( cpu, WORKER_POLL_STATE_SLEEPING );
+
+        err = ring_buffer__consume( bpf.input_buffer[cpu] );
+        if ( err == 0 )
+        {
+            err = ring_buffer__poll( bpf.input_buffer[cpu], 10 );
+            if ( err > 0 )
+            {
+                worker_wakeups[cpu]++;
+            }
+        }
+
+        set_worker_poll_state( cpu, WORKER_POLL_STATE_SPINNING );
+
+        drain( cpu );
+
+        if ( err == -EINTR )
+        {
+            // ctrl-c
+            quit = true;
+            break;
+        }
+        if ( err < 0 ) 
+        {
+            printf( "\nerror: could not poll input buffer: %d\n\n", err );
+            quit = true;
+            break;
+        }
+
+        last_input_time = platform_time();
+    }
+
+#else // #if WORKER_TICK_RATE
+
     while ( !quit )
     {
         // poll ring buffer to drive input processing
 
         int err = ring_buffer__poll( bpf.input_buffer[cpu], 1000 );
+        if ( err > 0 )
+        {
+            worker_wakeups[cpu]++;
+        }
+
+        // step and commit the players that got inputs during this poll
+
+        drain( cpu );
+
         if ( err == -EINTR )
         {
             // ctrl-c
@@ -388,6 +945,8 @@ void * worker_thread_function( void * context )
         }    
     }
 
+#endif // #if WORKER_TICK_RATE
+
     return NULL;
 }
 
@@ -403,9 +962,30 @@ int main( int argc, char *argv[] )
         return 1;
     }
 
+    simulate_kernel = simulate_init();
+
+    printf( "simulating players with the %s kernel\n", simulate_kernel_names[simulate_kernel] );
+
+    // each cpu gets its own player state arena on the numa node of that cpu
+
+    const bool numa = numa_available() >= 0;
+
+    const int num_online_cpus = sysconf( _SC_NPROCESSORS_ONLN );
+
+    printf( "player state arenas:\n" );
+
     for ( int i = 0; i < MAX_CPUS; i++ )
     {
-        cpu_player_map[i] = map_create();
+        const int numa_node = numa ? numa_node_of_cpu( i ) : -1;
+
+        cpu_player_map[i] = map_create( sizeof(struct player_t), PLAYERS_PER_CPU, numa_node );
+
+        worker[i].generation = 1;
+
+        if ( i < num_online_cpus )
+        {
+            printf( "    cpu %d: %.1fMB on numa node %d (cpu node is %d), %s pages\n", i, cpu_player_map[i]->arena_bytes / ( 1024.0 * 1024.0 ), map_arena_node( cpu_player_map[i] ), numa_node, cpu_player_map[i]->arena_huge_pages ? "2MB" : "4KB" );
+        }
     }
 
     const char * interface_name = argv[1];
@@ -437,6 +1017,7 @@ int main( int argc, char *argv[] )
     uint64_t previous_processed_inputs = 0;
     uint64_t previous_player_state_packets_sent = 0;
     uint64_t previous_lost_inputs = 0;
+    uint64_t previous_wakeups = 0;
 
     while ( !quit )
     {
@@ -473,6 +1054,49 @@ int main( int argc, char *argv[] )
         previous_player_state_packets_sent = current_player_state_packets_sent;
         previous_lost_inputs = current_lost_inputs;
 
+#if WORKER_TICK_RATE
+
+        // tick duration percentiles over the last second, worst cpu
+
+        struct tick_stats_t worst;
+        memset( &worst, 0, sizeof(worst) );
+        for ( int i = 0; i < MAX_CPUS; i++ )
+        {
+            worst.p50 = tick_stats[i].p50 > worst.p50 ? tick_stats[i].p50 : worst.p50;
+            worst.p90 = tick_stats[i].p90 > worst.p90 ? tick_stats[i].p90 : worst.p90;
+            worst.p99 = tick_stats[i].p99 > worst.p99 ? tick_stats[i].p99 : worst.p99;
+            worst.max = tick_stats[i].max > worst.max ? tick_stats[i].max : worst.max;
+        }
+        printf( "tick duration (ms): p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n", worst.p50 * 1000.0, worst.p90 * 1000.0, worst.p99 * 1000.0, worst.max * 1000.0 );
+
+#else // #if WORKER_TICK_RATE
+
+        // worker wakeups over the last second, all cpus
+
+        uint64_t current_wakeups = 0;
+        for ( int i = 0; i < MAX_CPUS; i++ )
+        {
+            current_wakeups += worker_wakeups[i];
+        }
+
+        printf( "%s poll: %" PRId64 " wakeups/sec\n", worker_poll_mode_names[WORKER_POLL_MODE], current_wakeups - previous_wakeups );
+
+        // input latency percentiles over the last INPUT_LATENCY_SAMPLES records, worst cpu
+
+        struct input_latency_stats_t worst;
+        memset( &worst, 0, sizeof(worst) );
+        for ( int i = 0; i < MAX_CPUS; i++ )
+        {
+            worst.p50 = input_latency_stats[i].p50 > worst.p50 ? input_latency_stats[i].p50 : worst.p50;
+            worst.p99 = input_latency_stats[i].p99 > worst.p99 ? input_latency_stats[i].p99 : worst.p99;
+            worst.p999 = input_latency_stats[i].p999 > worst.p999 ? input_latency_stats[i].p999 : worst.p999;
+        }
+        printf( "%s poll: input latency (us): p50 %.1f, p99 %.1f, p99.9 %.1f\n", worker_poll_mode_names[WORKER_POLL_MODE], worst.p50 / 1000.0, worst.p99 / 1000.0, worst.p999 / 1000.0 );
+
+        previous_wakeups = current_wakeups;
+
+#endif // #if WORKER_TICK_RATE
+
         // upload stats to the xdp program to be sent down to clients
 
         struct server_stats stats;
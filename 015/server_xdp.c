@@ -57,6 +57,15 @@ struct {
     __uint( pinning, LIBBPF_PIN_BY_NAME );
 } server_stats SEC(".maps");
 
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( map_flags, BPF_F_MMAPABLE );
+    __type( key, __u32 );
+    __type( value, struct worker_poll_state );
+    __uint( max_entries, MAX_CPUS );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} worker_poll_map SEC(".maps");
+
 struct inner_input_buffer_map {
     __uint( type, BPF_MAP_TYPE_RINGBUF );
     __uint( max_entries, 256 * 1024 * 1024 );
@@ -105,12 +114,27 @@ struct {
     }
 };
 
+#if PLAYER_STATE_MMAP
+
+struct inner_player_state_map {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( map_flags, BPF_F_MMAPABLE );
+    __type( key, __u32 );
+    __type( value, struct player_state_slot );
+    __uint( max_entries, PLAYERS_PER_CPU );
+} 
+
+#else // #if PLAYER_STATE_MMAP
+
 struct inner_player_state_map {
     __uint( type, BPF_MAP_TYPE_LRU_HASH );
     __type( key, __u64 );
     __type( value, struct player_state );
     __uint( max_entries, PLAYERS_PER_CPU );
 } 
+
+#endif // #if PLAYER_STATE_MMAP
+
 player_state_0 SEC(".maps"),
 player_state_1 SEC(".maps"),
 player_state_2 SEC(".maps"),
@@ -163,6 +187,17 @@ struct {
     __uint( pinning, LIBBPF_PIN_BY_NAME );
 } counters_map SEC(".maps");
 
+#if PLAYER_STATE_MMAP
+
+struct {
+    __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
+    __uint( max_entries, 1 );
+    __type( key, int );
+    __type( value, __u32 );
+} next_player_state_slot_map SEC(".maps");
+
+#endif // #if PLAYER_STATE_MMAP
+
 static void reflect_packet( void * data, int payload_bytes )
 {
     struct ethhdr * eth = data;
@@ -206,6 +241,82 @@ static __u64 get_server_time()
     return bpf_ktime_get_boot_ns();
 }
 
+#if PLAYER_STATE_MMAP
+
+static __always_inline struct player_state_slot * find_player_state_slot( void * cpu_player_state_map, __u32 * next_player_state_slot, __u32 * player_state_slot )
+{
+    // slots are handed out round robin, but a slot is only taken once the session it was given to has left the session map,
+    // or has sent no input for PLAYER_STATE_SLOT_TIMEOUT_SECONDS. an idle session is removed when its slot is taken, so it
+    // can't come back to a slot that now belongs to someone else. if the next few slots are all in use, there is no slot
+
+    const __u64 now = get_server_time();
+
+    for ( int i = 0; i < PLAYER_STATE_SLOT_PROBES; i++ )
+    {
+        __u32 index = ( *next_player_state_slot + i ) % PLAYERS_PER_CPU;
+
+        struct player_state_slot * slot = (struct player_state_slot*) bpf_map_lookup_elem( cpu_player_state_map, &index );
+        if ( !slot )
+        {
+            return NULL; // can't happen
+        }
+
+        __u64 owner = slot->session_id;
+
+        struct session_data * owner_session = owner ? (struct session_data*) bpf_map_lookup_elem( &session_map, &owner ) : NULL;
+        if ( owner_session && owner_session->player_state_slot == index )
+        {
+            if ( now - owner_session->last_input_time < PLAYER_STATE_SLOT_TIMEOUT_SECONDS * 1000000000ULL )
+            {
+                continue;
+            }
+
+            debug_printf( "session 0x%llx timed out", owner );
+
+            bpf_map_delete_elem( &session_map, &owner );
+        }
+
+        *player_state_slot = index;
+
+        return slot;
+    }
+
+    *next_player_state_slot += PLAYER_STATE_SLOT_PROBES;
+
+    return NULL;
+}
+
+#endif // #if PLAYER_STATE_MMAP
+
+static __always_inline int submit_inputs( void * input_buffer, __u8 * payload, struct session_data * session, __u64 session_id, __u64 sequence, __u64 t, __u64 wakeup_flags, const int n )
+{
+    // send n inputs down to userspace as one ring buffer record: input header followed by n input data, most recent input first
+
+    __u8 * record = bpf_ringbuf_reserve( input_buffer, INPUT_RECORD_SIZE( n ), 0 );
+    if ( !record )
+    {
+        return 0;
+    }
+
+    struct input_header * header = (struct input_header*) record;
+    header->session_id = session_id;
+    header->sequence = sequence;
+    header->t = t;
+    header->num_inputs = n;
+    header->player_state_slot = session->player_state_slot;
+    header->submit_time = bpf_ktime_get_ns();
+
+    __u8 * input_data = record + sizeof(struct input_header);
+    for ( int i = 0; i < sizeof(struct input_data) * n; i++ )
+    {
+        input_data[i] = payload[1+8+8+8+i];
+    }
+
+    bpf_ringbuf_submit( record, wakeup_flags );
+
+    return 1;
+}
+
 SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx ) 
 { 
     void * data = (void*) (long) ctx->data; 
@@ -244,9 +355,52 @@ SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx )
 
                                     struct session_data session;
                                     session.next_input_sequence = 1000;
+                                    session.player_state_slot = 0;
+                                    session.last_input_time = get_server_time();
+
+#if PLAYER_STATE_MMAP
+                                    // give a new session a player state slot on this cpu, or turn the join away if there is none free
+
+                                    struct player_state_slot * slot = NULL;
+
+                                    if ( !bpf_map_lookup_elem( &session_map, &request->session_id ) )
+                                    {
+                                        int zero = 0;
+                                        __u32 * next_player_state_slot = (__u32*) bpf_map_lookup_elem( &next_player_state_slot_map, &zero );
+                                        if ( !next_player_state_slot )
+                                        {
+                                            return XDP_DROP; // can't happen
+                                        }
+
+                                        int cpu = bpf_get_smp_processor_id();
+
+                                        void * cpu_player_state_map = bpf_map_lookup_elem( &player_state_map, &cpu );
+                                        if ( !cpu_player_state_map )
+                                        {
+                                            debug_printf( "could not find player state map for cpu %d", cpu );
+                                            return XDP_DROP;
+                                        }
+
+                                        slot = find_player_state_slot( cpu_player_state_map, next_player_state_slot, &session.player_state_slot );
+                                        if ( !slot )
+                                        {
+                                            debug_printf( "no free player state slot for session 0x%llx", request->session_id );
+                                            return XDP_DROP;
+                                        }
+
+                                        *next_player_state_slot = session.player_state_slot + 1;
+                                    }
+#endif // #if PLAYER_STATE_MMAP
+
                                     if ( bpf_map_update_elem( &session_map, &request->session_id, &session, BPF_NOEXIST ) == 0 )
                                     {
                                         debug_printf( "created session 0x%llx", request->session_id );
+#if PLAYER_STATE_MMAP
+                                        if ( slot )
+                                        {
+                                            slot->session_id = request->session_id;
+                                        }
+#endif // #if PLAYER_STATE_MMAP
                                     }
 
                                     reflect_packet( data, sizeof(struct join_response_packet) );
@@ -278,11 +432,13 @@ SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx )
                                         return XDP_DROP;
                                     }
 
+#if PLAYER_STATE_MMAP
+                                    session->last_input_time = get_server_time();
+#endif // #if PLAYER_STATE_MMAP
+
                                     // todo: try using the same processor id that packets were received on?
                                     int cpu = bpf_get_smp_processor_id();
 
-                                    // send the input(s) down to userspace via perf buffer
-
                                     __u64 sequence = (__u64) payload[9];
                                     sequence |= ( (__u64) payload[10] ) << 8;
                                     sequence |= ( (__u64) payload[11] ) << 16;
@@ -313,15 +469,13 @@ SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx )
                                     if ( sequence >= session->next_input_sequence )
                                     {
                                         __u64 n = ( sequence - session->next_input_sequence ) + 1;
-                                        if ( n > 10 )
+                                        if ( n > INPUTS_PER_PACKET )
                                         {
-                                            n = 10;
+                                            n = INPUTS_PER_PACKET;
                                         }
 
                                         debug_printf( "process input %lld (n=%d)", sequence, n );
 
-                                        session->next_input_sequence = sequence + 1;
-
                                         void * input_buffer = bpf_map_lookup_elem( &input_buffer_map, &cpu );
                                         if ( !input_buffer )
                                         {
@@ -329,106 +483,51 @@ SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx )
                                             return XDP_DROP;
                                         }
 
-                                        if ( n == 1 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) <= data_end )
-                                        {
-                                            __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + ( 8 + INPUT_SIZE ), 0 );
-                                            if ( !event )
-                                            {
-                                                debug_printf( "dropped input :(" );
-                                                return XDP_DROP;
-                                            }
-                                            
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ); i++ )
-                                            {
-                                                event[i] = payload[1+i];
-                                            }
+                                        // if the worker is spinning on the ring buffer it will see the record without a wakeup. if it has
+                                        // gone to sleep in epoll, always wake it, even if it hasn't consumed records we sent while it was spinning
 
-                                            bpf_ringbuf_submit( event, 0 );
-                                        }
-                                        // todo: update these to ringbuf
-                                        /*
-                                        else if ( n == 2 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 2 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 2; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
+                                        __u64 wakeup_flags = 0;
 
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 2 );
-                                        }
-                                        else if ( n == 3 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 3 <= data_end )
+                                        struct worker_poll_state * poll_state = (struct worker_poll_state*) bpf_map_lookup_elem( &worker_poll_map, &cpu );
+                                        if ( poll_state )
                                         {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 3; i++ )
+                                            if ( poll_state->state == WORKER_POLL_STATE_SPINNING )
                                             {
-                                                heap[i] = payload[1+i];
+                                                wakeup_flags = BPF_RB_NO_WAKEUP;
                                             }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 3 );
-                                        }
-                                        else if ( n == 4 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 4 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 4; i++ )
+                                            else if ( poll_state->state == WORKER_POLL_STATE_SLEEPING )
                                             {
-                                                heap[i] = payload[1+i];
+                                                wakeup_flags = BPF_RB_FORCE_WAKEUP;
                                             }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 4 );
                                         }
-                                        else if ( n == 5 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 5 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 5; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
 
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 5 );
-                                        }
-                                        else if ( n == 6 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 6 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 6; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
+                                        // IMPORTANT: the ring buffer reserve size must be a constant for the verifier, so each input count gets its own call site
 
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 6 );
-                                        }
-                                        else if ( n == 7 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 7 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 7; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
+                                        int result = 0;
 
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 7 );
-                                        }
-                                        else if ( n == 8 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 8 <= data_end )
+                                        switch ( n )
                                         {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 8; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 8 );
+                                            case 1:  result = submit_inputs( input_buffer, payload, session, session_id, sequence, t, wakeup_flags, 1 );  break;
+                                            case 2:  result = submit_inputs( input_buffer, payload, session, session_id, sequence, t, wakeup_flags, 2 );  break;
+                                            case 3:  result = submit_inputs( input_buffer, payload, session, session_id, sequence, t, wakeup_flags, 3 );  break;
+                                            case 4:  result = submit_inputs( input_buffer, payload, session, session_id, sequence, t, wakeup_flags, 4 );  break;
+                                            case 5:  result = submit_inputs( input_buffer, payload, session, session_id, sequence, t, wakeup_flags, 5 );  break;
+                                            case 6:  result = submit_inputs( input_buffer, payload, session, session_id, sequence, t, wakeup_flags, 6 );  break;
+                                            case 7:  result = submit_inputs( input_buffer, payload, session, session_id, sequence, t, wakeup_flags, 7 );  break;
+                                            case 8:  result = submit_inputs( input_buffer, payload, session, session_id, sequence, t, wakeup_flags, 8 );  break;
+                                            case 9:  result = submit_inputs( input_buffer, payload, session, session_id, sequence, t, wakeup_flags, 9 );  break;
+                                            case 10: result = submit_inputs( input_buffer, payload, session, session_id, sequence, t, wakeup_flags, 10 ); break;
                                         }
-                                        else if ( n == 9 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 9 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 9; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
 
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 9 );
-                                        }
-                                        else if ( n == 10 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 10 <= data_end )
+                                        if ( !result )
                                         {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 10; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 10 );
+                                            debug_printf( "dropped input :(" );
+                                            return XDP_DROP;
                                         }
-                                        */
+
+                                        // only advance once the inputs are in the ring buffer, so a failed reserve is recovered by the next packet
+
+                                        session->next_input_sequence = sequence + 1;
                                     }
                                     else
                                     {
@@ -445,20 +544,55 @@ SEC("server_xdp") int server_xdp_filter( struct xdp_md *ctx )
                                         return XDP_DROP;
                                     }
 
+#if PLAYER_STATE_MMAP
+
+                                    __u32 player_state_slot = session->player_state_slot;
+
+                                    struct player_state_slot * slot = (struct player_state_slot*) bpf_map_lookup_elem( cpu_player_state_map, &player_state_slot );
+                                    if ( !slot || slot->session_id != session_id )
+                                    {
+                                        debug_printf( "could not find player state for session 0x%llx", session_id );
+                                        return XDP_DROP;
+                                    }
+
+                                    // the worker writes state[0] while the latch sequence is odd and state[1] while it is even, so we always read the copy that is not being written.
+                                    // each copy holds the session it was written for, which is the previous owner of the slot until the worker has stepped this session
+
+                                    __u64 latch_sequence = *( (volatile __u64*) &slot->sequence );
+                                    const int latch_copy = latch_sequence & 1;
+                                    if ( latch_sequence < 2 || *( (volatile __u64*) &slot->owner[latch_copy] ) != session_id )
+                                    {
+                                        debug_printf( "no player state yet for session 0x%llx", session_id );
+                                        return XDP_DROP;
+                                    }
+
+                                    __u8 * player_state = (__u8*) &slot->state[latch_copy];
+
+#else // #if PLAYER_STATE_MMAP
+
                                     __u8 * player_state = (__u8*) bpf_map_lookup_elem( cpu_player_state_map, &session_id );
                                     if ( !player_state )
                                     {
                                         debug_printf( "could not find player state for session 0x%llx", session_id );
-                                        debug_printf( "whata the fuck 0x%llx", ( session_id >> 32 ) );
                                         return XDP_DROP;
                                     }
 
+#endif // #if PLAYER_STATE_MMAP
+
                                     payload[0] = PLAYER_STATE_PACKET;
 
                                     for ( int i = 0; i < 8 + PLAYER_STATE_SIZE; i++ )
                                     {
                                         payload[1+i] = player_state[i];
                                     }
+
+#if PLAYER_STATE_MMAP
+                                    if ( *( (volatile __u64*) &slot->sequence ) != latch_sequence || *( (volatile __u64*) &slot->owner[latch_copy] ) != session_id )
+                                    {
+                                        debug_printf( "player state changed while being read for session 0x%llx", session_id );
+                                        return XDP_DROP;
+                                    }
+#endif // #if PLAYER_STATE_MMAP
   
                                     int zero = 0;
                                     struct counters * counters = (struct counters*) bpf_map_lookup_elem( &counters_map, &zero );
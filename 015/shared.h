@@ -33,6 +33,28 @@
 
 #define PLAYER_STATE_PACKET_SIZE                                ( 1 + 8 + PLAYER_STATE_SIZE )
 
+#define PLAYER_STATE_MMAP                                                                   0
+
+#define PLAYER_STATE_SLOT_PROBES                                                            8
+
+#define PLAYER_STATE_SLOT_TIMEOUT_SECONDS                                                  15
+
+#define WORKER_TICK_RATE                                                                    0
+
+#define WORKER_POLL_EPOLL                                                                   0
+#define WORKER_POLL_BUSY                                                                    1
+#define WORKER_POLL_ADAPTIVE                                                                2
+
+#define WORKER_POLL_MODE                                                    WORKER_POLL_EPOLL
+
+#define WORKER_POLL_SPIN_US                                                                50
+
+#define INPUT_LATENCY_SAMPLES                                                           10000
+
+#define WORKER_POLL_STATE_DEFAULT                                                           0
+#define WORKER_POLL_STATE_SPINNING                                                          1
+#define WORKER_POLL_STATE_SLEEPING                                                          2
+
 #pragma pack(push, 1)
 
 struct join_request_packet
@@ -67,6 +89,8 @@ struct server_stats
 struct session_data 
 {
     __u64 next_input_sequence;
+    __u32 player_state_slot;
+    __u64 last_input_time;                  // only kept up to date with PLAYER_STATE_MMAP, an idle session gives up its slot
 };
 
 struct player_state
@@ -75,11 +99,22 @@ struct player_state
     __u8 data[PLAYER_STATE_SIZE];
 };
 
+struct player_state_slot
+{
+    __u64 session_id;                       // the session xdp gave the slot to when it joined
+    __u64 sequence;                         // latch: readers use state[sequence&1], the writer updates state[0] then state[1]
+    __u64 owner[2];                         // the session each copy of the state was written for
+    struct player_state state[2];
+};
+
 struct input_header
 {
     __u64 session_id;
     __u64 sequence;
     __u64 t;
+    __u64 num_inputs;
+    __u64 player_state_slot;
+    __u64 submit_time;                      // bpf_ktime_get_ns() when xdp submitted the record
 };
 
 struct input_data
@@ -88,6 +123,14 @@ struct input_data
     __u8 input[INPUT_SIZE];
 };
 
+#define INPUT_RECORD_SIZE(n) ( sizeof(struct input_header) + sizeof(struct input_data) * (n) )
+
+struct worker_poll_state
+{
+    __u64 state;                            // WORKER_POLL_STATE_*, written by the worker that consumes the ring buffer for this cpu
+    __u8 padding[56];
+};
+
 struct counters
 {
     __u64 player_state_packets_sent;
@@ -0,0 +1,256 @@
+
+#include "shared.h"
+
+#include <immintrin.h>
+
+/*
+    Batch player simulation.
+
+    A worker collects every player with pending inputs into a batch, then steps them all in one pass. The per-player
+    scalars are kept as structure of arrays: state t and the dt for each input step are contiguous across players,
+    so the t update is a vector add over players. Player state data stays in the map arena, one row per player, and
+    each step rewrites the row with vector stores.
+
+    There is a scalar kernel, an AVX2 kernel and an AVX-512 kernel. simulate_init picks the widest one the cpu
+    supports via cpuid. All kernels produce bit-identical player state.
+*/
+
+#define SIMULATE_BATCH_SIZE                                                               256
+#define SIMULATE_MAX_INPUTS                                         ( INPUTS_PER_PACKET * 2 )
+
+struct simulate_batch_t
+{
+    uint64_t t[SIMULATE_BATCH_SIZE];
+    uint64_t dt[SIMULATE_MAX_INPUTS][SIMULATE_BATCH_SIZE];          // oldest input first. zero past num_inputs
+    uint32_t num_inputs[SIMULATE_BATCH_SIZE];
+    struct player_state * state[SIMULATE_BATCH_SIZE];
+    int count;
+    int max_inputs;
+} __attribute__((aligned(64)));
+
+enum simulate_kernel_t
+{
+    SIMULATE_KERNEL_SCALAR,
+    SIMULATE_KERNEL_AVX2,
+    SIMULATE_KERNEL_AVX512,
+    SIMULATE_NUM_KERNELS
+};
+
+static const char * simulate_kernel_names[SIMULATE_NUM_KERNELS] = { "scalar", "avx2", "avx512" };
+
+typedef void (*simulate_function_t)( struct simulate_batch_t * batch );
+
+// iota[i] = (uint8_t) i, so a row of player state is just iota + broadcast t
+
+static uint8_t simulate_iota[PLAYER_STATE_SIZE + 64] __attribute__((aligned(64)));
+
+static void simulate_batch_reset( struct simulate_batch_t * batch )
+{
+    batch->count = 0;
+    batch->max_inputs = 0;
+}
+
+static int simulate_batch_add_dt( struct simulate_batch_t * batch, struct player_state * state, const uint64_t * dt, int num_inputs )
+{
+    // dt is oldest input first. returns the index of the player in the batch
+
+    assert( batch->count < SIMULATE_BATCH_SIZE );
+    assert( num_inputs <= SIMULATE_MAX_INPUTS );
+
+    const int index = batch->count++;
+
+    batch->state[index] = state;
+    batch->t[index] = state->t;
+    batch->num_inputs[index] = num_inputs;
+
+    // kernels only read dt rows below max_inputs, so only those rows need zero padding
+
+    if ( num_inputs > batch->max_inputs )
+    {
+        for ( int j = batch->max_inputs; j < num_inputs; j++ )
+        {
+            memset( batch->dt[j], 0, index * sizeof(uint64_t) );
+        }
+        batch->max_inputs = num_inputs;
+    }
+
+    for ( int j = 0; j < num_inputs; j++ )
+    {
+        batch->dt[j][index] = dt[j];
+    }
+
+    for ( int j = num_inputs; j < batch->max_inputs; j++ )
+    {
+        batch->dt[j][index] = 0;
+    }
+
+    return index;
+}
+
+static int simulate_batch_add( struct simulate_batch_t * batch, struct player_state * state, const struct input_data * inputs, int num_inputs )
+{
+    // inputs are most recent first, as they come from xdp
+
+    assert( num_inputs <= SIMULATE_MAX_INPUTS );
+
+    uint64_t dt[SIMULATE_MAX_INPUTS];
+    for ( int j = 0; j < num_inputs; j++ )
+    {
+        dt[j] = inputs[num_inputs-1-j].dt;
+    }
+
+    return simulate_batch_add_dt( batch, state, dt, num_inputs );
+}
+
+static void simulate_batch_scalar( struct simulate_batch_t * batch )
+{
+    for ( int j = 0; j < batch->max_inputs; j++ )
+    {
+        for ( int p = 0; p < batch->count; p++ )
+        {
+            batch->t[p] += batch->dt[j][p];
+        }
+
+        for ( int p = 0; p < batch->count; p++ )
+        {
+            if ( j >= (int) batch->num_inputs[p] )
+                continue;
+
+            uint8_t * data = batch->state[p]->data;
+            const uint8_t t = (uint8_t) batch->t[p];
+            for ( int i = 0; i < PLAYER_STATE_SIZE; i++ )
+            {
+                data[i] = t + (uint8_t) i;
+            }
+        }
+    }
+
+    for ( int p = 0; p < batch->count; p++ )
+    {
+        batch->state[p]->t = batch->t[p];
+    }
+}
+
+__attribute__((target("avx2"))) static void simulate_batch_avx2( struct simulate_batch_t * batch )
+{
+    const int count = batch->count;
+
+    for ( int j = 0; j < batch->max_inputs; j++ )
+    {
+        int p = 0;
+        for ( ; p + 4 <= count; p += 4 )
+        {
+            __m256i t = _mm256_load_si256( (__m256i*) &batch->t[p] );
+            __m256i dt = _mm256_load_si256( (__m256i*) &batch->dt[j][p] );
+            _mm256_store_si256( (__m256i*) &batch->t[p], _mm256_add_epi64( t, dt ) );
+        }
+        for ( ; p < count; p++ )
+        {
+            batch->t[p] += batch->dt[j][p];
+        }
+
+        for ( p = 0; p < count; p++ )
+        {
+            if ( j >= (int) batch->num_inputs[p] )
+                continue;
+
+            uint8_t * data = batch->state[p]->data;
+            const __m256i t = _mm256_set1_epi8( (char) batch->t[p] );
+            int i = 0;
+            for ( ; i + 32 <= PLAYER_STATE_SIZE; i += 32 )
+            {
+                __m256i iota = _mm256_load_si256( (__m256i*) &simulate_iota[i] );
+                _mm256_storeu_si256( (__m256i*) &data[i], _mm256_add_epi8( t, iota ) );
+            }
+            for ( ; i < PLAYER_STATE_SIZE; i++ )
+            {
+                data[i] = (uint8_t) batch->t[p] + (uint8_t) i;
+            }
+        }
+    }
+
+    for ( int p = 0; p < count; p++ )
+    {
+        batch->state[p]->t = batch->t[p];
+    }
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void simulate_batch_avx512( struct simulate_batch_t * batch )
+{
+    const int count = batch->count;
+
+    for ( int j = 0; j < batch->max_inputs; j++ )
+    {
+        int p = 0;
+        for ( ; p + 8 <= count; p += 8 )
+        {
+            __m512i t = _mm512_load_si512( &batch->t[p] );
+            __m512i dt = _mm512_load_si512( &batch->dt[j][p] );
+            _mm512_store_si512( &batch->t[p], _mm512_add_epi64( t, dt ) );
+        }
+        for ( ; p < count; p++ )
+        {
+            batch->t[p] += batch->dt[j][p];
+        }
+
+        for ( p = 0; p < count; p++ )
+        {
+            if ( j >= (int) batch->num_inputs[p] )
+                continue;
+
+            uint8_t * data = batch->state[p]->data;
+            const __m512i t = _mm512_set1_epi8( (char) batch->t[p] );
+            int i = 0;
+            for ( ; i + 64 <= PLAYER_STATE_SIZE; i += 64 )
+            {
+                __m512i iota = _mm512_load_si512( &simulate_iota[i] );
+                _mm512_storeu_si512( &data[i], _mm512_add_epi8( t, iota ) );
+            }
+            if ( i < PLAYER_STATE_SIZE )
+            {
+                const __mmask64 mask = _cvtu64_mask64( ( 1ULL << ( PLAYER_STATE_SIZE - i ) ) - 1 );
+                __m512i iota = _mm512_load_si512( &simulate_iota[i] );
+                _mm512_mask_storeu_epi8( &data[i], mask, _mm512_add_epi8( t, iota ) );
+            }
+        }
+    }
+
+    for ( int p = 0; p < count; p++ )
+    {
+        batch->state[p]->t = batch->t[p];
+    }
+}
+
+static simulate_function_t simulate_functions[SIMULATE_NUM_KERNELS] = { simulate_batch_scalar, simulate_batch_avx2, simulate_batch_avx512 };
+
+static bool simulate_kernel_supported( int kernel )
+{
+    __builtin_cpu_init();
+    switch ( kernel )
+    {
+        case SIMULATE_KERNEL_SCALAR:    return true;
+        case SIMULATE_KERNEL_AVX2:      return __builtin_cpu_supports( "avx2" );
+        case SIMULATE_KERNEL_AVX512:    return __builtin_cpu_supports( "avx512f" ) && __builtin_cpu_supports( "avx512bw" );
+        default:                        return false;
+    }
+}
+
+static int simulate_init()
+{
+    // returns the widest kernel this cpu supports
+
+    for ( int i = 0; i < (int) sizeof(simulate_iota); i++ )
+    {
+        simulate_iota[i] = (uint8_t) i;
+    }
+
+    for ( int kernel = SIMULATE_NUM_KERNELS - 1; kernel > SIMULATE_KERNEL_SCALAR; kernel-- )
+    {
+        if ( simulate_kernel_supported( kernel ) )
+        {
+            return kernel;
+        }
+    }
+
+    return SIMULATE_KERNEL_SCALAR;
+}
@@ -0,0 +1,587 @@
+package main
+
+import (
+	"encoding/binary"
+	"encoding/json"
+	"fmt"
+	"math"
+	"math/rand"
+	"net"
+	"os"
+	"os/signal"
+	"sort"
+	"strconv"
+	"sync"
+	"sync/atomic"
+	"syscall"
+	"time"
+)
+
+/*
+	Load generator for bench_veth.sh
+
+	Runs NUM_CLIENTS clients against SERVER_ADDRESS for DURATION seconds, then prints a JSON report to stdout.
+
+	Each player state reply carries the state time t, which the server advances to t + dt of the newest input it
+	processed, so the reply identifies the input that produced it and gives us the round trip time. It also acks
+	the newest input the server has taken, and clients only resend inputs newer than that. Clients ack the newest
+	state they have in turn, and the server sends state as a delta against it. player_state_packet_bytes is the
+	average player state packet payload.
+
+	LOSS is the percentage of input packets and of player state packets each client drops, to see how much
+	redundancy the acks leave in input packets under loss. input_packet_bytes is the average input packet payload,
+	and input_rx_kbps_per_player is what reaches the server NIC per player, with ethernet, ip and udp headers.
+
+	With JOIN_STORM set, once the clients have joined we also send that many join requests per-second for random
+	session ids and never answer the join challenge, like a flood from spoofed addresses would. Compare drop_rate
+	with the player server run with join_cookies=0 and join_cookies=1.
+
+	With FLOOD set, we also send that many full size input packets per-second for random sessions from
+	FLOOD_ADDRESS while measuring. The player server rate limits each source address, so the clients are spread
+	over CLIENT_ADDRESSES addresses starting at CLIENT_ADDRESS_BASE, to look like players on different hosts.
+
+	state_interval_p50_ms and state_interval_p99_ms are the times between player state packets arriving at a client,
+	and state_interval_jitter_ms is how far they are from the average interval on average. With the player server
+	run with state_send_rate=N, state is sent N times a second whether inputs arrive or not, so drops and drop_rate
+	no longer compare inputs with replies.
+*/
+
+const MaxPacketSize = 1384
+const SocketBufferSize = 2 * 1024 * 1024
+
+const InputSize = 100
+const InputsPerPacket = 10
+const InputHistory = 1024
+
+const PlayerDataSize = 1024
+
+const PlayerStateSize = 1000
+
+const InputTick = 1000000000 / 100
+const InputMaskBytes = (InputSize + 7) / 8
+const InputPacketMaxSize = 1 + 8 + 10*5 + 1 + 2 + (10+InputMaskBytes+InputSize)*InputsPerPacket
+const JoinRequestPacketSize = 1 + 8 + 8 + 8 + PlayerDataSize
+const JoinResponsePacketSize = 1 + 8 + 8 + 8
+const JoinChallengePacketSize = 1 + 8 + 8 + 8
+const StatsRequestPacketSize = 1 + 8 + 8
+const StatsResponsePacketSize = 1 + 8 + 8
+const PlayerStatePacketSize = 1 + 8 + PlayerStateReplyHeaderSize + PlayerStateSize
+
+const JoinRequestPacket = 1
+const JoinResponsePacket = 2
+const InputPacket = 3
+const StatsRequestPacket = 4
+const StatsResponsePacket = 5
+const PlayerStatePacket = 6
+const JoinChallengePacket = 7
+
+const MaxRTTSamples = 1000000
+const MaxIntervalSamples = 1000000
+
+const PacketHeaderBytes = 14 + 20 + 8
+
+var quit uint64
+var loss float64
+var measuring uint64
+var inputsSent uint64
+var inputBytesSent uint64
+var inputBytesDelivered uint64
+var inputPacketsDelivered uint64
+var playerStatesReceived uint64
+var playerStateBytesReceived uint64
+var serverInputsProcessed uint64
+var clientsJoined uint64
+var joinStormSent uint64
+var floodSent uint64
+
+var rttMutex sync.Mutex
+var rttSamples []float64
+
+var intervalMutex sync.Mutex
+var intervalSamples []float64
+
+type Report struct {
+	Mode                     string  `json:"mode"`
+	Clients                  int     `json:"clients"`
+	Duration                 float64 `json:"duration_seconds"`
+	Loss                     float64 `json:"loss_percent"`
+	InputsSentPerSecond      float64 `json:"inputs_sent_per_second"`
+	InputPacketBytes         float64 `json:"input_packet_bytes"`
+	InputRxKbpsPerPlayer     float64 `json:"input_rx_kbps_per_player"`
+	InputsProcessedPerSecond float64 `json:"inputs_processed_per_second"`
+	PlayerStatesPerSecond    float64 `json:"player_states_per_second"`
+	PlayerStatePacketBytes   float64 `json:"player_state_packet_bytes"`
+	ClientsJoined            uint64  `json:"clients_joined"`
+	JoinStormPerSecond       float64 `json:"join_storm_per_second"`
+	FloodPerSecond           float64 `json:"flood_per_second"`
+	Drops                    uint64  `json:"drops"`
+	DropRate                 float64 `json:"drop_rate"`
+	RTTp50                   float64 `json:"rtt_p50_ms"`
+	RTTp90                   float64 `json:"rtt_p90_ms"`
+	RTTp99                   float64 `json:"rtt_p99_ms"`
+	RTTp999                  float64 `json:"rtt_p999_ms"`
+	StateIntervalp50         float64 `json:"state_interval_p50_ms"`
+	StateIntervalp99         float64 `json:"state_interval_p99_ms"`
+	StateIntervalJitter      float64 `json:"state_interval_jitter_ms"`
+}
+
+func GetInt(name string, defaultValue int) int {
+	valueString, ok := os.LookupEnv(name)
+	if !ok {
+		return defaultValue
+	}
+	value, err := strconv.ParseInt(valueString, 10, 64)
+	if err != nil {
+		return defaultValue
+	}
+	return int(value)
+}
+
+func GetFloat(name string, defaultValue float64) float64 {
+	valueString, ok := os.LookupEnv(name)
+	if !ok {
+		return defaultValue
+	}
+	value, err := strconv.ParseFloat(valueString, 64)
+	if err != nil {
+		return defaultValue
+	}
+	return value
+}
+
+func GetString(name string, defaultValue string) string {
+	valueString, ok := os.LookupEnv(name)
+	if !ok {
+		return defaultValue
+	}
+	return valueString
+}
+
+func GetAddress(name string, defaultValue string) net.UDPAddr {
+	valueString, ok := os.LookupEnv(name)
+	if !ok {
+		valueString = defaultValue
+	}
+	value, err := net.ResolveUDPAddr("udp", valueString)
+	if err != nil {
+		panic(fmt.Sprintf("invalid address in envvar %s", name))
+	}
+	return *value
+}
+
+func percentile(sorted []float64, p float64) float64 {
+	if len(sorted) == 0 {
+		return 0
+	}
+	index := int(p * float64(len(sorted)-1))
+	return sorted[index]
+}
+
+func main() {
+
+	serverAddress := GetAddress("SERVER_ADDRESS", "127.0.0.1:40000")
+
+	numClients := GetInt("NUM_CLIENTS", 100)
+
+	warmup := GetInt("WARMUP", 5)
+
+	duration := GetInt("DURATION", 30)
+
+	mode := GetString("MODE", "ringbuf")
+
+	loss = GetFloat("LOSS", 0) / 100
+
+	joinStorm := GetInt("JOIN_STORM", 0)
+
+	flood := GetInt("FLOOD", 0)
+
+	floodAddress := net.ParseIP(GetString("FLOOD_ADDRESS", "0.0.0.0"))
+
+	clientAddressBase := net.ParseIP(GetString("CLIENT_ADDRESS_BASE", "0.0.0.0")).To4()
+
+	clientAddresses := GetInt("CLIENT_ADDRESSES", 1)
+
+	fmt.Fprintf(os.Stderr, "starting %d clients against %s for %d seconds (+%d warmup)\n", numClients, serverAddress.String(), duration, warmup)
+
+	rttSamples = make([]float64, 0, MaxRTTSamples)
+	intervalSamples = make([]float64, 0, MaxIntervalSamples)
+
+	var wg sync.WaitGroup
+
+	for i := 0; i < numClients; i++ {
+		wg.Add(1)
+		clientAddress := clientAddressBase
+		if !clientAddressBase.IsUnspecified() {
+			clientAddress = make(net.IP, 4)
+			binary.BigEndian.PutUint32(clientAddress, binary.BigEndian.Uint32(clientAddressBase)+uint32(i%clientAddresses))
+		}
+		go func(clientIndex int, clientAddress net.IP) {
+			runClient(clientIndex, clientAddress, &serverAddress)
+			wg.Done()
+		}(i, clientAddress)
+	}
+
+	termChan := make(chan os.Signal, 1)
+
+	signal.Notify(termChan, os.Interrupt, syscall.SIGTERM)
+
+	// warm up so every client has joined before we start measuring
+
+	select {
+	case <-termChan:
+		atomic.StoreUint64(&quit, 1)
+	case <-time.After(time.Duration(warmup) * time.Second):
+	}
+
+	startSent := atomic.LoadUint64(&inputsSent)
+	startBytesSent := atomic.LoadUint64(&inputBytesSent)
+	startBytesDelivered := atomic.LoadUint64(&inputBytesDelivered)
+	startPacketsDelivered := atomic.LoadUint64(&inputPacketsDelivered)
+	startReceived := atomic.LoadUint64(&playerStatesReceived)
+	startReceivedBytes := atomic.LoadUint64(&playerStateBytesReceived)
+	startProcessed := atomic.LoadUint64(&serverInputsProcessed)
+	startTime := time.Now()
+
+	atomic.StoreUint64(&measuring, 1)
+
+	if joinStorm > 0 {
+		fmt.Fprintf(os.Stderr, "join storm of %d requests per-second\n", joinStorm)
+		wg.Add(1)
+		go func() {
+			runJoinStorm(joinStorm, &serverAddress)
+			wg.Done()
+		}()
+	}
+
+	if flood > 0 {
+		fmt.Fprintf(os.Stderr, "flood of %d input packets per-second from %s\n", flood, floodAddress.String())
+		wg.Add(1)
+		go func() {
+			runFlood(flood, floodAddress, &serverAddress)
+			wg.Done()
+		}()
+	}
+
+	select {
+	case <-termChan:
+	case <-time.After(time.Duration(duration) * time.Second):
+	}
+
+	atomic.StoreUint64(&measuring, 0)
+
+	elapsed := time.Since(startTime).Seconds()
+
+	sent := atomic.LoadUint64(&inputsSent) - startSent
+	bytesSent := atomic.LoadUint64(&inputBytesSent) - startBytesSent
+	bytesDelivered := atomic.LoadUint64(&inputBytesDelivered) - startBytesDelivered
+	packetsDelivered := atomic.LoadUint64(&inputPacketsDelivered) - startPacketsDelivered
+	received := atomic.LoadUint64(&playerStatesReceived) - startReceived
+	receivedBytes := atomic.LoadUint64(&playerStateBytesReceived) - startReceivedBytes
+	processed := atomic.LoadUint64(&serverInputsProcessed) - startProcessed
+	stormSent := atomic.LoadUint64(&joinStormSent)
+	floodPackets := atomic.LoadUint64(&floodSent)
+
+	atomic.StoreUint64(&quit, 1)
+
+	wg.Wait()
+
+	rttMutex.Lock()
+	sort.Float64s(rttSamples)
+	report := Report{
+		Mode:                     mode,
+		Clients:                  numClients,
+		Duration:                 elapsed,
+		Loss:                     loss * 100,
+		InputsSentPerSecond:      float64(sent) / elapsed,
+		InputRxKbpsPerPlayer:     float64(bytesDelivered+packetsDelivered*PacketHeaderBytes) * 8 / 1000 / elapsed / float64(numClients),
+		InputsProcessedPerSecond: float64(processed) / elapsed,
+		PlayerStatesPerSecond:    float64(received) / elapsed,
+		ClientsJoined:            atomic.LoadUint64(&clientsJoined),
+		JoinStormPerSecond:       float64(stormSent) / elapsed,
+		FloodPerSecond:           float64(floodPackets) / elapsed,
+		RTTp50:                   percentile(rttSamples, 0.5),
+		RTTp90:                   percentile(rttSamples, 0.9),
+		RTTp99:                   percentile(rttSamples, 0.99),
+		RTTp999:                  percentile(rttSamples, 0.999),
+	}
+	rttMutex.Unlock()
+
+	// jitter is the mean absolute difference between a client's player state interval and the average interval
+
+	intervalMutex.Lock()
+	sort.Float64s(intervalSamples)
+	report.StateIntervalp50 = percentile(intervalSamples, 0.5)
+	report.StateIntervalp99 = percentile(intervalSamples, 0.99)
+	if len(intervalSamples) > 0 {
+		mean := 0.0
+		for _, interval := range intervalSamples {
+			mean += interval
+		}
+		mean /= float64(len(intervalSamples))
+		for _, interval := range intervalSamples {
+			report.StateIntervalJitter += math.Abs(interval - mean)
+		}
+		report.StateIntervalJitter /= float64(len(intervalSamples))
+	}
+	intervalMutex.Unlock()
+
+	if sent > 0 {
+		report.InputPacketBytes = float64(bytesSent) / float64(sent)
+	}
+
+	if received > 0 {
+		report.PlayerStatePacketBytes = float64(receivedBytes) / float64(received)
+	}
+
+	if sent > received {
+		report.Drops = sent - received
+	}
+	if sent > 0 {
+		report.DropRate = float64(report.Drops) / float64(sent)
+	}
+
+	output, _ := json.MarshalIndent(report, "", "    ")
+
+	fmt.Printf("%s\n", output)
+}
+
+func writeJoinRequestPacket(sessionId uint64, sentTime uint64, cookie uint64) []byte {
+	packet := make([]byte, JoinRequestPacketSize)
+	packet[0] = JoinRequestPacket
+	binary.LittleEndian.PutUint64(packet[1:], sessionId)
+	binary.LittleEndian.PutUint64(packet[1+8:], sentTime)
+	binary.LittleEndian.PutUint64(packet[1+8+8:], cookie)
+	return packet
+}
+
+func writeInputPacket(sessionId uint64, sequence uint64, t uint64, dt uint64, baseline uint64, numInputs int) []byte {
+
+	// see input_encoding.h. every input here is all zero, so only the masks are sent
+
+	packet := make([]byte, InputPacketMaxSize)
+	packetIndex := 0
+	packet[0] = InputPacket
+	packetIndex++
+	binary.LittleEndian.PutUint64(packet[packetIndex:], sessionId)
+	packetIndex += 8
+	packetIndex += binary.PutUvarint(packet[packetIndex:], sequence)
+	packetIndex += binary.PutUvarint(packet[packetIndex:], t/InputTick)
+	packetIndex += binary.PutUvarint(packet[packetIndex:], t%InputTick)
+	packetIndex += binary.PutUvarint(packet[packetIndex:], baseline/InputTick)
+	packetIndex += binary.PutUvarint(packet[packetIndex:], baseline%InputTick)
+	packet[packetIndex] = byte(numInputs)
+	packetIndex++
+	explicitDt := uint16(0)
+	if dt != InputTick {
+		explicitDt = (1 << numInputs) - 1
+	}
+	binary.LittleEndian.PutUint16(packet[packetIndex:], explicitDt)
+	packetIndex += 2
+	for i := 0; i < numInputs; i++ {
+		if explicitDt != 0 {
+			packetIndex += binary.PutUvarint(packet[packetIndex:], dt)
+		}
+		packetIndex += InputMaskBytes
+	}
+	return packet[:packetIndex]
+}
+
+func runClient(clientIndex int, clientAddress net.IP, serverAddress *net.UDPAddr) {
+
+	addr := net.UDPAddr{
+		Port: 0,
+		IP:   clientAddress,
+	}
+
+	conn, err := net.ListenUDP("udp", &addr)
+	if err != nil {
+		panic("could not create client")
+	}
+	defer conn.Close()
+
+	conn.SetReadBuffer(SocketBufferSize)
+	conn.SetWriteBuffer(SocketBufferSize)
+
+	dt := uint64(1000000000) / 100
+
+	var joined uint64
+
+	var acked uint64
+
+	var baseline uint64
+
+	var sendTime [InputHistory]int64
+
+	sessionId := rand.Uint64()
+
+	go func() {
+		buffer := make([]byte, MaxPacketSize)
+		playerStates := newPlayerStates()
+		lastStateTime := time.Time{}
+		for {
+			packetBytes, _, err := conn.ReadFromUDP(buffer)
+			if err != nil {
+				break
+			}
+			if packetBytes < 1 || rand.Float64() < loss {
+				continue
+			}
+			packetType := buffer[0]
+			if packetType == JoinChallengePacket && packetBytes == JoinChallengePacketSize {
+				cookie := binary.LittleEndian.Uint64(buffer[1+8+8:])
+				conn.WriteToUDP(writeJoinRequestPacket(sessionId, uint64(time.Now().UnixNano()), cookie), serverAddress)
+			} else if packetType == JoinResponsePacket && packetBytes == JoinResponsePacketSize {
+				if atomic.CompareAndSwapUint64(&joined, 0, 1) {
+					atomic.AddUint64(&clientsJoined, 1)
+				}
+			} else if packetType == StatsResponsePacket && packetBytes == StatsResponsePacketSize {
+				atomic.StoreUint64(&serverInputsProcessed, binary.LittleEndian.Uint64(buffer[1:]))
+			} else if packetType == PlayerStatePacket && packetBytes >= 1+8+PlayerStateReplyHeaderSize && packetBytes <= PlayerStatePacketSize {
+				atomic.AddUint64(&playerStatesReceived, 1)
+				atomic.AddUint64(&playerStateBytesReceived, uint64(packetBytes))
+				now := time.Now()
+				if !lastStateTime.IsZero() && atomic.LoadUint64(&measuring) != 0 {
+					interval := float64(now.Sub(lastStateTime).Microseconds()) / 1000.0
+					intervalMutex.Lock()
+					if len(intervalSamples) < MaxIntervalSamples {
+						intervalSamples = append(intervalSamples, interval)
+					}
+					intervalMutex.Unlock()
+				}
+				lastStateTime = now
+				ack := binary.LittleEndian.Uint64(buffer[1:])
+				if ack > atomic.LoadUint64(&acked) {
+					atomic.StoreUint64(&acked, ack)
+				}
+				if stateT, ok := playerStates.apply(buffer[1+8 : packetBytes]); ok && stateT > atomic.LoadUint64(&baseline) {
+					atomic.StoreUint64(&baseline, stateT)
+				}
+				t := binary.LittleEndian.Uint64(buffer[1+8+8:])
+				if t >= dt && atomic.LoadUint64(&measuring) != 0 {
+					index := ((t - dt) / dt) % InputHistory
+					sent := atomic.LoadInt64(&sendTime[index])
+					if sent != 0 {
+						rtt := float64(time.Now().UnixNano()-sent) / 1000000.0
+						rttMutex.Lock()
+						if len(rttSamples) < MaxRTTSamples {
+							rttSamples = append(rttSamples, rtt)
+						}
+						rttMutex.Unlock()
+					}
+				}
+			}
+		}
+	}()
+
+	// join. the server answers a join without a cookie with a challenge, which the reader above echoes back
+
+	for atomic.LoadUint64(&joined) == 0 {
+		if atomic.LoadUint64(&quit) != 0 {
+			return
+		}
+		conn.WriteToUDP(writeJoinRequestPacket(sessionId, uint64(time.Now().UnixNano()), 0), serverAddress)
+		time.Sleep(10 * time.Millisecond)
+	}
+
+	// send inputs at 100HZ. client 0 also requests stats once per-second
+
+	t := uint64(0)
+	sequence := uint64(1000)
+
+	ticker := time.NewTicker(10 * time.Millisecond)
+	defer ticker.Stop()
+
+	for iteration := 0; atomic.LoadUint64(&quit) == 0; iteration++ {
+		<-ticker.C
+		// resend every input the server hasn't acked, up to InputsPerPacket. until the first ack that is all of them
+
+		numInputs := InputsPerPacket
+		if unacked := sequence - atomic.LoadUint64(&acked); unacked < InputsPerPacket {
+			numInputs = int(unacked)
+		}
+		packet := writeInputPacket(sessionId, sequence, t, dt, atomic.LoadUint64(&baseline), numInputs)
+		atomic.StoreInt64(&sendTime[(t/dt)%InputHistory], time.Now().UnixNano())
+		if rand.Float64() >= loss {
+			conn.WriteToUDP(packet, serverAddress)
+			atomic.AddUint64(&inputBytesDelivered, uint64(len(packet)))
+			atomic.AddUint64(&inputPacketsDelivered, 1)
+		}
+		atomic.AddUint64(&inputsSent, 1)
+		atomic.AddUint64(&inputBytesSent, uint64(len(packet)))
+		t += dt
+		sequence++
+		if clientIndex == 0 && iteration%100 == 0 {
+			statsRequestPacket := make([]byte, StatsRequestPacketSize)
+			statsRequestPacket[0] = StatsRequestPacket
+			conn.WriteToUDP(statsRequestPacket, serverAddress)
+		}
+	}
+}
+
+func runJoinStorm(joinsPerSecond int, serverAddress *net.UDPAddr) {
+
+	addr := net.UDPAddr{
+		Port: 0,
+		IP:   net.ParseIP("0.0.0.0"),
+	}
+
+	conn, err := net.ListenUDP("udp", &addr)
+	if err != nil {
+		panic("could not create join storm socket")
+	}
+	defer conn.Close()
+
+	conn.SetWriteBuffer(SocketBufferSize)
+
+	// send in bursts every millisecond. if we can't keep up, join_storm_per_second in the report shows what we managed
+
+	joinsPerTick := (joinsPerSecond + 999) / 1000
+
+	packet := writeJoinRequestPacket(0, 0, 0)
+
+	ticker := time.NewTicker(time.Millisecond)
+	defer ticker.Stop()
+
+	for atomic.LoadUint64(&quit) == 0 && atomic.LoadUint64(&measuring) != 0 {
+		<-ticker.C
+		for i := 0; i < joinsPerTick; i++ {
+			binary.LittleEndian.PutUint64(packet[1:], rand.Uint64())
+			conn.WriteToUDP(packet, serverAddress)
+		}
+		atomic.AddUint64(&joinStormSent, uint64(joinsPerTick))
+	}
+}
+
+func runFlood(packetsPerSecond int, floodAddress net.IP, serverAddress *net.UDPAddr) {
+
+	addr := net.UDPAddr{
+		Port: 0,
+		IP:   floodAddress,
+	}
+
+	conn, err := net.ListenUDP("udp", &addr)
+	if err != nil {
+		panic("could not create flood socket")
+	}
+	defer conn.Close()
+
+	conn.SetWriteBuffer(SocketBufferSize)
+
+	// input packets for sessions that don't exist. without a first stage, each one costs the server a session lookup
+
+	packetsPerTick := (packetsPerSecond + 999) / 1000
+
+	packet := writeInputPacket(0, 1000, 0, 0, 0, InputsPerPacket)
+
+	ticker := time.NewTicker(time.Millisecond)
+	defer ticker.Stop()
+
+	for atomic.LoadUint64(&quit) == 0 && atomic.LoadUint64(&measuring) != 0 {
+		<-ticker.C
+		for i := 0; i < packetsPerTick; i++ {
+			binary.LittleEndian.PutUint64(packet[1:], rand.Uint64())
+			conn.WriteToUDP(packet, serverAddress)
+		}
+		atomic.AddUint64(&floodSent, uint64(packetsPerTick))
+	}
+}
@@ -0,0 +1,551 @@
+/*
+    Player state handoff benchmark
+
+    Runs the player update loop from 009/server.c on 1..N cpus and measures how fast each worker can hand its
+    updated player state over to the kernel, with each of these strategies:
+
+        lru_hash        bpf_map_update_elem per-player into a BPF_MAP_TYPE_LRU_HASH (what the player server does)
+        hash            bpf_map_update_elem per-player into a BPF_MAP_TYPE_HASH
+        lru_hash_batch  simulate every player, then one bpf_map_update_batch into a BPF_MAP_TYPE_LRU_HASH
+        mmap_array      memcpy into a BPF_F_MMAPABLE array through the latch (see PLAYER_STATE_MMAP)
+        user_ringbuf    reserve/submit into a BPF_MAP_TYPE_USER_RINGBUF, drained by bench_handoff_xdp.o
+
+    Each worker thread is pinned to its own cpu and owns its own map, just like the player server workers. The user
+    ring buffer is drained on the worker cpu by running the drain program with BPF_PROG_TEST_RUN whenever the ring
+    fills up, so that cost is included.
+
+    USAGE:
+
+        make bench_handoff && sudo ./bench_handoff [players per-cpu] [player state size] [max cpus] [seconds]
+*/
+
+#define _GNU_SOURCE
+
+#include <memory.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <linux/types.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <inttypes.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+#include "shared.h"
+#include "bench_handoff.h"
+
+#define BENCH_MAX_CPUS                                                                      256
+
+enum bench_strategy_t
+{
+    BENCH_STRATEGY_LRU_HASH,
+    BENCH_STRATEGY_HASH,
+    BENCH_STRATEGY_LRU_HASH_BATCH,
+    BENCH_STRATEGY_MMAP_ARRAY,
+    BENCH_STRATEGY_USER_RINGBUF,
+    BENCH_NUM_STRATEGIES
+};
+
+static const char * strategy_names[BENCH_NUM_STRATEGIES] = { "lru_hash", "hash", "lru_hash_batch", "mmap_array", "user_ringbuf" };
+
+static int players_per_cpu = PLAYERS_PER_CPU;
+static int player_state_size = PLAYER_STATE_SIZE;
+
+static volatile int quit;
+
+struct bench_worker_t
+{
+    pthread_t thread;
+    int cpu;
+    int strategy;
+    int result;
+
+    // the simulated player state for each player, stored as [t][data] with stride state_size
+
+    int state_size;
+    uint8_t * states;
+    uint64_t * session_ids;
+
+    // kernel side of the handoff for this strategy
+
+    int map_fd;
+    uint8_t * slots;
+    size_t slots_size;
+    int slot_size;
+    struct bpf_object * object;
+    int drain_fd;
+    struct user_ring_buffer * user_ringbuf;
+
+    uint64_t updates;
+} __attribute__((aligned(64)));
+
+static double platform_time()
+{
+    struct timespec ts;
+    clock_gettime( CLOCK_MONOTONIC_RAW, &ts );
+    return ts.tv_sec + ( (double) ( ts.tv_nsec ) ) / 1000000000.0;
+}
+
+static void simulate_player( uint8_t * state, int size )
+{
+    // same work as the 009 server: advance t and touch every byte of player state
+
+    const uint64_t dt = 1000000000 / 100;
+
+    uint64_t t;
+    memcpy( &t, state, 8 );
+    t += dt;
+    memcpy( state, &t, 8 );
+
+    uint8_t * data = state + 8;
+    for ( int i = 0; i < size; i++ )
+    {
+        data[i] ^= (uint8_t) t + (uint8_t) i;
+    }
+}
+
+static void publish_slot( uint8_t * slot, uint64_t session_id, const uint8_t * state, int state_size )
+{
+    // slot is [session_id][sequence][owner 0][owner 1][state 0][state 1]. see publish_player_state in 015/server.c
+
+    uint64_t * slot_session_id = (uint64_t*) slot;
+    uint64_t * sequence = (uint64_t*) ( slot + 8 );
+    uint64_t * owner = (uint64_t*) ( slot + 16 );
+    uint8_t * state_0 = slot + 32;
+    uint8_t * state_1 = state_0 + state_size;
+
+    *slot_session_id = session_id;
+
+    __atomic_fetch_add( sequence, 1, __ATOMIC_RELEASE );
+    owner[0] = session_id;
+    memcpy( state_0, state, state_size );
+    __atomic_fetch_add( sequence, 1, __ATOMIC_RELEASE );
+    owner[1] = session_id;
+    memcpy( state_1, state, state_size );
+}
+
+static int drain_user_ringbuf( struct bench_worker_t * worker )
+{
+    uint8_t packet[64];
+    memset( packet, 0, sizeof(packet) );
+
+    LIBBPF_OPTS( bpf_test_run_opts, opts,
+        .data_in = packet,
+        .data_size_in = sizeof(packet),
+        .repeat = 1,
+    );
+
+    if ( bpf_prog_test_run_opts( worker->drain_fd, &opts ) != 0 )
+    {
+        return 1;
+    }
+
+    return 0;
+}
+
+static int worker_init( struct bench_worker_t * worker )
+{
+    worker->state_size = 8 + player_state_size;
+
+    worker->states = (uint8_t*) calloc( players_per_cpu, worker->state_size );
+    worker->session_ids = (uint64_t*) malloc( players_per_cpu * sizeof(uint64_t) );
+    if ( !worker->states || !worker->session_ids )
+    {
+        printf( "\nerror: out of memory\n\n" );
+        return 1;
+    }
+
+    for ( int i = 0; i < players_per_cpu; i++ )
+    {
+        worker->session_ids[i] = ( (uint64_t) worker->cpu << 32 ) | (uint64_t) i;
+    }
+
+    worker->drain_fd = -1;
+
+    switch ( worker->strategy )
+    {
+        case BENCH_STRATEGY_LRU_HASH:
+        case BENCH_STRATEGY_LRU_HASH_BATCH:
+        case BENCH_STRATEGY_HASH:
+        {
+            const int type = ( worker->strategy == BENCH_STRATEGY_HASH ) ? BPF_MAP_TYPE_HASH : BPF_MAP_TYPE_LRU_HASH;
+            worker->map_fd = bpf_map_create( type, "bench_handoff", sizeof(uint64_t), worker->state_size, players_per_cpu, NULL );
+            if ( worker->map_fd < 0 )
+            {
+                printf( "\nerror: could not create %s map: %s\n\n", strategy_names[worker->strategy], strerror(errno) );
+                return 1;
+            }
+        }
+        break;
+
+        case BENCH_STRATEGY_MMAP_ARRAY:
+        {
+            worker->slot_size = ( 32 + worker->state_size * 2 + 7 ) & ~7;
+            LIBBPF_OPTS( bpf_map_create_opts, opts, .map_flags = BPF_F_MMAPABLE );
+            worker->map_fd = bpf_map_create( BPF_MAP_TYPE_ARRAY, "bench_handoff", sizeof(uint32_t), worker->slot_size, players_per_cpu, &opts );
+            if ( worker->map_fd < 0 )
+            {
+                printf( "\nerror: could not create mmap array: %s\n\n", strerror(errno) );
+                return 1;
+            }
+            const size_t page_size = sysconf( _SC_PAGESIZE );
+            worker->slots_size = ( (size_t) worker->slot_size * players_per_cpu + page_size - 1 ) & ~( page_size - 1 );
+            worker->slots = (uint8_t*) mmap( NULL, worker->slots_size, PROT_READ | PROT_WRITE, MAP_SHARED, worker->map_fd, 0 );
+            if ( worker->slots == MAP_FAILED )
+            {
+                worker->slots = NULL;
+                printf( "\nerror: could not mmap array: %s\n\n", strerror(errno) );
+                return 1;
+            }
+        }
+        break;
+
+        case BENCH_STRATEGY_USER_RINGBUF:
+        {
+            worker->object = bpf_object__open_file( "bench_handoff_xdp.o", NULL );
+            if ( libbpf_get_error( worker->object ) )
+            {
+                worker->object = NULL;
+                printf( "\nerror: could not open bench_handoff_xdp.o\n\n" );
+                return 1;
+            }
+
+            bpf_map__set_max_entries( bpf_object__find_map_by_name( worker->object, "player_state" ), players_per_cpu );
+
+            if ( bpf_object__load( worker->object ) != 0 )
+            {
+                printf( "\nerror: could not load bench_handoff_xdp.o\n\n" );
+                return 1;
+            }
+
+            worker->drain_fd = bpf_program__fd( bpf_object__find_program_by_name( worker->object, "bench_handoff_drain" ) );
+            worker->map_fd = bpf_map__fd( bpf_object__find_map_by_name( worker->object, "user_ringbuf" ) );
+
+            worker->user_ringbuf = user_ring_buffer__new( worker->map_fd, NULL );
+            if ( !worker->user_ringbuf )
+            {
+                printf( "\nerror: could not create user ring buffer: %s\n\n", strerror(errno) );
+                return 1;
+            }
+        }
+        break;
+    }
+
+    return 0;
+}
+
+static void worker_shutdown( struct bench_worker_t * worker )
+{
+    if ( worker->user_ringbuf )
+    {
+        user_ring_buffer__free( worker->user_ringbuf );
+    }
+    if ( worker->object )
+    {
+        bpf_object__close( worker->object );
+    }
+    if ( worker->slots )
+    {
+        munmap( worker->slots, worker->slots_size );
+    }
+    if ( worker->map_fd >= 0 && worker->strategy != BENCH_STRATEGY_USER_RINGBUF )
+    {
+        close( worker->map_fd );
+    }
+    free( worker->states );
+    free( worker->session_ids );
+}
+
+static int worker_update( struct bench_worker_t * worker )
+{
+    const int state_size = worker->state_size;
+
+    switch ( worker->strategy )
+    {
+        case BENCH_STRATEGY_LRU_HASH:
+        case BENCH_STRATEGY_HASH:
+        {
+            for ( int i = 0; i < players_per_cpu; i++ )
+            {
+                uint8_t * state = worker->states + (size_t) i * state_size;
+                simulate_player( state, player_state_size );
+                if ( bpf_map_update_elem( worker->map_fd, &worker->session_ids[i], state, BPF_ANY ) != 0 )
+                {
+                    printf( "\nerror: map update failed: %s\n\n", strerror(errno) );
+                    return 1;
+                }
+            }
+        }
+        break;
+
+        case BENCH_STRATEGY_LRU_HASH_BATCH:
+        {
+            for ( int i = 0; i < players_per_cpu; i++ )
+            {
+                simulate_player( worker->states + (size_t) i * state_size, player_state_size );
+            }
+            uint32_t count = players_per_cpu;
+            if ( bpf_map_update_batch( worker->map_fd, worker->session_ids, worker->states, &count, NULL ) != 0 )
+            {
+                printf( "\nerror: map update batch failed: %s\n\n", strerror(errno) );
+                return 1;
+            }
+        }
+        break;
+
+        case BENCH_STRATEGY_MMAP_ARRAY:
+        {
+            for ( int i = 0; i < players_per_cpu; i++ )
+            {
+                uint8_t * state = worker->states + (size_t) i * state_size;
+                simulate_player( state, player_state_size );
+                publish_slot( worker->slots + (size_t) i * worker->slot_size, worker->session_ids[i], state, state_size );
+            }
+        }
+        break;
+
+        case BENCH_STRATEGY_USER_RINGBUF:
+        {
+            const uint32_t sample_size = sizeof(struct bench_update_header) + state_size;
+            for ( int i = 0; i < players_per_cpu; i++ )
+            {
+                uint8_t * state = worker->states + (size_t) i * state_size;
+                simulate_player( state, player_state_size );
+
+                void * sample = user_ring_buffer__reserve( worker->user_ringbuf, sample_size );
+                if ( !sample )
+                {
+                    // ring is full. drain it in the kernel and try again
+
+                    if ( drain_user_ringbuf( worker ) != 0 )
+                    {
+                        printf( "\nerror: user ring buffer drain failed: %s\n\n", strerror(errno) );
+                        return 1;
+                    }
+
+                    sample = user_ring_buffer__reserve( worker->user_ringbuf, sample_size );
+                    if ( !sample )
+                    {
+                        printf( "\nerror: could not reserve user ring buffer sample: %s\n\n", strerror(errno) );
+                        return 1;
+                    }
+                }
+
+                struct bench_update_header * header = (struct bench_update_header*) sample;
+                header->index = i;
+                header->size = state_size;
+                memcpy( (uint8_t*) sample + sizeof(struct bench_update_header), state, state_size );
+
+                user_ring_buffer__submit( worker->user_ringbuf, sample );
+            }
+        }
+        break;
+    }
+
+    __atomic_fetch_add( &worker->updates, players_per_cpu, __ATOMIC_RELAXED );
+
+    return 0;
+}
+
+static void * worker_thread_function( void * context )
+{
+    struct bench_worker_t * worker = (struct bench_worker_t*) context;
+
+    cpu_set_t cpuset;
+    CPU_ZERO( &cpuset );
+    CPU_SET( worker->cpu, &cpuset );
+    pthread_setaffinity_np( pthread_self(), sizeof(cpu_set_t), &cpuset );
+
+    while ( !quit )
+    {
+        if ( worker_update( worker ) != 0 )
+        {
+            worker->result = 1;
+            break;
+        }
+    }
+
+    return NULL;
+}
+
+static int run_strategy( int strategy, int num_cpus, double seconds, double * updates_per_second )
+{
+    static struct bench_worker_t workers[BENCH_MAX_CPUS];
+
+    memset( workers, 0, sizeof(workers) );
+
+    int result = 0;
+
+    for ( int i = 0; i < num_cpus; i++ )
+    {
+        workers[i].map_fd = -1;
+    }
+
+    for ( int i = 0; i < num_cpus; i++ )
+    {
+        workers[i].cpu = i;
+        workers[i].strategy = strategy;
+        if ( worker_init( &workers[i] ) != 0 )
+        {
+            result = 1;
+            goto cleanup;
+        }
+    }
+
+    quit = 0;
+
+    for ( int i = 0; i < num_cpus; i++ )
+    {
+        if ( pthread_create( &workers[i].thread, NULL, worker_thread_function, &workers[i] ) != 0 )
+        {
+            printf( "\nerror: could not create worker thread\n\n" );
+            quit = 1;
+            for ( int j = 0; j < i; j++ )
+            {
+                pthread_join( workers[j].thread, NULL );
+            }
+            result = 1;
+            goto cleanup;
+        }
+    }
+
+    // let every worker warm up its map before we start measuring
+
+    usleep( 500000 );
+
+    uint64_t start_updates = 0;
+    for ( int i = 0; i < num_cpus; i++ )
+    {
+        start_updates += __atomic_load_n( &workers[i].updates, __ATOMIC_RELAXED );
+    }
+
+    double start_time = platform_time();
+
+    usleep( (int) ( seconds * 1000000 ) );
+
+    uint64_t finish_updates = 0;
+    for ( int i = 0; i < num_cpus; i++ )
+    {
+        finish_updates += __atomic_load_n( &workers[i].updates, __ATOMIC_RELAXED );
+    }
+
+    double finish_time = platform_time();
+
+    quit = 1;
+
+    for ( int i = 0; i < num_cpus; i++ )
+    {
+        pthread_join( workers[i].thread, NULL );
+        if ( workers[i].result != 0 )
+        {
+            result = 1;
+        }
+    }
+
+    *updates_per_second = ( finish_updates - start_updates ) / ( finish_time - start_time );
+
+cleanup:
+
+    for ( int i = 0; i < num_cpus; i++ )
+    {
+        worker_shutdown( &workers[i] );
+    }
+
+    return result;
+}
+
+int main( int argc, char *argv[] )
+{
+    int max_cpus = MAX_CPUS;
+    double seconds = 5.0;
+
+    if ( argc > 1 ) players_per_cpu = atoi( argv[1] );
+    if ( argc > 2 ) player_state_size = atoi( argv[2] );
+    if ( argc > 3 ) max_cpus = atoi( argv[3] );
+    if ( argc > 4 ) seconds = atof( argv[4] );
+
+    if ( argc > 5 || players_per_cpu <= 0 || player_state_size <= 0 || player_state_size > BENCH_MAX_STATE_SIZE || max_cpus <= 0 || seconds <= 0.0 )
+    {
+        printf( "\nusage: bench_handoff [players per-cpu] [player state size <= %d] [max cpus] [seconds]\n\n", BENCH_MAX_STATE_SIZE );
+        return 1;
+    }
+
+    if ( geteuid() != 0 )
+    {
+        printf( "\nerror: this program must be run as root\n\n" );
+        return 1;
+    }
+
+    struct rlimit rlim_new = {
+        .rlim_cur   = RLIM_INFINITY,
+        .rlim_max   = RLIM_INFINITY,
+    };
+
+    if ( setrlimit( RLIMIT_MEMLOCK, &rlim_new ) )
+    {
+        printf( "\nerror: could not increase RLIMIT_MEMLOCK limit!\n\n" );
+        return 1;
+    }
+
+    int num_cpus = (int) sysconf( _SC_NPROCESSORS_ONLN );
+    if ( max_cpus > num_cpus )
+    {
+        max_cpus = num_cpus;
+    }
+    if ( max_cpus > BENCH_MAX_CPUS )
+    {
+        max_cpus = BENCH_MAX_CPUS;
+    }
+
+    // 1, 2, 4 ... up to max cpus, always including max cpus itself
+
+    int cpu_counts[32];
+    int num_cpu_counts = 0;
+    for ( int n = 1; n < max_cpus; n *= 2 )
+    {
+        cpu_counts[num_cpu_counts++] = n;
+    }
+    cpu_counts[num_cpu_counts++] = max_cpus;
+
+    printf( "players per-cpu: %d, player state size: %d bytes, %.1f seconds per run\n\n", players_per_cpu, player_state_size, seconds );
+
+    printf( "%-16s %6s %18s %18s %10s\n", "strategy", "cpus", "updates/sec", "updates/sec/cpu", "scaling" );
+
+    for ( int strategy = 0; strategy < BENCH_NUM_STRATEGIES; strategy++ )
+    {
+        double single_cpu = 0.0;
+
+        for ( int i = 0; i < num_cpu_counts; i++ )
+        {
+            double updates_per_second = 0.0;
+
+            if ( run_strategy( strategy, cpu_counts[i], seconds, &updates_per_second ) != 0 )
+            {
+                printf( "%-16s %6d %18s\n", strategy_names[strategy], cpu_counts[i], "failed" );
+                break;
+            }
+
+            if ( i == 0 )
+            {
+                single_cpu = updates_per_second;
+            }
+
+            const double per_cpu = updates_per_second / cpu_counts[i];
+
+            printf( "%-16s %6d %18.0f %18.0f %9.2fx\n", strategy_names[strategy], cpu_counts[i], updates_per_second, per_cpu, single_cpu > 0.0 ? updates_per_second / single_cpu : 0.0 );
+
+            fflush( stdout );
+        }
+
+        printf( "\n" );
+    }
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+/*
+    Shared definitions between the handoff benchmark and its XDP program.
+*/
+
+#ifndef BENCH_HANDOFF_H
+#define BENCH_HANDOFF_H
+
+#define BENCH_MAX_STATE_SIZE                                                             4096
+
+#define BENCH_USER_RINGBUF_SIZE                                              ( 16 * 1024 * 1024 )
+
+#pragma pack(push, 1)
+
+struct bench_update_header
+{
+    __u32 index;
+    __u32 size;
+};
+
+struct bench_player_state
+{
+    __u8 data[8 + BENCH_MAX_STATE_SIZE];
+};
+
+#pragma pack(pop)
+
+#endif // #ifndef BENCH_HANDOFF_H
@@ -0,0 +1,63 @@
+/*
+    Player state handoff benchmark XDP program
+
+    Drains player state updates from a BPF user ring buffer into an array, so bench_handoff can measure the
+    user ring buffer handoff. bench_handoff loads one copy per worker thread and runs it with BPF_PROG_TEST_RUN.
+
+    USAGE:
+
+        clang -Ilibbpf/src -g -O2 -target bpf -c bench_handoff_xdp.c -o bench_handoff_xdp.o
+*/
+
+#include <linux/bpf.h>
+#include <bpf/bpf_helpers.h>
+
+#include "bench_handoff.h"
+
+struct {
+    __uint( type, BPF_MAP_TYPE_USER_RINGBUF );
+    __uint( max_entries, BENCH_USER_RINGBUF_SIZE );
+} user_ringbuf SEC(".maps");
+
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( max_entries, 1 );
+    __type( key, __u32 );
+    __type( value, struct bench_player_state );
+} player_state SEC(".maps");
+
+static long drain_player_state( struct bpf_dynptr * dynptr, void * context )
+{
+    struct bench_update_header header;
+    if ( bpf_dynptr_read( &header, sizeof(header), dynptr, 0, 0 ) != 0 )
+    {
+        return 1;
+    }
+
+    __u32 index = header.index;
+
+    struct bench_player_state * state = (struct bench_player_state*) bpf_map_lookup_elem( &player_state, &index );
+    if ( !state )
+    {
+        return 0;
+    }
+
+    __u32 size = header.size;
+    if ( size > sizeof(struct bench_player_state) )
+    {
+        size = sizeof(struct bench_player_state);
+    }
+
+    bpf_dynptr_read( state->data, size, dynptr, sizeof(header), 0 );
+
+    return 0;
+}
+
+SEC("xdp") int bench_handoff_drain( struct xdp_md *ctx )
+{
+    bpf_user_ringbuf_drain( &user_ringbuf, drain_player_state, NULL, 0 );
+
+    return XDP_PASS;
+}
+
+char _license[] SEC("license") = "GPL";
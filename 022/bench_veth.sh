@@ -0,0 +1,142 @@
+#!/bin/bash
+#
+#   End to end benchmark over a veth pair, no NIC or network access required.
+#
+#   The player server side of the veth pair stays in the root namespace and runs player_server_xdp.o in native
+#   veth XDP mode, plus player_server, its workers, the world server and a zone database. The other side lives in
+#   its own network namespace and runs bench_client, which prints a JSON report when it finishes.
+#
+#   USAGE:
+#
+#       make && sudo ./bench_veth.sh [ringbuf|xsk] > bench_output.json
+#
+#   Environment: NUM_CLIENTS (default 1000), DURATION in seconds (default 30), QUEUES (default: number of cpus)
+#
+#   Join storm: JOIN_STORM sends that many join requests per-second for random sessions while measuring (default 0),
+#   and JOIN_COOKIES (default 1) turns the join challenge on or off in the player server. For before and after:
+#
+#       sudo JOIN_STORM=200000 JOIN_COOKIES=0 RATE_LIMIT=0 ./bench_veth.sh > join_storm_off.json
+#       sudo JOIN_STORM=200000 JOIN_COOKIES=1 RATE_LIMIT=0 ./bench_veth.sh > join_storm_on.json
+#
+#   then compare drop_rate and join_storm_per_second. The storm comes from one address, so the rate limit is off.
+#
+#   Flood: FLOOD sends that many input packets per-second for random sessions from FLOOD_ADDRESS while measuring
+#   (default 0). RATE_LIMIT sets the player server's per-source rate limit, 0 turns it off, and FLOOD_BLOCK=1
+#   blocklists the flood address. Legitimate throughput should hold steady with the rate limit or blocklist on:
+#
+#       sudo FLOOD=500000 RATE_LIMIT=0 ./bench_veth.sh > flood_unlimited.json
+#       sudo FLOOD=500000 ./bench_veth.sh > flood_rate_limited.json
+#       sudo FLOOD=500000 FLOOD_BLOCK=1 ./bench_veth.sh > flood_blocked.json
+#
+#   then compare inputs_processed_per_second, player_states_per_second and drop_rate with a run without FLOOD.
+#   Clients are spread over CLIENT_ADDRESSES source addresses (default: one per 4 clients, up to 250), so each
+#   stays under the rate limit like players on different hosts would.
+#
+#   Loss: LOSS is the percentage of input and player state packets the clients drop (default 0). It is simulated
+#   in bench_client, since XDP_TX replies skip the qdisc, so netem on the veth could only drop inputs. Compare
+#   input_packet_bytes and input_rx_kbps_per_player for LOSS=0, LOSS=1 and LOSS=5.
+#
+#   Player state: player_state_packet_bytes is the average player state reply, which workers send as a delta against
+#   the last state the client acked. player_server prints replies per-second and bytes per reply for each cpu.
+#
+#   Paced state: STATE_SEND_RATE=N has the workers send player state N times a second with sendmmsg, instead of
+#   XDP_TX replies to each input (ringbuf mode only). Each worker prints packets/sec and packets per sendmmsg, and
+#   compare state_interval_p99_ms and state_interval_jitter_ms with a run without it:
+#
+#       sudo STATE_SEND_RATE=100 ./bench_veth.sh > paced.json
+#
+#   For the mmap variant set PLAYER_STATE_MMAP to 1 in shared.h and rebuild.
+#   For the user ring buffer variant set PLAYER_STATE_USER_RINGBUF to 1 instead. player_server prints player
+#   state commits per-second for each cpu, as xdp drains them.
+#
+
+set -e
+
+MODE=${1:-ringbuf}
+NUM_CLIENTS=${NUM_CLIENTS:-1000}
+DURATION=${DURATION:-30}
+QUEUES=${QUEUES:-$(nproc)}
+JOIN_STORM=${JOIN_STORM:-0}
+JOIN_COOKIES=${JOIN_COOKIES:-1}
+FLOOD=${FLOOD:-0}
+LOSS=${LOSS:-0}
+FLOOD_BLOCK=${FLOOD_BLOCK:-0}
+CLIENT_ADDRESSES=${CLIENT_ADDRESSES:-$(( ( NUM_CLIENTS + 3 ) / 4 > 250 ? 250 : ( NUM_CLIENTS + 3 ) / 4 ))}
+
+NAMESPACE=fps_bench
+SERVER_INTERFACE=fps_server
+CLIENT_INTERFACE=fps_client
+SERVER_ADDRESS=10.77.0.1
+CLIENT_ADDRESS=10.77.0.2
+FLOOD_ADDRESS=10.77.0.3
+CLIENT_ADDRESS_BASE=10.77.1.1
+
+PIDS=()
+
+cleanup() {
+    for pid in "${PIDS[@]}"; do
+        kill -INT $pid 2>/dev/null || true
+    done
+    pkill -INT player_server_worker 2>/dev/null || true
+    sleep 1
+    ip link del $SERVER_INTERFACE 2>/dev/null || true
+    ip netns del $NAMESPACE 2>/dev/null || true
+    rm -f /sys/fs/bpf/blocklist_map
+}
+
+trap cleanup EXIT
+
+if [ "$(id -u)" != "0" ]; then
+    echo "error: this script must be run as root" >&2
+    exit 1
+fi
+
+# create the veth pair with one queue per cpu, and move the client side into its own namespace
+
+ip netns add $NAMESPACE
+ip link add $SERVER_INTERFACE numrxqueues $QUEUES numtxqueues $QUEUES type veth peer name $CLIENT_INTERFACE numrxqueues $QUEUES numtxqueues $QUEUES
+ip link set $CLIENT_INTERFACE netns $NAMESPACE
+
+ip addr add $SERVER_ADDRESS/24 dev $SERVER_INTERFACE
+ip link set $SERVER_INTERFACE up
+
+ip netns exec $NAMESPACE ip addr add $CLIENT_ADDRESS/24 dev $CLIENT_INTERFACE
+ip netns exec $NAMESPACE ip addr add $FLOOD_ADDRESS/32 dev $CLIENT_INTERFACE
+for i in $(seq 1 $CLIENT_ADDRESSES); do
+    ip netns exec $NAMESPACE ip addr add 10.77.1.$i/32 dev $CLIENT_INTERFACE
+done
+ip netns exec $NAMESPACE ip link set $CLIENT_INTERFACE up
+ip netns exec $NAMESPACE ip link set lo up
+
+# XDP_TX on a veth needs napi on the peer, which is enabled by turning on gro
+
+ip netns exec $NAMESPACE ethtool -K $CLIENT_INTERFACE gro on >/dev/null
+
+# start the server side
+
+SERVER_ARGS="join_cookies=$JOIN_COOKIES debug=0"
+if [ -n "$RATE_LIMIT" ]; then
+    SERVER_ARGS="$SERVER_ARGS rate_limit=$RATE_LIMIT"
+fi
+if [ -n "$STATE_SEND_RATE" ]; then
+    SERVER_ARGS="$SERVER_ARGS state_send_rate=$STATE_SEND_RATE"
+fi
+if [ "$FLOOD_BLOCK" == "1" ]; then
+    SERVER_ARGS="$SERVER_ARGS block=$FLOOD_ADDRESS/32"
+fi
+
+./world_server >&2 &
+PIDS+=($!)
+sleep 1
+
+./zone_database >&2 &
+PIDS+=($!)
+sleep 1
+
+./player_server $SERVER_INTERFACE $MODE $SERVER_ARGS >&2 &
+PIDS+=($!)
+sleep 5
+
+# run the load generator on the client side and wait for the report
+
+ip netns exec $NAMESPACE env SERVER_ADDRESS=$SERVER_ADDRESS:40000 NUM_CLIENTS=$NUM_CLIENTS DURATION=$DURATION MODE=$MODE LOSS=$LOSS JOIN_STORM=$JOIN_STORM FLOOD=$FLOOD FLOOD_ADDRESS=$FLOOD_ADDRESS CLIENT_ADDRESS_BASE=$CLIENT_ADDRESS_BASE CLIENT_ADDRESSES=$CLIENT_ADDRESSES ./bench_client
@@ -0,0 +1,670 @@
+/*
+    XDP fast path micro-benchmark
+
+    Loads three builds of the XDP program with their maps pinned under /sys/fs/bpf/bench_xdp so a running player
+    server is not disturbed, pre-populates the session and player state maps, then runs server_xdp_filter over
+    synthetic packets with BPF_PROG_TEST_RUN:
+
+        hardcoded       player_server_xdp_hardcoded.o, with the deployment parameters as compile time constants
+                        (RODATA_CONFIG 0, DEBUG 0)
+        rodata          the player_server_xdp skeleton with debug set to 0 in .rodata, the way player_server loads it
+        rodata debug    the same with debug set to 1
+
+    The program rewrites each packet in place (reflect, adjust tail) and advances the session input sequence, so
+    a test run with repeat > 1 would only measure the first iteration on the intended path. Instead each iteration
+    resets the state it depends on and runs once, and we sum the in-kernel duration reported by the test run, which
+    excludes the syscall.
+
+    USAGE:
+
+        make bench_xdp && sudo ./bench_xdp [iterations]
+*/
+
+#define _GNU_SOURCE
+
+#include <memory.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <unistd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+#include <sys/resource.h>
+#include <inttypes.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <time.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include "shared.h"
+#include "cpu_maps.h"
+#include "join_cookie.h"
+#include "input_encoding.h"
+#include "player_server_xdp.skel.h"
+
+#define BENCH_PIN_PATH                                                  "/sys/fs/bpf/bench_xdp"
+#define BENCH_INPUT_BUFFER_SIZE                                              ( 16 * 1024 * 1024 )
+#define BENCH_SESSION_ID                                                   0x1122334455667788ULL
+#define BENCH_SEQUENCE                                                                   100000
+#define BENCH_MAX_PACKET_SIZE                                                              2048
+#define BENCH_CLIENT_ADDRESS                                                         0x0A000002
+#define BENCH_CLIENT_PORT                                                                 50000
+#define BENCH_BLOCKED_ADDRESS                                                        0x0A000003
+
+static const struct join_cookie_key bench_join_cookie_key = { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL };
+
+enum bench_reset_t
+{
+    BENCH_RESET_NONE,
+    BENCH_RESET_SESSION,
+    BENCH_RESET_NO_SESSION,
+};
+
+struct bench_packet_t
+{
+    char name[64];
+    uint8_t data[BENCH_MAX_PACKET_SIZE];
+    int bytes;
+    int reset;
+    int num_inputs;
+    bool join_cookie;               // sign the join request with a cookie for the current time bucket before running it
+    bool rate_limited;              // run with the source out of tokens. otherwise its bucket is full
+};
+
+struct bench_variant_t
+{
+    const char * name;
+    const char * filename;          // NULL for the skeleton
+    int debug;
+};
+
+struct bench_t
+{
+    struct player_server_xdp * skel;
+    struct bpf_object * object;
+    int program_fd;
+    int session_map_fd;
+    int rate_limit_map_fd;
+    int player_state_fd;
+    int input_buffer_fd;
+    struct ring_buffer * input_buffer;
+};
+
+static int num_possible_cpus;
+
+static int write_packet( uint8_t * buffer, const uint8_t * payload, int payload_bytes, uint16_t dest_port )
+{
+    struct ethhdr * eth = (struct ethhdr*) buffer;
+    struct iphdr  * ip  = (struct iphdr*) ( buffer + sizeof(struct ethhdr) );
+    struct udphdr * udp = (struct udphdr*) ( (uint8_t*) ip + sizeof(struct iphdr) );
+
+    const uint8_t source_mac[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+    const uint8_t dest_mac[ETH_ALEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x02 };
+
+    memcpy( eth->h_source, source_mac, ETH_ALEN );
+    memcpy( eth->h_dest, dest_mac, ETH_ALEN );
+    eth->h_proto = htons( ETH_P_IP );
+
+    memset( ip, 0, sizeof(struct iphdr) );
+    ip->version = 4;
+    ip->ihl = 5;
+    ip->ttl = 64;
+    ip->protocol = IPPROTO_UDP;
+    ip->saddr = htonl( BENCH_CLIENT_ADDRESS );
+    ip->daddr = htonl( 0x0A000001 );
+    ip->tot_len = htons( sizeof(struct iphdr) + sizeof(struct udphdr) + payload_bytes );
+
+    udp->source = htons( BENCH_CLIENT_PORT );
+    udp->dest = htons( dest_port );
+    udp->len = htons( sizeof(struct udphdr) + payload_bytes );
+    udp->check = 0;
+
+    memcpy( (uint8_t*) udp + sizeof(struct udphdr), payload, payload_bytes );
+
+    return sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) + payload_bytes;
+}
+
+static int write_varint( uint8_t * buffer, uint64_t value )
+{
+    int bytes = 0;
+    while ( value >= 0x80 )
+    {
+        buffer[bytes++] = (uint8_t) value | 0x80;
+        value >>= 7;
+    }
+    buffer[bytes++] = (uint8_t) value;
+    return bytes;
+}
+
+static int write_input_packet( uint8_t * payload, uint64_t session_id, uint64_t sequence, uint64_t t, uint64_t dt, int num_inputs )
+{
+    // see input_encoding.h. each input has a few active bytes, like sticks and buttons, that differ from the last
+
+    memset( payload, 0, INPUT_PACKET_MAX_SIZE );
+
+    payload[0] = INPUT_PACKET;
+    memcpy( payload + 1, &session_id, 8 );
+
+    int index = 1 + 8;
+    index += write_varint( payload + index, sequence );
+    index += write_varint( payload + index, t / INPUT_TICK );
+    index += write_varint( payload + index, t % INPUT_TICK );
+    payload[index++] = (uint8_t) num_inputs;
+
+    const uint16_t explicit_dt = ( dt != INPUT_TICK ) ? ( 1 << num_inputs ) - 1 : 0;
+    memcpy( payload + index, &explicit_dt, 2 );
+    index += 2;
+
+    for ( int j = 0; j < num_inputs; j++ )
+    {
+        if ( explicit_dt )
+        {
+            index += write_varint( payload + index, dt );
+        }
+
+        const int mask_index = index;
+        index += INPUT_MASK_BYTES;
+
+        for ( int i = 0; i < INPUT_SIZE; i++ )
+        {
+            const uint8_t value = ( i < 4 ) ? (uint8_t) ( ( i + j + 1 ) ^ ( i + 1 ) ) : 0;       // XOR with the most recent input
+            if ( j == 0 ? i < 4 : value != 0 )
+            {
+                payload[mask_index + i / 8] |= 1 << ( i % 8 );
+                payload[index++] = ( j == 0 ) ? (uint8_t) ( i + 1 ) : value;
+            }
+        }
+    }
+
+    return index;
+}
+
+static int create_packets( struct bench_packet_t * packets )
+{
+    int num_packets = 0;
+
+    uint8_t payload[BENCH_MAX_PACKET_SIZE];
+    uint64_t session_id = BENCH_SESSION_ID;
+    uint64_t sequence = BENCH_SEQUENCE;
+    uint64_t t = 1000000;
+    uint64_t dt = 10000000;
+
+    // join request without a cookie, which is all a join flood sends, then the join that echoes the cookie and creates the session
+
+    memset( payload, 0, sizeof(payload) );
+    payload[0] = JOIN_REQUEST_PACKET;
+    memcpy( payload + 1, &session_id, 8 );
+    strcpy( packets[num_packets].name, "join (challenge)" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, JOIN_REQUEST_PACKET_SIZE, SERVER_PORT );
+    packets[num_packets].reset = BENCH_RESET_NO_SESSION;
+    num_packets++;
+
+    strcpy( packets[num_packets].name, "join (cookie)" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, JOIN_REQUEST_PACKET_SIZE, SERVER_PORT );
+    packets[num_packets].reset = BENCH_RESET_NO_SESSION;
+    packets[num_packets].join_cookie = true;
+    num_packets++;
+
+    const uint64_t bad_cookie = 1;
+    memcpy( payload + 1 + 8 + 8, &bad_cookie, 8 );
+    strcpy( packets[num_packets].name, "invalid (join cookie)" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, JOIN_REQUEST_PACKET_SIZE, SERVER_PORT );
+    packets[num_packets].reset = BENCH_RESET_NO_SESSION;
+    num_packets++;
+
+    // input packets carrying 1..INPUTS_PER_PACKET new inputs, and nothing the server has already acked
+
+    for ( int n = 1; n <= INPUTS_PER_PACKET; n++ )
+    {
+        const int payload_bytes = write_input_packet( payload, session_id, sequence, t, dt, n );
+        sprintf( packets[num_packets].name, "input (n=%d)", n );
+        packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, payload_bytes, SERVER_PORT );
+        packets[num_packets].reset = BENCH_RESET_SESSION;
+        packets[num_packets].num_inputs = n;
+        num_packets++;
+    }
+
+    // stats request
+
+    memset( payload, 0, sizeof(payload) );
+    payload[0] = STATS_REQUEST_PACKET;
+    strcpy( packets[num_packets].name, "stats" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, STATS_REQUEST_PACKET_SIZE, SERVER_PORT );
+    packets[num_packets].reset = BENCH_RESET_NONE;
+    num_packets++;
+
+    // invalid packets
+
+    const int input_packet_bytes = write_input_packet( payload, session_id, sequence, t, dt, INPUTS_PER_PACKET );
+    strcpy( packets[num_packets].name, "invalid (old input)" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, input_packet_bytes, SERVER_PORT );
+    packets[num_packets].reset = BENCH_RESET_SESSION;
+    packets[num_packets].num_inputs = 0;
+    num_packets++;
+
+    strcpy( packets[num_packets].name, "invalid (input encoding)" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, input_packet_bytes - 1, SERVER_PORT );
+    packets[num_packets].reset = BENCH_RESET_SESSION;
+    num_packets++;
+
+    strcpy( packets[num_packets].name, "invalid (no session)" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, input_packet_bytes, SERVER_PORT );
+    packets[num_packets].reset = BENCH_RESET_NO_SESSION;
+    num_packets++;
+
+    strcpy( packets[num_packets].name, "invalid (too small)" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, 1 + 4, SERVER_PORT );
+    packets[num_packets].reset = BENCH_RESET_NONE;
+    num_packets++;
+
+    memset( payload, 0, sizeof(payload) );
+    payload[0] = 255;
+    strcpy( packets[num_packets].name, "invalid (packet type)" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, 100, SERVER_PORT );
+    packets[num_packets].reset = BENCH_RESET_NONE;
+    num_packets++;
+
+    write_input_packet( payload, session_id, sequence, t, dt, INPUTS_PER_PACKET );
+    strcpy( packets[num_packets].name, "invalid (rate limited)" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, input_packet_bytes, SERVER_PORT );
+    packets[num_packets].reset = BENCH_RESET_SESSION;
+    packets[num_packets].rate_limited = true;
+    num_packets++;
+
+    strcpy( packets[num_packets].name, "invalid (blocked)" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, input_packet_bytes, SERVER_PORT );
+    packets[num_packets].reset = BENCH_RESET_SESSION;
+    ( (struct iphdr*) ( packets[num_packets].data + sizeof(struct ethhdr) ) )->saddr = htonl( BENCH_BLOCKED_ADDRESS );
+    num_packets++;
+
+    memset( payload, 0, sizeof(payload) );
+    payload[0] = 255;
+    strcpy( packets[num_packets].name, "invalid (other port)" );
+    packets[num_packets].bytes = write_packet( packets[num_packets].data, payload, 100, 12345 );
+    packets[num_packets].reset = BENCH_RESET_NONE;
+    num_packets++;
+
+    return num_packets;
+}
+
+static int ignore_input( void * ctx, void * data, size_t data_sz )
+{
+    (void) ctx; (void) data; (void) data_sz;
+    return 0;
+}
+
+static const char * xdp_action_string( uint32_t action )
+{
+    switch ( action )
+    {
+        case XDP_ABORTED:   return "XDP_ABORTED";
+        case XDP_DROP:      return "XDP_DROP";
+        case XDP_PASS:      return "XDP_PASS";
+        case XDP_TX:        return "XDP_TX";
+        case XDP_REDIRECT:  return "XDP_REDIRECT";
+        default:            return "?";
+    }
+}
+
+int bench_init( struct bench_t * bench, const struct bench_variant_t * variant )
+{
+    memset( bench, 0, sizeof(struct bench_t) );
+
+    bench->input_buffer_fd = -1;
+    bench->player_state_fd = -1;
+
+    LIBBPF_OPTS( bpf_object_open_opts, open_opts, .pin_root_path = BENCH_PIN_PATH );
+
+    const char * filename = variant->filename ? variant->filename : "player_server_xdp skeleton";
+
+    if ( variant->filename )
+    {
+        bench->object = bpf_object__open_file( variant->filename, &open_opts );
+        if ( libbpf_get_error( bench->object ) )
+        {
+            bench->object = NULL;
+            printf( "\nerror: could not open %s\n\n", filename );
+            return 1;
+        }
+    }
+    else
+    {
+        bench->skel = player_server_xdp__open_opts( &open_opts );
+        if ( !bench->skel )
+        {
+            printf( "\nerror: could not open %s\n\n", filename );
+            return 1;
+        }
+
+        bench->skel->rodata->debug = variant->debug;
+
+        bench->object = bench->skel->obj;
+    }
+
+    // we only need an input buffer and player state map for cpu 0, and create them once the object is loaded
+
+    struct cpu_map_spec_t input_buffer_spec;
+    struct cpu_map_spec_t player_state_spec;
+
+    if ( cpu_map_spec_init( &input_buffer_spec, bench->object, "input_buffer_map", BENCH_INPUT_BUFFER_SIZE ) != 0 ||
+         cpu_map_spec_init( &player_state_spec, bench->object, "player_state_map", PLAYERS_PER_CPU ) != 0 )
+    {
+        printf( "\nerror: could not find the per-cpu map definitions in %s\n\n", filename );
+        return 1;
+    }
+
+    if ( bpf_object__load( bench->object ) != 0 )
+    {
+        printf( "\nerror: could not load %s\n\n", filename );
+        return 1;
+    }
+
+    struct bpf_program * program = bpf_object__find_program_by_name( bench->object, "server_xdp_filter" );
+    if ( !program )
+    {
+        printf( "\nerror: could not find server_xdp_filter\n\n" );
+        return 1;
+    }
+
+    bench->program_fd = bpf_program__fd( program );
+
+    // we are pinned to cpu 0, so the program uses the cpu 0 input buffer and player state map
+
+    bench->session_map_fd = bpf_map__fd( bpf_object__find_map_by_name( bench->object, "session_map" ) );
+    bench->input_buffer_fd = cpu_map_create( &input_buffer_spec, "input_buffer", 0 );
+    bench->player_state_fd = cpu_map_create( &player_state_spec, "player_state", 0 );
+    if ( bench->input_buffer_fd < 0 || bench->player_state_fd < 0 )
+    {
+        printf( "\nerror: could not create the cpu 0 maps: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    bench->input_buffer = ring_buffer__new( bench->input_buffer_fd, ignore_input, NULL, NULL );
+    if ( !bench->input_buffer )
+    {
+        printf( "\nerror: could not create input buffer\n\n" );
+        return 1;
+    }
+
+    // a known join cookie key, so we can sign join requests the way a client that received the challenge would
+
+    int zero = 0;
+    if ( bpf_map_update_elem( bpf_map__fd( bpf_object__find_map_by_name( bench->object, "join_cookie_key_map" ) ), &zero, &bench_join_cookie_key, BPF_ANY ) != 0 )
+    {
+        printf( "\nerror: could not set join cookie key: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    // block one source address, and keep the rate limit bucket of the others where each packet wants it (see run_packet)
+
+    struct blocklist_key blocked;
+    blocked.prefix_length = 32;
+    blocked.address = htonl( BENCH_BLOCKED_ADDRESS );
+    __u8 value = 1;
+    if ( bpf_map_update_elem( bpf_map__fd( bpf_object__find_map_by_name( bench->object, "blocklist_map" ) ), &blocked, &value, BPF_ANY ) != 0 )
+    {
+        printf( "\nerror: could not add blocked address: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    bench->rate_limit_map_fd = bpf_map__fd( bpf_object__find_map_by_name( bench->object, "rate_limit_map" ) );
+
+    // the player state reply for the session must exist so input packets get one. it is a full state, the biggest reply there is
+
+    uint64_t session_id = BENCH_SESSION_ID;
+
+#if PLAYER_STATE_MMAP
+    struct player_state_slot slot;
+    memset( &slot, 0, sizeof(slot) );
+    slot.session_id = session_id;
+    slot.sequence = 2;
+    slot.owner[0] = session_id;
+    slot.owner[1] = session_id;
+    slot.reply[0].bytes = PLAYER_STATE_REPLY_MAX_SIZE;
+    slot.reply[1].bytes = PLAYER_STATE_REPLY_MAX_SIZE;
+    uint32_t slot_index = 0;
+    int err = bpf_map_update_elem( bench->player_state_fd, &slot_index, &slot, BPF_ANY );
+#else // #if PLAYER_STATE_MMAP
+    struct player_state_reply reply;
+    memset( &reply, 0, sizeof(reply) );
+    reply.bytes = PLAYER_STATE_REPLY_MAX_SIZE;
+    int err = bpf_map_update_elem( bench->player_state_fd, &session_id, &reply, BPF_ANY );
+#endif // #if PLAYER_STATE_MMAP
+    if ( err != 0 )
+    {
+        printf( "\nerror: could not add player state: %s\n\n", strerror(errno) );
+        return 1;
+    }
+
+    return 0;
+}
+
+void bench_shutdown( struct bench_t * bench )
+{
+    if ( bench->input_buffer )
+    {
+        ring_buffer__free( bench->input_buffer );
+    }
+    if ( bench->input_buffer_fd >= 0 )
+    {
+        close( bench->input_buffer_fd );
+    }
+    if ( bench->player_state_fd >= 0 )
+    {
+        close( bench->player_state_fd );
+    }
+    if ( bench->object )
+    {
+        bpf_object__unpin_maps( bench->object, BENCH_PIN_PATH );
+    }
+    if ( bench->skel )
+    {
+        player_server_xdp__destroy( bench->skel );
+    }
+    else if ( bench->object )
+    {
+        bpf_object__close( bench->object );
+    }
+}
+
+static int reset_session( struct bench_t * bench, uint64_t next_input_sequence )
+{
+    // session map is per-cpu, so provide a value for every possible cpu
+
+    const int value_size = ( sizeof(struct session_data) + 7 ) & ~7;
+
+    uint8_t values[num_possible_cpus * value_size];
+    memset( values, 0, sizeof(values) );
+
+    for ( int i = 0; i < num_possible_cpus; i++ )
+    {
+        struct session_data * session = (struct session_data*) ( values + i * value_size );
+        session->next_input_sequence = next_input_sequence;
+        session->player_state_slot = 0;
+    }
+
+    uint64_t session_id = BENCH_SESSION_ID;
+    return bpf_map_update_elem( bench->session_map_fd, &session_id, values, BPF_ANY );
+}
+
+static int reset_rate_limit( struct bench_t * bench, bool rate_limited )
+{
+    // a full bucket, or an empty one refilled just now, so it has a fraction of a token when the packet arrives
+
+    const int value_size = sizeof(struct rate_limit_bucket);
+
+    uint8_t values[num_possible_cpus * value_size];
+
+    struct timespec now;
+    clock_gettime( CLOCK_MONOTONIC, &now );
+
+    for ( int i = 0; i < num_possible_cpus; i++ )
+    {
+        struct rate_limit_bucket * bucket = (struct rate_limit_bucket*) ( values + i * value_size );
+        bucket->tokens = rate_limited ? 0 : RATE_LIMIT_BURST * 1000000000ULL;
+        bucket->last_time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+    }
+
+    uint32_t address = htonl( BENCH_CLIENT_ADDRESS );
+    return bpf_map_update_elem( bench->rate_limit_map_fd, &address, values, BPF_ANY );
+}
+
+static int run_packet( struct bench_t * bench, struct bench_packet_t * packet, int iterations, double * ns_per_packet, uint32_t * action )
+{
+    uint8_t output[BENCH_MAX_PACKET_SIZE];
+
+    uint64_t total_duration = 0;
+
+    if ( packet->join_cookie )
+    {
+        struct timespec now;
+        clock_gettime( CLOCK_BOOTTIME, &now );
+        const uint64_t boot_time = now.tv_sec * 1000000000ULL + now.tv_nsec;
+        const uint64_t cookie = join_cookie( &bench_join_cookie_key, htonl( BENCH_CLIENT_ADDRESS ), htons( BENCH_CLIENT_PORT ), BENCH_SESSION_ID, join_cookie_bucket( boot_time ) );
+        memcpy( packet->data + sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) + 1 + 8 + 8, &cookie, 8 );
+    }
+
+    for ( int i = 0; i < iterations; i++ )
+    {
+        uint64_t session_id = BENCH_SESSION_ID;
+
+        if ( packet->reset == BENCH_RESET_SESSION )
+        {
+            if ( reset_session( bench, BENCH_SEQUENCE - packet->num_inputs + 1 ) != 0 )
+            {
+                printf( "\nerror: could not reset session: %s\n\n", strerror(errno) );
+                return 1;
+            }
+        }
+        else if ( packet->reset == BENCH_RESET_NO_SESSION )
+        {
+            bpf_map_delete_elem( bench->session_map_fd, &session_id );
+        }
+
+        if ( reset_rate_limit( bench, packet->rate_limited ) != 0 )
+        {
+            printf( "\nerror: could not reset rate limit: %s\n\n", strerror(errno) );
+            return 1;
+        }
+
+        LIBBPF_OPTS( bpf_test_run_opts, opts,
+            .data_in = packet->data,
+            .data_size_in = packet->bytes,
+            .data_out = output,
+            .data_size_out = sizeof(output),
+            .repeat = 1,
+        );
+
+        if ( bpf_prog_test_run_opts( bench->program_fd, &opts ) != 0 )
+        {
+            printf( "\nerror: test run failed: %s\n\n", strerror(errno) );
+            return 1;
+        }
+
+        total_duration += opts.duration;
+
+        *action = opts.retval;
+
+        ring_buffer__consume( bench->input_buffer );
+    }
+
+    *ns_per_packet = total_duration / (double) iterations;
+
+    return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+    int iterations = 100000;
+
+    if ( argc == 2 )
+    {
+        iterations = atoi( argv[1] );
+    }
+
+    if ( argc > 2 || iterations <= 0 )
+    {
+        printf( "\nusage: bench_xdp [iterations]\n\n" );
+        return 1;
+    }
+
+    if ( geteuid() != 0 )
+    {
+        printf( "\nerror: this program must be run as root\n\n" );
+        return 1;
+    }
+
+    struct rlimit rlim_new = {
+        .rlim_cur   = RLIM_INFINITY,
+        .rlim_max   = RLIM_INFINITY,
+    };
+
+    if ( setrlimit( RLIMIT_MEMLOCK, &rlim_new ) )
+    {
+        printf( "\nerror: could not increase RLIMIT_MEMLOCK limit!\n\n" );
+        return 1;
+    }
+
+    cpu_set_t cpuset;
+    CPU_ZERO( &cpuset );
+    CPU_SET( 0, &cpuset );
+    sched_setaffinity( 0, sizeof(cpuset), &cpuset );
+
+    num_possible_cpus = libbpf_num_possible_cpus();
+
+    static struct bench_packet_t packets[32];
+
+    int num_packets = create_packets( packets );
+
+    const struct bench_variant_t variants[] = 
+    {
+        { "hardcoded",      "player_server_xdp_hardcoded.o",    0 },
+        { "rodata",         NULL,                               0 },
+        { "rodata debug",   NULL,                               1 },
+    };
+
+    const int num_variants = sizeof(variants) / sizeof(variants[0]);
+
+    static double ns_per_packet[3][32];
+    static uint32_t action[3][32];
+
+    for ( int i = 0; i < num_variants; i++ )
+    {
+        struct bench_t bench;
+
+        if ( bench_init( &bench, &variants[i] ) != 0 )
+        {
+            bench_shutdown( &bench );
+            return 1;
+        }
+
+        for ( int j = 0; j < num_packets; j++ )
+        {
+            if ( run_packet( &bench, &packets[j], iterations, &ns_per_packet[i][j], &action[i][j] ) != 0 )
+            {
+                bench_shutdown( &bench );
+                return 1;
+            }
+        }
+
+        bench_shutdown( &bench );
+    }
+
+    // rodata / hardcoded should be 1.00x or below: the verifier sees the same constants either way
+
+    printf( "\nns per packet, %d iterations\n\n", iterations );
+
+    printf( "    %-24s %12s %12s %10s %14s    %s\n", "packet", variants[0].name, variants[1].name, "ratio", variants[2].name, "action" );
+
+    for ( int j = 0; j < num_packets; j++ )
+    {
+        printf( "    %-24s %12.1f %12.1f %9.2fx %14.1f    %s\n", packets[j].name, ns_per_packet[0][j], ns_per_packet[1][j], ns_per_packet[1][j] / ns_per_packet[0][j], ns_per_packet[2][j], xdp_action_string( action[1][j] ) );
+    }
+
+    printf( "\n" );
+
+    return 0;
+}
@@ -26,12 +26,15 @@ const PlayerDataSize = 1024
 
 const PlayerStateSize = 1000
 
-const InputPacketSize = 1 + 8 + 8 + 8 + (8 + InputSize) * InputsPerPacket
-const JoinRequestPacketSize = 1 + 8 + 8 + PlayerDataSize
+const InputTick = 1000000000 / 100
+const InputMaskBytes = (InputSize + 7) / 8
+const InputPacketMaxSize = 1 + 8 + 10*5 + 1 + 2 + (10 + InputMaskBytes + InputSize) * InputsPerPacket
+const JoinRequestPacketSize = 1 + 8 + 8 + 8 + PlayerDataSize
 const JoinResponsePacketSize = 1 + 8 + 8 + 8
+const JoinChallengePacketSize = 1 + 8 + 8 + 8
 const StatsRequestPacketSize = 1 + 8 + 8
 const StatsResponsePacketSize = 1 + 8 + 8
-const PlayerStatePacketSize = 1 + 8 + PlayerStateSize
+const PlayerStatePacketSize = 1 + 8 + PlayerStateReplyHeaderSize + PlayerStateSize
 
 const JoinRequestPacket = 1
 const JoinResponsePacket = 2
@@ -39,6 +42,7 @@ const InputPacket = 3
 const StatsRequestPacket = 4
 const StatsResponsePacket = 5
 const PlayerStatePacket = 6
+const JoinChallengePacket = 7
 
 var numClients int
 
@@ -46,9 +50,11 @@ var quit uint64
 var joined uint64
 var serverTime uint64
 var packetsSent uint64
+var inputBytesSent uint64
 var packetsReceived uint64
 var totalInputsProcessed uint64
 var playerStatePacketsReceived uint64
+var playerStateBytesReceived uint64
 
 type Input struct {
 	sequence uint64
@@ -108,8 +114,10 @@ func main() {
 	ticker := time.NewTicker(time.Second)
  
 	prev_sent := uint64(0)
+	prev_bytes := uint64(0)
 	prev_processed := uint64(0)
 	prev_player_states := uint64(0)
+	prev_player_state_bytes := uint64(0)
 
  	for {
 		select {
@@ -118,15 +126,27 @@ func main() {
 			atomic.StoreUint64(&quit, 1)
 	 	case <-ticker.C:
 	 		sent := atomic.LoadUint64(&packetsSent)
+	 		bytes := atomic.LoadUint64(&inputBytesSent)
 	 		processed := atomic.LoadUint64(&totalInputsProcessed)
 	 		player_states := atomic.LoadUint64(&playerStatePacketsReceived)
+	 		player_state_bytes := atomic.LoadUint64(&playerStateBytesReceived)
 	 		sent_delta := sent - prev_sent
 	 		processed_delta := processed - prev_processed
 	 		player_state_delta := player_states - prev_player_states
-	 		fmt.Printf("inputs sent delta %d, inputs processed delta %d, player state delta %d\n", sent_delta, processed_delta, player_state_delta)
+	 		input_packet_bytes := uint64(0)
+	 		if sent_delta > 0 {
+	 			input_packet_bytes = (bytes - prev_bytes) / sent_delta
+	 		}
+	 		player_state_packet_bytes := uint64(0)
+	 		if player_state_delta > 0 {
+	 			player_state_packet_bytes = (player_state_bytes - prev_player_state_bytes) / player_state_delta
+	 		}
+	 		fmt.Printf("inputs sent delta %d, inputs processed delta %d, player state delta %d, input packet bytes %d, player state packet bytes %d\n", sent_delta, processed_delta, player_state_delta, input_packet_bytes, player_state_packet_bytes)
 			prev_sent = sent
+			prev_bytes = bytes
 			prev_processed = processed
 			prev_player_states = player_states
+			prev_player_state_bytes = player_state_bytes
 	 	}
 		quit := atomic.LoadUint64(&quit)
 		if quit != 0 {
@@ -150,8 +170,8 @@ func addInput(sequence uint64, inputBuffer []Input, input Input) {
 	inputBuffer[index] = input
 }
 
-func writeJoinRequestPacket(sessionId uint64, sentTime uint64, playerData []byte) []byte {
-	packet := make([]byte, InputPacketSize)
+func writeJoinRequestPacket(sessionId uint64, sentTime uint64, cookie uint64, playerData []byte) []byte {
+	packet := make([]byte, JoinRequestPacketSize)
 	packetIndex := 0
 	packet[0] = JoinRequestPacket
 	packetIndex++
@@ -159,34 +179,64 @@ func writeJoinRequestPacket(sessionId uint64, sentTime uint64, playerData []byte
 	packetIndex += 8
 	binary.LittleEndian.PutUint64(packet[packetIndex:], sentTime)
 	packetIndex += 8
+	binary.LittleEndian.PutUint64(packet[packetIndex:], cookie)
+	packetIndex += 8
 	copy(packet[packetIndex:], playerData)
 	packetIndex += PlayerDataSize
 	return packet[:packetIndex]
 }
 
-func writeInputPacket(sessionId uint64, sequence uint64, inputBuffer []Input) []byte {
-	index := sequence % InputHistory
-	input := inputBuffer[index]
-	packet := make([]byte, InputPacketSize)
+func writeInputPacket(sessionId uint64, sequence uint64, acked uint64, baseline uint64, inputBuffer []Input) []byte {
+
+	// see input_encoding.h. inputs we haven't had acked yet, most recent first
+
+	inputs := make([]Input, 0, InputsPerPacket)
+	for len(inputs) < InputsPerPacket && sequence > acked {
+		input := inputBuffer[sequence%InputHistory]
+		if input.sequence != sequence {
+			break
+		}
+		inputs = append(inputs, input)
+		sequence--
+	}
+
+	packet := make([]byte, InputPacketMaxSize)
 	packetIndex := 0
 	packet[0] = InputPacket
 	packetIndex++
 	binary.LittleEndian.PutUint64(packet[packetIndex:], sessionId)
 	packetIndex += 8
-	binary.LittleEndian.PutUint64(packet[packetIndex:], sequence)
-	packetIndex += 8
-	binary.LittleEndian.PutUint64(packet[packetIndex:], input.t)
-	packetIndex += 8
-	for i := 0; i < InputsPerPacket; i++ {
-		binary.LittleEndian.PutUint64(packet[packetIndex:], input.dt)
-		packetIndex += 8
-		copy(packet[packetIndex:], input.input)
-		packetIndex += InputSize
-		sequence --
-		index = sequence % InputHistory
-		input = inputBuffer[index]
-		if input.sequence != sequence {
-			break
+	packetIndex += binary.PutUvarint(packet[packetIndex:], inputs[0].sequence)
+	packetIndex += binary.PutUvarint(packet[packetIndex:], inputs[0].t/InputTick)
+	packetIndex += binary.PutUvarint(packet[packetIndex:], inputs[0].t%InputTick)
+	packetIndex += binary.PutUvarint(packet[packetIndex:], baseline/InputTick)
+	packetIndex += binary.PutUvarint(packet[packetIndex:], baseline%InputTick)
+	packet[packetIndex] = byte(len(inputs))
+	packetIndex++
+	explicitDt := uint16(0)
+	for j := range inputs {
+		if inputs[j].dt != InputTick {
+			explicitDt |= 1 << j
+		}
+	}
+	binary.LittleEndian.PutUint16(packet[packetIndex:], explicitDt)
+	packetIndex += 2
+	for j := range inputs {
+		if inputs[j].dt != InputTick {
+			packetIndex += binary.PutUvarint(packet[packetIndex:], inputs[j].dt)
+		}
+		maskIndex := packetIndex
+		packetIndex += InputMaskBytes
+		for i := 0; i < InputSize; i++ {
+			value := inputs[j].input[i]
+			if j > 0 {
+				value ^= inputs[0].input[i]
+			}
+			if value != 0 {
+				packet[maskIndex+i/8] |= 1 << (i % 8)
+				packet[packetIndex] = value
+				packetIndex++
+			}
 		}
 	}
 	return packet[:packetIndex]
@@ -221,7 +271,24 @@ func runClient(clientIndex int, serverAddress *net.UDPAddr) {
 
 	buffer := make([]byte, MaxPacketSize)
 
+	rand.Seed(time.Now().UnixNano())
+
+	sessionId := rand.Uint64()
+
+	playerData := make([]byte, PlayerDataSize)
+
+	// the newest input sequence the server has acked in a player state packet. we don't resend inputs up to it
+
+	var acked uint64
+
+	// the t of the newest player state we have. the server sends player state as a delta against it
+
+	var baseline uint64
+
 	go func() {
+
+		playerStates := newPlayerStates()
+
 		for {
 	
 			packetBytes, _, err := conn.ReadFromUDP(buffer)
@@ -237,7 +304,19 @@ func runClient(clientIndex int, serverAddress *net.UDPAddr) {
 
 			packetType := packetData[0]
 
-			if packetType == JoinResponsePacket && packetBytes == JoinResponsePacketSize {
+			if packetType == JoinChallengePacket && packetBytes == JoinChallengePacketSize {
+
+				// echo the cookie straight back. the server only creates our session for a join that carries it
+
+				fmt.Printf("received join challenge packet\n")
+
+				cookie := binary.LittleEndian.Uint64(packetData[1+8+8:])
+
+				sentTime := uint64(time.Now().UnixNano())
+
+				conn.WriteToUDP(writeJoinRequestPacket(sessionId, sentTime, cookie, playerData), serverAddress)
+
+			} else if packetType == JoinResponsePacket && packetBytes == JoinResponsePacketSize {
 
 				fmt.Printf("received join response packet\n")
 
@@ -265,10 +344,21 @@ func runClient(clientIndex int, serverAddress *net.UDPAddr) {
 
 				atomic.StoreUint64(&totalInputsProcessed, packetInputsProcessed)
 
-			} else if packetType == PlayerStatePacket && packetBytes == PlayerStatePacketSize {
+			} else if packetType == PlayerStatePacket && packetBytes >= 1+8+PlayerStateReplyHeaderSize && packetBytes <= PlayerStatePacketSize {
 
 				atomic.AddUint64(&playerStatePacketsReceived, 1)
 
+				atomic.AddUint64(&playerStateBytesReceived, uint64(packetBytes))
+
+				ack := binary.LittleEndian.Uint64(packetData[1:])
+				if ack > atomic.LoadUint64(&acked) {
+					atomic.StoreUint64(&acked, ack)
+				}
+
+				if t, ok := playerStates.apply(packetData[1+8:]); ok && t > atomic.LoadUint64(&baseline) {
+					atomic.StoreUint64(&baseline, t)
+				}
+
 			}
 
 			atomic.AddUint64(&packetsReceived, 1)
@@ -277,14 +367,9 @@ func runClient(clientIndex int, serverAddress *net.UDPAddr) {
 
 	// join
 
-	rand.Seed(time.Now().UnixNano())
-
-	sessionId := rand.Uint64()
 	{
 		fmt.Printf("joining server as session %016x\n", sessionId)
 
-		playerData := make([]byte, PlayerDataSize)
-
 		ticker := time.NewTicker(time.Millisecond * 10)
 
 	 	for {
@@ -303,7 +388,7 @@ func runClient(clientIndex int, serverAddress *net.UDPAddr) {
 
 		 		sentTime := uint64(time.Now().UnixNano())
 
-				joinRequestPacket := writeJoinRequestPacket(sessionId, sentTime, playerData)
+				joinRequestPacket := writeJoinRequestPacket(sessionId, sentTime, 0, playerData)
 
 				conn.WriteToUDP(joinRequestPacket, serverAddress)
 		 	}
@@ -364,12 +449,14 @@ func runClient(clientIndex int, serverAddress *net.UDPAddr) {
 
 			addInput(sequence, inputBuffer, input)
 
-			inputPacket := writeInputPacket(sessionId, sequence, inputBuffer)
+			inputPacket := writeInputPacket(sessionId, sequence, atomic.LoadUint64(&acked), atomic.LoadUint64(&baseline), inputBuffer)
 
 			conn.WriteToUDP(inputPacket, serverAddress)
 
 			atomic.AddUint64(&packetsSent, 1)
 
+			atomic.AddUint64(&inputBytesSent, uint64(len(inputPacket)))
+
 			t += dt
 
 			sequence++
@@ -0,0 +1,71 @@
+
+#ifndef CPU_MAPS_H
+#define CPU_MAPS_H
+
+#include "shared.h"
+
+/*
+    Per-cpu inner maps.
+
+    player_server_xdp.c only declares what each cpu's input buffer and player state map look like. Userspace creates
+    one of each for every cpu it uses and inserts them into input_buffer_map and player_state_map, so the same object
+    works on any number of cpus up to MAX_CPUS.
+
+    libbpf only keeps the inner map definition until it has created the outer map, so cpu_map_spec_init must be
+    called before the object is loaded, and cpu_map_create after.
+*/
+
+struct cpu_map_spec_t
+{
+    struct bpf_map * outer;
+    enum bpf_map_type type;
+    __u32 key_size;
+    __u32 value_size;
+    __u32 map_flags;
+    __u32 max_entries;
+};
+
+static int cpu_map_spec_init( struct cpu_map_spec_t * spec, struct bpf_object * object, const char * outer_name, __u32 max_entries )
+{
+    memset( spec, 0, sizeof(struct cpu_map_spec_t) );
+
+    spec->outer = bpf_object__find_map_by_name( object, outer_name );
+    if ( !spec->outer )
+        return 1;
+
+    struct bpf_map * inner = bpf_map__inner_map( spec->outer );
+    if ( !inner )
+        return 1;
+
+    spec->type = bpf_map__type( inner );
+    spec->key_size = bpf_map__key_size( inner );
+    spec->value_size = bpf_map__value_size( inner );
+    spec->map_flags = bpf_map__map_flags( inner );
+    spec->max_entries = max_entries;
+
+    // the kernel only accepts inner arrays the same size as the definition the outer map was created with
+
+    return bpf_map__set_max_entries( inner, max_entries );
+}
+
+static int cpu_map_create( const struct cpu_map_spec_t * spec, const char * name, int cpu )
+{
+    // returns the fd of the new map, or -1. the outer map holds its own reference, so the fd can be closed any time
+
+    LIBBPF_OPTS( bpf_map_create_opts, opts, .map_flags = spec->map_flags );
+
+    const int fd = bpf_map_create( spec->type, name, spec->key_size, spec->value_size, spec->max_entries, &opts );
+    if ( fd < 0 )
+        return -1;
+
+    __u32 key = cpu;
+    if ( bpf_map_update_elem( bpf_map__fd( spec->outer ), &key, &fd, BPF_ANY ) != 0 )
+    {
+        close( fd );
+        return -1;
+    }
+
+    return fd;
+}
+
+#endif // #ifndef CPU_MAPS_H
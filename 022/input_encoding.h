@@ -0,0 +1,156 @@
+
+#ifndef INPUT_ENCODING_H
+#define INPUT_ENCODING_H
+
+#include "shared.h"
+
+/*
+    Compact input packets.
+
+    An input packet is:
+
+        u8      packet type (INPUT_PACKET)
+        u64     session id, little endian. not encoded, so xdp can look up the session before decoding anything
+        varint  sequence
+        varint  t / INPUT_TICK
+        varint  t % INPUT_TICK, so 0 for a client that runs on the tick
+        varint  baseline / INPUT_TICK: the t of the newest player state the client has received, or 0
+        varint  baseline % INPUT_TICK
+        u8      number of inputs, 1 to INPUTS_PER_PACKET, most recent first
+        u16     explicit dt mask, little endian: bit j is set if input j has a dt other than INPUT_TICK
+
+    then for each input:
+
+        varint  dt, only if the input's bit is set in the explicit dt mask
+        u8      mask[INPUT_MASK_BYTES]: bit i is set if input byte i is sent
+        u8      the input bytes that are sent, in order
+
+    Bytes that are not sent are zero. The most recent input is sent as is, older inputs are XORed with it first, so
+    the bytes they have in common with it are not sent either. Varints are little endian base 128, as in protobuf and
+    Go's encoding/binary.
+
+    xdp expands packets back into input_data before they go in the ring buffer, so workers never see this encoding.
+
+    The decoder is shared between xdp and userspace. Every read is masked into a buffer of INPUT_DECODE_BUFFER_SIZE
+    bytes holding the packet, so the verifier can bound it without checking each read against the packet length. A
+    malformed packet reads past its end into the rest of the buffer, and is rejected by the index > bytes check at
+    the end.
+*/
+
+#define INPUT_TICK                                              ( 1000000000ULL / INPUT_PACKETS_PER_SECOND )
+
+#define INPUT_MASK_BYTES                                                    ( ( INPUT_SIZE + 7 ) / 8 )
+
+#define INPUT_PACKET_MAX_SIZE       ( 1 + 8 + 10 * 5 + 1 + 2 + ( 10 + INPUT_MASK_BYTES + INPUT_SIZE ) * INPUTS_PER_PACKET )
+
+#define INPUT_DECODE_BUFFER_SIZE                                                         2048
+
+_Static_assert( INPUT_PACKET_MAX_SIZE <= INPUT_DECODE_BUFFER_SIZE, "input decode buffer is too small" );
+_Static_assert( ( INPUT_DECODE_BUFFER_SIZE & ( INPUT_DECODE_BUFFER_SIZE - 1 ) ) == 0, "input decode buffer size must be a power of two" );
+_Static_assert( INPUTS_PER_PACKET <= 16, "explicit dt mask is 16 bits" );
+
+struct input_packet
+{
+    __u64 session_id;
+    __u64 sequence;
+    __u64 t;
+    __u64 baseline;
+    __u64 num_inputs;                       // carried by the packet. only the first max_inputs are decoded
+    struct input_data inputs[INPUTS_PER_PACKET];
+};
+
+static __always_inline __u64 input_read_varint( const __u8 * buffer, __u32 * index, __u64 present )
+{
+    // reads nothing and returns 0 if present is 0. the same instructions run either way
+
+    __u64 value = 0;
+    __u64 more = present;
+    __u32 i = *index;
+
+    for ( int shift = 0; shift < 64; shift += 7 )
+    {
+        const __u64 byte = buffer[i & ( INPUT_DECODE_BUFFER_SIZE - 1 )];
+        value |= ( ( byte & 0x7f ) << shift ) & ( 0 - more );
+        i += more;
+        more &= byte >> 7;
+    }
+
+    *index = i;
+
+    return value;
+}
+
+static __always_inline int input_packet_decode( const __u8 * buffer, __u32 bytes, struct input_packet * packet, __u64 max_inputs )
+{
+    // buffer is INPUT_DECODE_BUFFER_SIZE bytes, starting with the packet. returns the number of inputs decoded, or -1 if the packet is malformed
+
+    if ( bytes < 1 + 8 || bytes > INPUT_DECODE_BUFFER_SIZE )
+    {
+        return -1;
+    }
+
+    __u64 session_id = 0;
+    for ( int i = 0; i < 8; i++ )
+    {
+        session_id |= ( (__u64) buffer[1+i] ) << ( i * 8 );
+    }
+
+    __u32 index = 1 + 8;
+
+    packet->session_id = session_id;
+    packet->sequence = input_read_varint( buffer, &index, 1 );
+    const __u64 ticks = input_read_varint( buffer, &index, 1 );
+    packet->t = ticks * INPUT_TICK + input_read_varint( buffer, &index, 1 );
+    const __u64 baseline_ticks = input_read_varint( buffer, &index, 1 );
+    packet->baseline = baseline_ticks * INPUT_TICK + input_read_varint( buffer, &index, 1 );
+
+    packet->num_inputs = buffer[index & ( INPUT_DECODE_BUFFER_SIZE - 1 )];
+    index++;
+
+    const __u32 explicit_dt = buffer[index & ( INPUT_DECODE_BUFFER_SIZE - 1 )] | ( buffer[( index + 1 ) & ( INPUT_DECODE_BUFFER_SIZE - 1 )] << 8 );
+    index += 2;
+
+    if ( packet->num_inputs < 1 || packet->num_inputs > INPUTS_PER_PACKET )
+    {
+        return -1;
+    }
+
+    const __u64 n = packet->num_inputs < max_inputs ? packet->num_inputs : max_inputs;
+
+    for ( int j = 0; j < INPUTS_PER_PACKET; j++ )
+    {
+        if ( j >= n )
+        {
+            break;
+        }
+
+        struct input_data * input = &packet->inputs[j];
+
+        const __u64 explicit = ( explicit_dt >> j ) & 1;
+        input->dt = input_read_varint( buffer, &index, explicit ) | ( INPUT_TICK & ( explicit - 1 ) );
+
+        const __u32 mask_index = index;
+        index += INPUT_MASK_BYTES;
+
+        for ( int i = 0; i < INPUT_SIZE; i++ )
+        {
+            const __u8 sent = ( buffer[( mask_index + ( i >> 3 ) ) & ( INPUT_DECODE_BUFFER_SIZE - 1 )] >> ( i & 7 ) ) & 1;
+            __u8 value = buffer[index & ( INPUT_DECODE_BUFFER_SIZE - 1 )] & (__u8) ( 0 - sent );
+            index += sent;
+            if ( j > 0 )
+            {
+                value ^= packet->inputs[0].input[i];
+            }
+            input->input[i] = value;
+        }
+    }
+
+    if ( index > bytes )
+    {
+        return -1;
+    }
+
+    return (int) n;
+}
+
+#endif // #ifndef INPUT_ENCODING_H
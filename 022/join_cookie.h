@@ -0,0 +1,72 @@
+
+#ifndef JOIN_COOKIE_H
+#define JOIN_COOKIE_H
+
+#include "shared.h"
+
+/*
+    Join cookies.
+
+    A join request without a cookie creates no state. xdp answers it with a join challenge carrying a cookie, which
+    is SipHash-2-4 of the client address and port, the session id and the current JOIN_COOKIE_SECONDS time bucket,
+    keyed from join_cookie_key_map. Only a join request that echoes a cookie valid for this bucket or the last one
+    creates a session, so a client has to receive our packets to join: spoofed join floods can't evict real players
+    from the session map.
+
+    The challenge is smaller than the request, so it can't be used for reflection amplification either.
+
+    Included by both the xdp program and userspace (bench_xdp), so the time is passed in: bpf_ktime_get_boot_ns in
+    xdp, CLOCK_BOOTTIME in userspace.
+*/
+
+#define JOIN_COOKIE_ROTL( x, b ) ( ( (x) << (b) ) | ( (x) >> ( 64 - (b) ) ) )
+
+#define JOIN_COOKIE_SIPROUND( v0, v1, v2, v3 )                                                                      \
+    do {                                                                                                            \
+        v0 += v1; v1 = JOIN_COOKIE_ROTL( v1, 13 ); v1 ^= v0; v0 = JOIN_COOKIE_ROTL( v0, 32 );                       \
+        v2 += v3; v3 = JOIN_COOKIE_ROTL( v3, 16 ); v3 ^= v2;                                                        \
+        v0 += v3; v3 = JOIN_COOKIE_ROTL( v3, 21 ); v3 ^= v0;                                                        \
+        v2 += v1; v1 = JOIN_COOKIE_ROTL( v1, 17 ); v1 ^= v2; v2 = JOIN_COOKIE_ROTL( v2, 32 );                       \
+    } while (0)
+
+static __always_inline __u64 join_cookie_bucket( __u64 boot_time_ns )
+{
+    return boot_time_ns / ( JOIN_COOKIE_SECONDS * 1000000000ULL );
+}
+
+static __always_inline __u64 join_cookie( const struct join_cookie_key * key, __u32 address, __u16 port, __u64 session_id, __u64 bucket )
+{
+    // address and port are in network byte order, as they are in the packet. the message is three words, 24 bytes
+
+    const __u64 m[3] = { ( (__u64) port << 32 ) | address, session_id, bucket };
+
+    __u64 v0 = key->k0 ^ 0x736f6d6570736575ULL;
+    __u64 v1 = key->k1 ^ 0x646f72616e646f6dULL;
+    __u64 v2 = key->k0 ^ 0x6c7967656e657261ULL;
+    __u64 v3 = key->k1 ^ 0x7465646279746573ULL;
+
+    for ( int i = 0; i < 3; i++ )
+    {
+        v3 ^= m[i];
+        JOIN_COOKIE_SIPROUND( v0, v1, v2, v3 );
+        JOIN_COOKIE_SIPROUND( v0, v1, v2, v3 );
+        v0 ^= m[i];
+    }
+
+    const __u64 b = 24ULL << 56;
+
+    v3 ^= b;
+    JOIN_COOKIE_SIPROUND( v0, v1, v2, v3 );
+    JOIN_COOKIE_SIPROUND( v0, v1, v2, v3 );
+    v0 ^= b;
+
+    v2 ^= 0xff;
+    JOIN_COOKIE_SIPROUND( v0, v1, v2, v3 );
+    JOIN_COOKIE_SIPROUND( v0, v1, v2, v3 );
+    JOIN_COOKIE_SIPROUND( v0, v1, v2, v3 );
+    JOIN_COOKIE_SIPROUND( v0, v1, v2, v3 );
+
+    return v0 ^ v1 ^ v2 ^ v3;
+}
+
+#endif // #ifndef JOIN_COOKIE_H
@@ -0,0 +1,449 @@
+
+#include "shared.h"
+
+#include <sys/mman.h>
+#include <numaif.h>
+
+/*
+    Per-cpu player table.
+
+    Session ids are indexed with Robin Hood open addressing over a cache aligned key array. Values live in one
+    contiguous arena indexed by slot, with a free list for slots released by map_delete.
+
+    Both the index and the arena double when they fill up, so no player is ever dropped. Growing the arena moves
+    it, so pointers returned by map_get and map_insert are only valid until the next map_insert.
+
+    The arena is mmapped with 2MB huge pages when the system has them reserved, otherwise with regular pages and
+    a transparent huge page hint. When a numa node is given, the arena is bound to it with mbind before it is
+    touched, so the player state lives next to the cpu that works on it.
+*/
+
+#define MAP_CACHE_LINE                           64
+#define MAP_MAX_LOAD_NUMERATOR                    7
+#define MAP_MAX_LOAD_DENOMINATOR                  8
+#define MAP_MAX_PROBE_DISTANCE                  255
+#define MAP_HUGE_PAGE_SIZE        ( 2 * 1024 * 1024 )
+
+struct map_t
+{
+    int size;
+    int capacity;
+    uint64_t mask;
+
+    // index: probe distance + 1 (0 means empty), session id and arena slot for each entry
+
+    uint64_t * keys;
+    uint8_t * distances;
+    uint32_t * slots;
+
+    // arena of values, indexed by slot
+
+    int value_size;
+    int arena_size;
+    int arena_capacity;
+    uint8_t * arena;
+    size_t arena_bytes;
+    bool arena_huge_pages;
+    int numa_node;
+
+    int num_free_slots;
+    uint32_t * free_slots;
+};
+
+static inline uint64_t map_hash( uint64_t session_id )
+{
+    // session ids are usually random, but don't rely on it. splitmix64 finalizer
+
+    session_id ^= session_id >> 30;
+    session_id *= 0xbf58476d1ce4e5b9ULL;
+    session_id ^= session_id >> 27;
+    session_id *= 0x94d049bb133111ebULL;
+    session_id ^= session_id >> 31;
+    return session_id;
+}
+
+static int map_capacity_for( int num_elements )
+{
+    int capacity = 16;
+    while ( capacity * MAP_MAX_LOAD_NUMERATOR < num_elements * MAP_MAX_LOAD_DENOMINATOR )
+    {
+        capacity *= 2;
+    }
+    return capacity;
+}
+
+static int map_index_alloc( struct map_t * map, int capacity )
+{
+    map->keys = (uint64_t*) aligned_alloc( MAP_CACHE_LINE, ( capacity * sizeof(uint64_t) + MAP_CACHE_LINE - 1 ) & ~( MAP_CACHE_LINE - 1 ) );
+    map->distances = (uint8_t*) calloc( capacity, sizeof(uint8_t) );
+    map->slots = (uint32_t*) malloc( capacity * sizeof(uint32_t) );
+    if ( !map->keys || !map->distances || !map->slots )
+    {
+        free( map->keys );
+        free( map->distances );
+        free( map->slots );
+        return 0;
+    }
+    map->capacity = capacity;
+    map->mask = capacity - 1;
+    return 1;
+}
+
+static uint8_t * map_arena_alloc( size_t bytes, int numa_node, size_t * mapped_bytes, bool * huge_pages )
+{
+    // try explicit huge pages first. this fails unless huge pages are reserved via /proc/sys/vm/nr_hugepages
+
+    size_t size = ( bytes + MAP_HUGE_PAGE_SIZE - 1 ) & ~( (size_t) MAP_HUGE_PAGE_SIZE - 1 );
+
+    void * arena = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0 );
+
+    *huge_pages = arena != MAP_FAILED;
+
+    if ( arena == MAP_FAILED )
+    {
+        const size_t page_size = sysconf( _SC_PAGESIZE );
+        size = ( bytes + page_size - 1 ) & ~( page_size - 1 );
+        arena = mmap( NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+        if ( arena == MAP_FAILED )
+        {
+            return NULL;
+        }
+        madvise( arena, size, MADV_HUGEPAGE );
+    }
+
+    if ( numa_node >= 0 )
+    {
+        unsigned long node_mask[16];
+        memset( node_mask, 0, sizeof(node_mask) );
+        node_mask[numa_node/64] = 1UL << ( numa_node % 64 );
+        if ( mbind( arena, size, MPOL_BIND, node_mask, sizeof(node_mask) * 8, 0 ) != 0 )
+        {
+            printf( "warning: could not bind player arena to numa node %d: %s\n", numa_node, strerror(errno) );
+        }
+    }
+
+    // touch the arena up front, so page faults don't land on the first input from each player
+
+    memset( arena, 0, size );
+
+    *mapped_bytes = size;
+
+    return (uint8_t*) arena;
+}
+
+struct map_t * map_create( int value_size, int initial_elements, int numa_node )
+{
+    // numa_node is the node to bind the arena to, or -1 to leave it with the default policy
+
+    struct map_t * map = (struct map_t*) malloc( sizeof( struct map_t ) );
+    assert( map );
+    memset( map, 0, sizeof(struct map_t) );
+
+    int result = map_index_alloc( map, map_capacity_for( initial_elements ) );
+    assert( result );
+    (void) result;
+
+    map->numa_node = numa_node >= 0 && numa_node < 1024 ? numa_node : -1;
+    map->value_size = ( value_size + 7 ) & ~7;
+    map->arena = map_arena_alloc( (size_t) ( initial_elements > 0 ? initial_elements : 1 ) * map->value_size, map->numa_node, &map->arena_bytes, &map->arena_huge_pages );
+    assert( map->arena );
+    map->arena_capacity = map->arena_bytes / map->value_size;
+    map->free_slots = (uint32_t*) malloc( map->arena_capacity * sizeof(uint32_t) );
+    assert( map->free_slots );
+
+    return map;
+}
+
+static int map_arena_node( struct map_t * map )
+{
+    // the numa node the first page of the arena actually landed on
+
+    int node = -1;
+    if ( get_mempolicy( &node, NULL, 0, map->arena, MPOL_F_NODE | MPOL_F_ADDR ) != 0 )
+    {
+        return -1;
+    }
+    return node;
+}
+
+static void map_destroy( struct map_t * map )
+{
+    assert( map );
+    free( map->keys );
+    free( map->distances );
+    free( map->slots );
+    munmap( map->arena, map->arena_bytes );
+    free( map->free_slots );
+    free( map );
+}
+
+static void map_reset( struct map_t * map )
+{
+    assert( map );
+    map->size = 0;
+    map->arena_size = 0;
+    map->num_free_slots = 0;
+    memset( map->distances, 0, map->capacity );
+}
+
+static int map_index_put( struct map_t * map, uint64_t * session_id, uint32_t * slot )
+{
+    // robin hood: an entry that is further from home than the resident entry takes its place.
+    // if probe distance would no longer fit in a byte, the entry we are carrying is passed back and we fail
+
+    uint64_t index = map_hash( *session_id ) & map->mask;
+    uint8_t distance = 1;
+
+    while ( distance < MAP_MAX_PROBE_DISTANCE )
+    {
+        if ( map->distances[index] == 0 )
+        {
+            map->keys[index] = *session_id;
+            map->slots[index] = *slot;
+            map->distances[index] = distance;
+            return 1;
+        }
+
+        if ( map->distances[index] < distance )
+        {
+            uint64_t resident_session_id = map->keys[index];
+            uint32_t resident_slot = map->slots[index];
+            uint8_t resident_distance = map->distances[index];
+
+            map->keys[index] = *session_id;
+            map->slots[index] = *slot;
+            map->distances[index] = distance;
+
+            *session_id = resident_session_id;
+            *slot = resident_slot;
+            distance = resident_distance;
+        }
+
+        index = ( index + 1 ) & map->mask;
+        distance++;
+    }
+
+    return 0;
+}
+
+static int map_index_grow( struct map_t * map )
+{
+    uint64_t * old_keys = map->keys;
+    uint8_t * old_distances = map->distances;
+    uint32_t * old_slots = map->slots;
+    int old_capacity = map->capacity;
+
+    int capacity = old_capacity * 2;
+
+    while ( true )
+    {
+        if ( !map_index_alloc( map, capacity ) )
+        {
+            map->keys = old_keys;
+            map->distances = old_distances;
+            map->slots = old_slots;
+            map->capacity = old_capacity;
+            map->mask = old_capacity - 1;
+            return 0;
+        }
+
+        bool ok = true;
+
+        for ( int i = 0; i < old_capacity && ok; i++ )
+        {
+            if ( old_distances[i] )
+            {
+                uint64_t session_id = old_keys[i];
+                uint32_t slot = old_slots[i];
+                ok = map_index_put( map, &session_id, &slot );
+            }
+        }
+
+        if ( ok )
+        {
+            break;
+        }
+
+        free( map->keys );
+        free( map->distances );
+        free( map->slots );
+
+        capacity *= 2;
+    }
+
+    free( old_keys );
+    free( old_distances );
+    free( old_slots );
+
+    return 1;
+}
+
+static int map_find_index_hashed( struct map_t * map, uint64_t session_id, uint64_t hash )
+{
+    uint64_t index = hash & map->mask;
+    uint8_t distance = 1;
+
+    // stop as soon as we pass an entry closer to home than we would be. the key can't be beyond it
+
+    while ( map->distances[index] >= distance )
+    {
+        if ( map->keys[index] == session_id )
+        {
+            return (int) index;
+        }
+        index = ( index + 1 ) & map->mask;
+        distance++;
+    }
+
+    return -1;
+}
+
+static int map_find_index( struct map_t * map, uint64_t session_id )
+{
+    return map_find_index_hashed( map, session_id, map_hash( session_id ) );
+}
+
+static inline void map_prefetch( struct map_t * map, uint64_t hash )
+{
+    // bring in the index entries a lookup with this hash starts at
+
+    const uint64_t index = hash & map->mask;
+    __builtin_prefetch( &map->keys[index] );
+    __builtin_prefetch( &map->distances[index] );
+    __builtin_prefetch( &map->slots[index] );
+}
+
+static int map_get_slot_hashed( struct map_t * map, uint64_t session_id, uint64_t hash )
+{
+    // arena slot of the session, or -1. unlike value pointers, slots stay valid when the arena grows
+
+    int index = map_find_index_hashed( map, session_id, hash );
+    return index >= 0 ? (int) map->slots[index] : -1;
+}
+
+static inline void * map_slot_value( struct map_t * map, int slot )
+{
+    return map->arena + (size_t) slot * map->value_size;
+}
+
+static void * map_get( struct map_t * map, uint64_t session_id )
+{
+    assert( map );
+    int index = map_find_index( map, session_id );
+    return index >= 0 ? map->arena + (size_t) map->slots[index] * map->value_size : NULL;
+}
+
+static uint32_t map_alloc_slot( struct map_t * map )
+{
+    if ( map->num_free_slots > 0 )
+    {
+        return map->free_slots[--map->num_free_slots];
+    }
+
+    if ( map->arena_size == map->arena_capacity )
+    {
+        const size_t old_bytes = (size_t) map->arena_capacity * map->value_size;
+
+        size_t new_bytes = 0;
+        bool huge_pages = false;
+        uint8_t * arena = map_arena_alloc( old_bytes * 2, map->numa_node, &new_bytes, &huge_pages );
+        if ( !arena )
+        {
+            return UINT32_MAX;
+        }
+
+        const int new_capacity = new_bytes / map->value_size;
+
+        uint32_t * free_slots = (uint32_t*) realloc( map->free_slots, new_capacity * sizeof(uint32_t) );
+        if ( !free_slots )
+        {
+            munmap( arena, new_bytes );
+            return UINT32_MAX;
+        }
+
+        memcpy( arena, map->arena, old_bytes );
+        munmap( map->arena, map->arena_bytes );
+
+        map->arena = arena;
+        map->arena_bytes = new_bytes;
+        map->arena_huge_pages = huge_pages;
+        map->arena_capacity = new_capacity;
+        map->free_slots = free_slots;
+    }
+
+    return map->arena_size++;
+}
+
+static void * map_insert( struct map_t * map, uint64_t session_id )
+{
+    // returns the zeroed value for a new session, or the existing value if the session is already in the map
+
+    assert( map );
+
+    int index = map_find_index( map, session_id );
+    if ( index >= 0 )
+    {
+        return map->arena + (size_t) map->slots[index] * map->value_size;
+    }
+
+    if ( ( map->size + 1 ) * MAP_MAX_LOAD_DENOMINATOR > map->capacity * MAP_MAX_LOAD_NUMERATOR )
+    {
+        if ( !map_index_grow( map ) )
+        {
+            return NULL;
+        }
+    }
+
+    uint32_t slot = map_alloc_slot( map );
+    if ( slot == UINT32_MAX )
+    {
+        return NULL;
+    }
+
+    uint64_t key = session_id;
+    uint32_t key_slot = slot;
+    while ( !map_index_put( map, &key, &key_slot ) )
+    {
+        if ( !map_index_grow( map ) )
+        {
+            return NULL;
+        }
+    }
+
+    map->size++;
+
+    void * value = map->arena + (size_t) slot * map->value_size;
+    memset( value, 0, map->value_size );
+    return value;
+}
+
+static int map_delete( struct map_t * map, uint64_t session_id )
+{
+    assert( map );
+
+    int index = map_find_index( map, session_id );
+    if ( index < 0 )
+    {
+        return 0;
+    }
+
+    map->free_slots[map->num_free_slots++] = map->slots[index];
+
+    // backward shift the entries after it, so there are no tombstones
+
+    uint64_t current = (uint64_t) index;
+    uint64_t next = ( current + 1 ) & map->mask;
+    while ( map->distances[next] > 1 )
+    {
+        map->keys[current] = map->keys[next];
+        map->slots[current] = map->slots[next];
+        map->distances[current] = map->distances[next] - 1;
+        current = next;
+        next = ( next + 1 ) & map->mask;
+    }
+    map->distances[current] = 0;
+
+    --map->size;
+
+    return 1;
+}
@@ -25,22 +25,417 @@
 #include <pthread.h>
 #include <sched.h>
 #include <stdlib.h>
+#include <poll.h>
+#include <sys/mman.h>
+#include <sys/random.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/ip.h>
+#include <linux/udp.h>
+#include <xdp/xsk.h>
+#include <numa.h>
 #include "shared.h"
+#include "map.h"
+#include "cpu_maps.h"
+#include "input_encoding.h"
+#include "player_server_xdp.skel.h"
 
 struct bpf_t
 {
     int interface_index;
+    struct player_server_xdp * skel;
     struct xdp_program * program;
     bool attached_native;
     bool attached_skb;
     int counters_fd;
+    int packet_counters_fd;
     int inputs_processed_fd;
     int server_stats_fd;
+    int xsk_map_fd;
+    int latency_fd;
+    size_t latency_size;
+    const struct latency_histograms * latency;
+    struct cpu_map_spec_t input_buffer_spec;
+    struct cpu_map_spec_t player_state_spec;
+    int num_cpu_maps;
+    int input_buffer_fd[MAX_CPUS];
+    int player_state_fd[MAX_CPUS];
+#if PLAYER_STATE_USER_RINGBUF
+    struct cpu_map_spec_t player_state_commit_spec;
+    int player_state_commit_fd[MAX_CPUS];
+#endif // #if PLAYER_STATE_USER_RINGBUF
+#if CPU_STEERING
+    int cpu_map_fd;
+    int cpu_steering_fd;
+    int num_steering_cpus;
+#endif // #if CPU_STEERING
 };
 
 static struct bpf_t bpf;
 
-int bpf_init( struct bpf_t * bpf, const char * interface_name )
+// ----------------------------------------------------------------------------------------------------------------------
+
+/*
+    Load time parameters
+
+    Map sizes in player_server_xdp.c are only defaults. Before the program is loaded we size the session map and the
+    definitions of the per-cpu input ring buffers and player state maps from these, then once it is loaded we create
+    an input buffer and player state map for each of the first max_cpus cpus (see cpu_maps.h). xdp drops inputs that
+    land on any other cpu.
+
+    max_sessions is the total across the cpus we use, by default SESSIONS_PER_CPU each, so capacity grows with the
+    cpu count. The session map keeps a separate lru list for every possible cpu, so it gets max_sessions / max_cpus
+    entries for each possible cpu, and each cpu we use holds its share of sessions before the least recently used
+    ones on it are evicted.
+
+    The input buffers only need to hold the inputs that can arrive while the worker isn't draining them, so they
+    are sized for input_buffer_ms of a full cpu of players each sending one new input per-packet.
+
+    port, inputs_per_packet, rate_limit, rate_limit_burst, join_cookies and debug are written into the program's
+    .rodata through the skeleton, before it is verified (see player_server_xdp.c).
+
+    state_send_rate=N has the workers send each player's state N times a second, instead of xdp replying to each input
+    packet with it (see shared.h). It is passed down to the workers, so it only works in ringbuf mode.
+
+    Each block=a.b.c.d/n is added to the blocklist once the program is loaded.
+*/
+
+#define MAX_BLOCKLIST_ARGS                                                                 64
+
+struct config_t
+{
+    int max_cpus;
+    int max_sessions;
+    int players_per_cpu;
+    int input_buffer_ms;
+    int port;
+    int inputs_per_packet;
+    int rate_limit;
+    int rate_limit_burst;
+    int rate_limit_sources;
+    int join_cookies;
+    int state_send_rate;
+    int debug;
+    int num_blocked;
+    struct blocklist_key blocked[MAX_BLOCKLIST_ARGS];
+};
+
+static struct config_t config = { MAX_CPUS, 0, PLAYERS_PER_CPU, INPUT_BUFFER_MILLISECONDS, SERVER_PORT, INPUTS_PER_PACKET, RATE_LIMIT_PACKETS_PER_SECOND, RATE_LIMIT_BURST, RATE_LIMIT_SOURCES, JOIN_COOKIES, STATE_SEND_RATE, 1 };
+
+static uint32_t input_buffer_size( const struct config_t * config )
+{
+    // ring buffer sizes must be a power of two number of pages. each record has an 8 byte header and is 8 byte aligned
+
+    const uint64_t record_bytes = ( BPF_RINGBUF_HDR_SZ + INPUT_RECORD_SIZE(1) + 7 ) & ~7ULL;
+
+    const uint64_t bytes = (uint64_t) config->players_per_cpu * INPUT_PACKETS_PER_SECOND * config->input_buffer_ms / 1000 * record_bytes;
+
+    uint64_t size = sysconf( _SC_PAGESIZE );
+    while ( size < bytes && size < ( 1ULL << 30 ) )
+    {
+        size *= 2;
+    }
+
+    return (uint32_t) size;
+}
+
+static uint32_t sessions_per_cpu( const struct config_t * config )
+{
+    // sessions stay on the cpu their packets are steered to, so each of the max_cpus cpus holds its share of max_sessions
+
+    return ( config->max_sessions + config->max_cpus - 1 ) / config->max_cpus;
+}
+
+static uint64_t session_map_entries( const struct config_t * config )
+{
+    // the session map is an lru per-cpu hash with BPF_F_NO_COMMON_LRU. max_entries is the total across all cpus, which
+    // the kernel splits evenly into one lru list per possible cpu, so size it for the share of every possible cpu
+
+    const int num_possible_cpus = libbpf_num_possible_cpus();
+    if ( num_possible_cpus <= 0 )
+        return 0;
+
+    return (uint64_t) sessions_per_cpu( config ) * num_possible_cpus;
+}
+
+#if PLAYER_STATE_USER_RINGBUF
+
+static uint32_t player_state_commit_buffer_size( const struct config_t * config )
+{
+    // user ring buffers are sized like ring buffers, with the same 8 byte aligned records
+
+    const uint64_t record_bytes = ( BPF_RINGBUF_HDR_SZ + sizeof(struct player_state_commit) + 7 ) & ~7ULL;
+
+    const uint64_t bytes = (uint64_t) config->players_per_cpu * PLAYER_STATE_COMMITS_PER_PLAYER * record_bytes;
+
+    uint64_t size = sysconf( _SC_PAGESIZE );
+    while ( size < bytes && size < ( 1ULL << 30 ) )
+    {
+        size *= 2;
+    }
+
+    return (uint32_t) size;
+}
+
+#endif // #if PLAYER_STATE_USER_RINGBUF
+
+static bool parse_config( int argc, char * argv[], int first, struct config_t * config )
+{
+    for ( int i = first; i < argc; i++ )
+    {
+        int value = 0;
+        unsigned int a, b, c, d, prefix_length;
+        if ( sscanf( argv[i], "block=%u.%u.%u.%u/%u", &a, &b, &c, &d, &prefix_length ) == 5 )
+        {
+            if ( config->num_blocked == MAX_BLOCKLIST_ARGS || a > 255 || b > 255 || c > 255 || d > 255 || prefix_length > 32 )
+                return false;
+            struct blocklist_key * key = &config->blocked[config->num_blocked++];
+            key->prefix_length = prefix_length;
+            key->address = htonl( ( a << 24 ) | ( b << 16 ) | ( c << 8 ) | d );
+        }
+        else if ( sscanf( argv[i], "max_cpus=%d", &value ) == 1 )
+            config->max_cpus = value;
+        else if ( sscanf( argv[i], "max_sessions=%d", &value ) == 1 )
+            config->max_sessions = value;
+        else if ( sscanf( argv[i], "players_per_cpu=%d", &value ) == 1 )
+            config->players_per_cpu = value;
+        else if ( sscanf( argv[i], "input_buffer_ms=%d", &value ) == 1 )
+            config->input_buffer_ms = value;
+        else if ( sscanf( argv[i], "port=%d", &value ) == 1 )
+            config->port = value;
+        else if ( sscanf( argv[i], "inputs_per_packet=%d", &value ) == 1 )
+            config->inputs_per_packet = value;
+        else if ( sscanf( argv[i], "rate_limit=%d", &value ) == 1 )
+            config->rate_limit = value;
+        else if ( sscanf( argv[i], "rate_limit_burst=%d", &value ) == 1 )
+            config->rate_limit_burst = value;
+        else if ( sscanf( argv[i], "rate_limit_sources=%d", &value ) == 1 )
+            config->rate_limit_sources = value;
+        else if ( sscanf( argv[i], "join_cookies=%d", &value ) == 1 )
+            config->join_cookies = value;
+        else if ( sscanf( argv[i], "state_send_rate=%d", &value ) == 1 )
+            config->state_send_rate = value;
+        else if ( sscanf( argv[i], "debug=%d", &value ) == 1 )
+            config->debug = value;
+        else
+            return false;
+    }
+
+    // unless it is given, session capacity grows with the cpus we use
+
+    if ( config->max_sessions == 0 )
+    {
+        config->max_sessions = config->max_cpus * SESSIONS_PER_CPU;
+    }
+
+    return config->max_cpus > 0 && config->max_cpus <= MAX_CPUS && config->max_sessions > 0 && config->players_per_cpu > 0 && config->input_buffer_ms > 0 &&
+           config->port > 0 && config->port <= 65535 && config->inputs_per_packet > 0 && config->inputs_per_packet <= INPUTS_PER_PACKET &&
+           config->rate_limit >= 0 && config->rate_limit <= 1000000 && config->rate_limit_burst > 0 && config->rate_limit_burst <= 1000000 &&
+           config->rate_limit_sources > 0 && ( config->join_cookies == 0 || config->join_cookies == 1 ) && config->state_send_rate >= 0 && config->state_send_rate <= 1000;
+}
+
+static int configure_maps( struct bpf_t * bpf, const struct config_t * config )
+{
+    // a pinned map from a previous run is reused as is, whatever size we ask for here, so unpin the ones we size
+
+    unlink( "/sys/fs/bpf/session_map" );
+    unlink( "/sys/fs/bpf/input_buffer_map" );
+    unlink( "/sys/fs/bpf/player_state_map" );
+    unlink( "/sys/fs/bpf/player_state_commit_map" );
+
+    struct bpf_object * object = bpf->skel->obj;
+
+    const uint64_t session_entries = session_map_entries( config );
+    if ( session_entries == 0 || session_entries > UINT32_MAX )
+    {
+        printf( "\nerror: could not size session map for %d sessions\n\n", config->max_sessions );
+        return 1;
+    }
+
+    struct bpf_map * session_map = bpf_object__find_map_by_name( object, "session_map" );
+    if ( !session_map || bpf_map__set_max_entries( session_map, (uint32_t) session_entries ) != 0 )
+    {
+        printf( "\nerror: could not set size of session map\n\n" );
+        return 1;
+    }
+
+    struct bpf_map * rate_limit_map = bpf_object__find_map_by_name( object, "rate_limit_map" );
+    if ( !rate_limit_map || bpf_map__set_max_entries( rate_limit_map, config->rate_limit_sources ) != 0 )
+    {
+        printf( "\nerror: could not set size of rate limit map\n\n" );
+        return 1;
+    }
+
+    if ( cpu_map_spec_init( &bpf->input_buffer_spec, object, "input_buffer_map", input_buffer_size( config ) ) != 0 )
+    {
+        printf( "\nerror: could not set size of input buffers\n\n" );
+        return 1;
+    }
+
+    if ( cpu_map_spec_init( &bpf->player_state_spec, object, "player_state_map", config->players_per_cpu ) != 0 )
+    {
+        printf( "\nerror: could not set size of player state maps\n\n" );
+        return 1;
+    }
+
+#if PLAYER_STATE_USER_RINGBUF
+    if ( cpu_map_spec_init( &bpf->player_state_commit_spec, object, "player_state_commit_map", player_state_commit_buffer_size( config ) ) != 0 )
+    {
+        printf( "\nerror: could not set size of player state commit buffers\n\n" );
+        return 1;
+    }
+#endif // #if PLAYER_STATE_USER_RINGBUF
+
+    return 0;
+}
+
+static int create_cpu_maps( struct bpf_t * bpf, const struct config_t * config )
+{
+    for ( int i = 0; i < config->max_cpus; i++ )
+    {
+        bpf->input_buffer_fd[i] = cpu_map_create( &bpf->input_buffer_spec, "input_buffer", i );
+        if ( bpf->input_buffer_fd[i] < 0 )
+        {
+            printf( "\nerror: could not create input buffer for cpu %d: %s\n\n", i, strerror(errno) );
+            return 1;
+        }
+
+        bpf->player_state_fd[i] = cpu_map_create( &bpf->player_state_spec, "player_state", i );
+        if ( bpf->player_state_fd[i] < 0 )
+        {
+            close( bpf->input_buffer_fd[i] );
+            printf( "\nerror: could not create player state map for cpu %d: %s\n\n", i, strerror(errno) );
+            return 1;
+        }
+
+#if PLAYER_STATE_USER_RINGBUF
+        bpf->player_state_commit_fd[i] = cpu_map_create( &bpf->player_state_commit_spec, "state_commit", i );
+        if ( bpf->player_state_commit_fd[i] < 0 )
+        {
+            close( bpf->input_buffer_fd[i] );
+            close( bpf->player_state_fd[i] );
+            printf( "\nerror: could not create player state commit buffer for cpu %d: %s\n\n", i, strerror(errno) );
+            return 1;
+        }
+#endif // #if PLAYER_STATE_USER_RINGBUF
+
+        bpf->num_cpu_maps++;
+    }
+
+    return 0;
+}
+
+static uint64_t map_memory_bytes( int fd )
+{
+    // the kernel's own count of the memory a map uses. accurate for every map type since linux 6.4
+
+    char path[64];
+    snprintf( path, sizeof(path), "/proc/self/fdinfo/%d", fd );
+
+    FILE * file = fopen( path, "r" );
+    if ( !file )
+        return 0;
+
+    uint64_t bytes = 0;
+    char line[256];
+    while ( fgets( line, sizeof(line), file ) )
+    {
+        if ( sscanf( line, "memlock: %" SCNu64, &bytes ) == 1 )
+            break;
+    }
+
+    fclose( file );
+
+    return bytes;
+}
+
+static const char * map_type_name( enum bpf_map_type type )
+{
+    switch ( type )
+    {
+        case BPF_MAP_TYPE_ARRAY:            return "array";
+        case BPF_MAP_TYPE_PERCPU_ARRAY:     return "percpu array";
+        case BPF_MAP_TYPE_HASH:             return "hash";
+        case BPF_MAP_TYPE_LRU_HASH:         return "lru hash";
+        case BPF_MAP_TYPE_LRU_PERCPU_HASH:  return "lru percpu hash";
+        case BPF_MAP_TYPE_ARRAY_OF_MAPS:    return "array of maps";
+        case BPF_MAP_TYPE_RINGBUF:          return "ringbuf";
+        case BPF_MAP_TYPE_USER_RINGBUF:     return "user ringbuf";
+        case BPF_MAP_TYPE_XSKMAP:           return "xskmap";
+        case BPF_MAP_TYPE_CPUMAP:           return "cpumap";
+        case BPF_MAP_TYPE_LPM_TRIE:         return "lpm trie";
+        default:                            return "other";
+    }
+}
+
+static void print_memory_budget_row( const char * name, enum bpf_map_type type, int count, uint32_t max_entries, uint64_t bytes )
+{
+    printf( "    %-24s %-16s %6d %12u %12.2f\n", name, map_type_name( type ), count, max_entries, bytes / ( 1024.0 * 1024.0 ) );
+}
+
+static void print_memory_budget( const struct bpf_t * bpf )
+{
+    printf( "map memory budget:\n" );
+    printf( "    %-24s %-16s %6s %12s %12s\n", "map", "type", "maps", "max entries", "MB" );
+
+    uint64_t total_bytes = 0;
+
+    struct bpf_map * map;
+    bpf_object__for_each_map( map, bpf->skel->obj )
+    {
+        const int fd = bpf_map__fd( map );
+        if ( fd < 0 )
+            continue;
+
+        const uint64_t bytes = map_memory_bytes( fd );
+        print_memory_budget_row( bpf_map__name( map ), bpf_map__type( map ), 1, bpf_map__max_entries( map ), bytes );
+        total_bytes += bytes;
+    }
+
+    // the per-cpu maps we created get one line for all cpus
+
+    uint64_t input_buffer_bytes = 0;
+    uint64_t player_state_bytes = 0;
+
+    for ( int i = 0; i < bpf->num_cpu_maps; i++ )
+    {
+        input_buffer_bytes += map_memory_bytes( bpf->input_buffer_fd[i] );
+        player_state_bytes += map_memory_bytes( bpf->player_state_fd[i] );
+    }
+
+    print_memory_budget_row( "input_buffer (per-cpu)", bpf->input_buffer_spec.type, bpf->num_cpu_maps, bpf->input_buffer_spec.max_entries, input_buffer_bytes );
+    print_memory_budget_row( "player_state (per-cpu)", bpf->player_state_spec.type, bpf->num_cpu_maps, bpf->player_state_spec.max_entries, player_state_bytes );
+
+    total_bytes += input_buffer_bytes + player_state_bytes;
+
+#if PLAYER_STATE_USER_RINGBUF
+    uint64_t player_state_commit_bytes = 0;
+    for ( int i = 0; i < bpf->num_cpu_maps; i++ )
+    {
+        player_state_commit_bytes += map_memory_bytes( bpf->player_state_commit_fd[i] );
+    }
+    print_memory_budget_row( "state_commit (per-cpu)", bpf->player_state_commit_spec.type, bpf->num_cpu_maps, bpf->player_state_commit_spec.max_entries, player_state_commit_bytes );
+    total_bytes += player_state_commit_bytes;
+#endif // #if PLAYER_STATE_USER_RINGBUF
+
+    printf( "    %-24s %-16s %6s %12s %12.2f\n", "total", "", "", "", total_bytes / ( 1024.0 * 1024.0 ) );
+}
+
+#if CPU_STEERING
+
+int set_cpu_steering( struct bpf_t * bpf, int bucket, int cpu )
+{
+    // sessions with session_id % CPU_STEERING_BUCKETS == bucket are processed on this cpu
+
+    __u32 key = bucket;
+    __u32 value = cpu;
+    return bpf_map_update_elem( bpf->cpu_steering_fd, &key, &value, BPF_ANY );
+}
+
+#endif // #if CPU_STEERING
+
+int bpf_init( struct bpf_t * bpf, const char * interface_name, const struct config_t * config )
 {
     // we can only run xdp programs as root
 
@@ -94,9 +489,63 @@ int bpf_init( struct bpf_t * bpf, const char * interface_name )
 
     printf( "loading player_server_xdp...\n" );
 
-    bpf->program = xdp_program__open_file( "player_server_xdp.o", "xdp", NULL );
+    bpf->skel = player_server_xdp__open();
+    if ( !bpf->skel )
+    {
+        printf( "\nerror: could not open player_server_xdp skeleton\n\n" );
+        return 1;
+    }
+
+    bpf->skel->rodata->server_port = htons( config->port );
+    bpf->skel->rodata->inputs_per_packet = config->inputs_per_packet;
+    bpf->skel->rodata->players_per_cpu = config->players_per_cpu;
+    bpf->skel->rodata->rate_limit = config->rate_limit;
+    bpf->skel->rodata->rate_limit_burst = config->rate_limit_burst;
+    bpf->skel->rodata->join_cookies = config->join_cookies;
+    bpf->skel->rodata->state_replies = config->state_send_rate == 0;
+    bpf->skel->rodata->debug = config->debug;
+
+    printf( "%d cpus, %d players per-cpu, %u sessions per-cpu (%" PRIu64 " session map entries), %.1fMB input buffer per-cpu (%dms)\n", config->max_cpus, config->players_per_cpu, sessions_per_cpu( config ), session_map_entries( config ), input_buffer_size( config ) / ( 1024.0 * 1024.0 ), config->input_buffer_ms );
+
+    printf( "port %d, %d inputs per-packet, join cookies %d, debug %d\n", config->port, config->inputs_per_packet, config->join_cookies, config->debug );
+
+    if ( config->state_send_rate > 0 )
+    {
+        printf( "workers send player state %d times per-second\n", config->state_send_rate );
+    }
+
+    printf( "rate limit %d packets per-second per source (burst %d, %d sources), %d blocked prefixes\n", config->rate_limit, config->rate_limit_burst, config->rate_limit_sources, config->num_blocked );
+
+    if ( configure_maps( bpf, config ) != 0 )
+    {
+        return 1;
+    }
+
+#if CPU_STEERING
+
+    // libxdp only loads the program it attaches, and turns off autoload for every other program in the object. the second
+    // stage has to be loaded too before it can go in the cpu map, so load the skeleton ourselves, then hand libxdp the
+    // first stage to attach
+
+    if ( player_server_xdp__load( bpf->skel ) != 0 )
+    {
+        printf( "\nerror: could not load player_server_xdp program\n\n" );
+        return 1;
+    }
+
+    bpf->program = xdp_program__from_fd( bpf_program__fd( bpf->skel->progs.server_xdp_filter ) );
+
+#else // #if CPU_STEERING
+
+    // libxdp loads the object when it attaches the program
+
+    bpf->program = xdp_program__from_bpf_obj( bpf->skel->obj, "xdp" );
+
+#endif // #if CPU_STEERING
+
     if ( libxdp_get_error( bpf->program ) ) 
     {
+        bpf->program = NULL;
         printf( "\nerror: could not load player_server_xdp program\n\n");
         return 1;
     }
@@ -125,6 +574,37 @@ int bpf_init( struct bpf_t * bpf, const char * interface_name )
         }
     }
 
+    // sign join cookies with a random key. the key map only exists once the program is loaded, so any join challenged
+    // before now was signed with a zero key. its join fails and the client asks for a new challenge
+
+    {
+        struct join_cookie_key key;
+        if ( getrandom( &key, sizeof(key), 0 ) != sizeof(key) )
+        {
+            printf( "\nerror: could not generate join cookie key\n\n" );
+            return 1;
+        }
+
+        int zero = 0;
+        if ( bpf_map_update_elem( bpf_map__fd( bpf->skel->maps.join_cookie_key_map ), &zero, &key, BPF_ANY ) != 0 )
+        {
+            printf( "\nerror: could not set join cookie key: %s\n\n", strerror(errno) );
+            return 1;
+        }
+    }
+
+    // block the prefixes we were given. the blocklist is pinned, so entries from a previous run are still there too
+
+    for ( int i = 0; i < config->num_blocked; i++ )
+    {
+        __u8 value = 1;
+        if ( bpf_map_update_elem( bpf_map__fd( bpf->skel->maps.blocklist_map ), &config->blocked[i], &value, BPF_ANY ) != 0 )
+        {
+            printf( "\nerror: could not add blocked prefix: %s\n\n", strerror(errno) );
+            return 1;
+        }
+    }
+
     // bump rlimit
 
     struct rlimit rlim_new = {
@@ -138,33 +618,88 @@ int bpf_init( struct bpf_t * bpf, const char * interface_name )
         return 1;
     }
 
-    // get the file handle to counters
+    // create the input buffer and player state map for each cpu, then report what every map costs
 
-    bpf->counters_fd = bpf_obj_get( "/sys/fs/bpf/counters_map" );
-    if ( bpf->counters_fd <= 0 )
+    if ( create_cpu_maps( bpf, config ) != 0 )
     {
-        printf( "\nerror: could not get counters map: %s\n\n", strerror(errno) );
         return 1;
     }
 
-    // get the file handle to inputs processed
+    print_memory_budget( bpf );
+
+    // the skeleton has the map fds, so we don't need to look them up through their pins. the maps are still pinned for the workers
+
+    bpf->counters_fd = bpf_map__fd( bpf->skel->maps.counters_map );
+    bpf->packet_counters_fd = bpf_map__fd( bpf->skel->maps.packet_counters_map );
+    bpf->inputs_processed_fd = bpf_map__fd( bpf->skel->maps.inputs_processed_map );
+    bpf->server_stats_fd = bpf_map__fd( bpf->skel->maps.server_stats );
+    bpf->xsk_map_fd = bpf_map__fd( bpf->skel->maps.xsk_map );
+    bpf->latency_fd = bpf_map__fd( bpf->skel->maps.latency_map );
+
+    // map the latency histograms the workers write into
+
+    const size_t page_size = sysconf( _SC_PAGESIZE );
+
+    bpf->latency_size = ( ( sizeof(struct latency_histograms) * MAX_CPUS + page_size - 1 ) / page_size ) * page_size;
 
-    bpf->inputs_processed_fd = bpf_obj_get( "/sys/fs/bpf/inputs_processed_map" );
-    if ( bpf->inputs_processed_fd <= 0 )
+    void * latency = mmap( NULL, bpf->latency_size, PROT_READ, MAP_SHARED, bpf->latency_fd, 0 );
+    if ( latency == MAP_FAILED )
     {
-        printf( "\nerror: could not get inputs processed map: %s\n\n", strerror(errno) );
+        printf( "\nerror: could not mmap latency map: %s\n\n", strerror(errno) );
         return 1;
     }
 
-    // get the file handle to the server stats
+    bpf->latency = (const struct latency_histograms*) latency;
 
-    bpf->server_stats_fd = bpf_obj_get( "/sys/fs/bpf/server_stats" );
-    if ( bpf->server_stats_fd <= 0 )
+#if CPU_STEERING
+
+    // point every cpu in the cpu map at the second stage xdp program, so steered packets are processed there
+
+    bpf->cpu_map_fd = bpf_map__fd( bpf->skel->maps.cpu_map );
+    bpf->cpu_steering_fd = bpf_map__fd( bpf->skel->maps.cpu_steering_map );
+
+    struct bpf_program * steered_program = bpf->skel->progs.server_xdp_steered;
+    if ( bpf_program__fd( steered_program ) < 0 )
     {
-        printf( "\nerror: could not get server stats: %s\n\n", strerror(errno) );
+        printf( "\nerror: server_xdp_steered program is not loaded\n\n" );
         return 1;
     }
 
+    bpf->num_steering_cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( bpf->num_steering_cpus > config->max_cpus )
+    {
+        bpf->num_steering_cpus = config->max_cpus;
+    }
+
+    for ( int i = 0; i < bpf->num_steering_cpus; i++ )
+    {
+        __u32 cpu = i;
+        struct bpf_cpumap_val value;
+        memset( &value, 0, sizeof(value) );
+        value.qsize = 2048;
+        value.bpf_prog.fd = bpf_program__fd( steered_program );
+        if ( bpf_map_update_elem( bpf->cpu_map_fd, &cpu, &value, BPF_ANY ) != 0 )
+        {
+            printf( "\nerror: could not add cpu %d to cpu map: %s\n\n", i, strerror(errno) );
+            return 1;
+        }
+    }
+
+    // spread sessions evenly across all cpus, not just the ones with rx queues
+
+    for ( int i = 0; i < CPU_STEERING_BUCKETS; i++ )
+    {
+        if ( set_cpu_steering( bpf, i, i % bpf->num_steering_cpus ) != 0 )
+        {
+            printf( "\nerror: could not set cpu steering: %s\n\n", strerror(errno) );
+            return 1;
+        }
+    }
+
+    printf( "steering sessions across %d cpus\n", bpf->num_steering_cpus );
+
+#endif // #if CPU_STEERING
+
     printf( "ready\n" );
 
     return 0;
@@ -174,6 +709,22 @@ void bpf_shutdown( struct bpf_t * bpf )
 {
     assert( bpf );
 
+    if ( bpf->latency )
+    {
+        munmap( (void*) bpf->latency, bpf->latency_size );
+        bpf->latency = NULL;
+    }
+
+    for ( int i = 0; i < bpf->num_cpu_maps; i++ )
+    {
+        close( bpf->input_buffer_fd[i] );
+        close( bpf->player_state_fd[i] );
+#if PLAYER_STATE_USER_RINGBUF
+        close( bpf->player_state_commit_fd[i] );
+#endif // #if PLAYER_STATE_USER_RINGBUF
+    }
+    bpf->num_cpu_maps = 0;
+
     if ( bpf->program != NULL )
     {
         if ( bpf->attached_native )
@@ -185,6 +736,13 @@ void bpf_shutdown( struct bpf_t * bpf )
             xdp_program__detach( bpf->program, bpf->interface_index, XDP_MODE_SKB, 0 );
         }
         xdp_program__close( bpf->program );
+        bpf->program = NULL;
+    }
+
+    if ( bpf->skel != NULL )
+    {
+        player_server_xdp__destroy( bpf->skel );
+        bpf->skel = NULL;
     }
 }
 
@@ -222,63 +780,755 @@ int pin_thread_to_cpu( int cpu )
     return pthread_setaffinity_np( current_thread, sizeof(cpu_set_t), &cpuset );
 }
 
-int main( int argc, char *argv[] )
-{
-    signal( SIGINT,  interrupt_handler );
-    signal( SIGTERM, clean_shutdown_handler );
-    signal( SIGHUP,  clean_shutdown_handler );
+// ----------------------------------------------------------------------------------------------------------------------
 
-    if ( argc != 2 )
-    {
-        printf( "\nusage: server <interface name>\n\n" );
-        return 1;
-    }
+/*
+    AF_XDP input path (optional)
 
-    const char * interface_name = argv[1];
+    One XSK socket is bound per NIC queue. The XDP program redirects input packets for known sessions to the socket
+    on their queue, and a worker thread pinned to the matching CPU simulates the player straight out of the UMEM
+    frame, then writes the player state packet back into the same frame and sends it from userspace.
 
-    if ( bpf_init( &bpf, interface_name ) != 0 )
-    {
-        cleanup();
-        return 1;
-    }
+    Players are stepped and expired exactly as in player_server_worker.go, so the inputs/sec of the two paths can be
+    compared. The xsk worker does not make the zone database round trip per input that the Go worker does.
+*/
 
-    // fork workers
+#define XSK_NUM_FRAMES                                                                   4096
+#define XSK_FRAME_SIZE                                           XSK_UMEM__DEFAULT_FRAME_SIZE
+#define XSK_BATCH_SIZE                                                                     64
+#define XSK_PLAYER_TIMEOUT                                                                 15
 
-    for ( int i = 0; i < MAX_CPUS; i++ )
-    {   
-        pid_t c = fork();
-        if ( c == 0 )
-        { 
-            // child worker process
-            printf( "starting player server worker on cpu #%d\n", i );
-            fflush( stdout );
-            char cpu_string[64];
-            sprintf( cpu_string, "%d", i );
-            char * args[] = { "taskset", "-c", cpu_string, "./player_server_worker", cpu_string, 0 };
-            execv( "/usr/bin/taskset", args );
-            exit(0); 
-        } 
-    }
+struct xsk_player_t
+{
+    uint64_t next_input_sequence;
+    uint64_t last_input_time;
+    struct player_state state;
+};
 
-    // main loop
+struct xsk_worker_t
+{
+    int queue;
+    bool zero_copy;
+    void * umem_area;
+    struct xsk_umem * umem;
+    struct xsk_ring_prod fill;
+    struct xsk_ring_cons comp;
+    struct xsk_ring_cons rx;
+    struct xsk_ring_prod tx;
+    struct xsk_socket * xsk;
+    struct map_t * player_map;
+    int num_players;
+    int max_players;
+    uint64_t * player_session_ids;                  // every session in player_map, walked once a second to expire players
+    uint64_t last_expire_time;
+    uint8_t input_decode_buffer[INPUT_DECODE_BUFFER_SIZE];
+    struct input_packet input_packet;
+};
 
-    unsigned int num_cpus = libbpf_num_possible_cpus();
+static int num_xsk_workers;
+static struct xsk_worker_t xsk_worker[MAX_CPUS];
 
-    uint64_t previous_inputs_processed = 0;
-    uint64_t previous_player_state_packets_sent = 0;
+static uint64_t xsk_inputs_processed[MAX_CPUS];
+static uint64_t xsk_player_state_packets_sent[MAX_CPUS];
+static uint64_t xsk_player_state_bytes_sent[MAX_CPUS];
 
-    while ( !quit )
+int get_num_rx_queues( const char * interface_name )
+{
+    int num_queues = 0;
+    for ( int i = 0; i < MAX_CPUS; i++ )
+    {
+        char path[1024];
+        snprintf( path, sizeof(path), "/sys/class/net/%s/queues/rx-%d", interface_name, i );
+        if ( access( path, F_OK ) != 0 )
+            break;
+        num_queues++;
+    }
+    return num_queues;
+}
+
+int xsk_worker_init( struct xsk_worker_t * worker, const char * interface_name, int queue, int xsk_map_fd, int players_per_cpu )
+{
+    worker->queue = queue;
+
+    // the worker runs on the cpu with the same index as its queue, so put its players on that cpu's numa node
+
+    const int numa_node = numa_available() >= 0 ? numa_node_of_cpu( queue ) : -1;
+
+    worker->player_map = map_create( sizeof(struct xsk_player_t), players_per_cpu, numa_node );
+
+    printf( "xsk worker %d: player arena is %.1fMB on numa node %d (cpu node is %d), %s pages\n", queue, worker->player_map->arena_bytes / ( 1024.0 * 1024.0 ), map_arena_node( worker->player_map ), numa_node, worker->player_map->arena_huge_pages ? "2MB" : "4KB" );
+
+    const uint64_t umem_size = XSK_NUM_FRAMES * XSK_FRAME_SIZE;
+
+    worker->umem_area = mmap( NULL, umem_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0 );
+    if ( worker->umem_area == MAP_FAILED )
+    {
+        worker->umem_area = NULL;
+        printf( "\nerror: could not allocate umem for queue %d\n\n", queue );
+        return 1;
+    }
+
+    struct xsk_umem_config umem_config = {
+        .fill_size = XSK_NUM_FRAMES,
+        .comp_size = XSK_NUM_FRAMES,
+        .frame_size = XSK_FRAME_SIZE,
+        .frame_headroom = 0,
+        .flags = 0,
+    };
+
+    int err = xsk_umem__create( &worker->umem, worker->umem_area, umem_size, &worker->fill, &worker->comp, &umem_config );
+    if ( err != 0 )
+    {
+        printf( "\nerror: could not create umem for queue %d: %s\n\n", queue, strerror(-err) );
+        return 1;
+    }
+
+    // try zero copy first, then fall back to copy mode if the driver doesn't support it
+
+    struct xsk_socket_config socket_config = {
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .libxdp_flags = XSK_LIBXDP_FLAGS__INHIBIT_PROG_LOAD,
+        .xdp_flags = 0,
+        .bind_flags = XDP_ZEROCOPY | XDP_USE_NEED_WAKEUP,
+    };
+
+    worker->zero_copy = true;
+
+    err = xsk_socket__create( &worker->xsk, interface_name, queue, worker->umem, &worker->rx, &worker->tx, &socket_config );
+    if ( err != 0 )
+    {
+        worker->zero_copy = false;
+        socket_config.bind_flags = XDP_COPY | XDP_USE_NEED_WAKEUP;
+        err = xsk_socket__create( &worker->xsk, interface_name, queue, worker->umem, &worker->rx, &worker->tx, &socket_config );
+        if ( err != 0 )
+        {
+            printf( "\nerror: could not create xsk socket for queue %d: %s\n\n", queue, strerror(-err) );
+            return 1;
+        }
+    }
+
+    err = xsk_socket__update_xskmap( worker->xsk, xsk_map_fd );
+    if ( err != 0 )
+    {
+        printf( "\nerror: could not add xsk socket for queue %d to xsk map: %s\n\n", queue, strerror(-err) );
+        return 1;
+    }
+
+    // give all frames to the kernel. the fill ring holds every frame, so recycling a frame back to it never fails
+
+    uint32_t fill_index = 0;
+    if ( xsk_ring_prod__reserve( &worker->fill, XSK_NUM_FRAMES, &fill_index ) != XSK_NUM_FRAMES )
+    {
+        printf( "\nerror: could not populate fill ring for queue %d\n\n", queue );
+        return 1;
+    }
+    for ( int i = 0; i < XSK_NUM_FRAMES; i++ )
+    {
+        *xsk_ring_prod__fill_addr( &worker->fill, fill_index++ ) = (uint64_t) i * XSK_FRAME_SIZE;
+    }
+    xsk_ring_prod__submit( &worker->fill, XSK_NUM_FRAMES );
+
+    printf( "xsk socket bound to queue %d (%s)\n", queue, worker->zero_copy ? "zero copy" : "copy" );
+
+    return 0;
+}
+
+void xsk_worker_shutdown( struct xsk_worker_t * worker )
+{
+    if ( worker->xsk )
+    {
+        xsk_socket__delete( worker->xsk );
+        worker->xsk = NULL;
+    }
+    if ( worker->umem )
+    {
+        xsk_umem__delete( worker->umem );
+        worker->umem = NULL;
+    }
+    if ( worker->umem_area )
+    {
+        munmap( worker->umem_area, XSK_NUM_FRAMES * XSK_FRAME_SIZE );
+        worker->umem_area = NULL;
+    }
+    if ( worker->player_map )
+    {
+        map_destroy( worker->player_map );
+        worker->player_map = NULL;
+    }
+    free( worker->player_session_ids );
+    worker->player_session_ids = NULL;
+    worker->num_players = 0;
+    worker->max_players = 0;
+}
+
+static void reflect_packet( uint8_t * frame, int payload_bytes )
+{
+    struct ethhdr * eth = (struct ethhdr*) frame;
+    struct iphdr  * ip  = (struct iphdr*) ( frame + sizeof( struct ethhdr ) );
+    struct udphdr * udp = (struct udphdr*) ( (uint8_t*) ip + sizeof( struct iphdr ) );
+
+    uint16_t a = udp->source;
+    udp->source = udp->dest;
+    udp->dest = a;
+    udp->check = 0;
+    udp->len = htons( sizeof(struct udphdr) + payload_bytes );
+
+    uint32_t b = ip->saddr;
+    ip->saddr = ip->daddr;
+    ip->daddr = b;
+    ip->tot_len = htons( sizeof(struct iphdr) + sizeof(struct udphdr) + payload_bytes );
+    ip->check = 0;
+
+    uint8_t c[ETH_ALEN];
+    memcpy( c, eth->h_source, ETH_ALEN );
+    memcpy( eth->h_source, eth->h_dest, ETH_ALEN );
+    memcpy( eth->h_dest, c, ETH_ALEN );
+
+    uint16_t * p = (uint16_t*) ip;
+    uint32_t checksum = 0;
+    for ( int i = 0; i < 10; i++ )
+    {
+        checksum += p[i];
+    }
+    checksum = ~ ( ( checksum & 0xFFFF ) + ( checksum >> 16 ) );
+    ip->check = checksum;
+}
+
+static int xsk_process_input( struct xsk_worker_t * worker, uint8_t * frame, uint32_t frame_bytes )
+{
+    // returns the size of the player state reply written into the frame, or zero if nothing should be sent
+
+    const int header_bytes = sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr);
+
+    if ( frame_bytes < header_bytes + 1 + 8 || frame_bytes - header_bytes > INPUT_DECODE_BUFFER_SIZE )
+        return 0;
+
+    uint8_t * payload = frame + header_bytes;
+
+    if ( payload[0] != INPUT_PACKET )
+        return 0;
+
+    // the decoder reads a whole INPUT_DECODE_BUFFER_SIZE buffer, see input_encoding.h
+
+    const uint32_t payload_bytes = frame_bytes - header_bytes;
+
+    memcpy( worker->input_decode_buffer, payload, payload_bytes );
+
+    struct input_packet * packet = &worker->input_packet;
+
+    const int inputs_decoded = input_packet_decode( worker->input_decode_buffer, payload_bytes, packet, config.inputs_per_packet );
+    if ( inputs_decoded <= 0 )
+        return 0;
+
+    const uint64_t session_id = packet->session_id;
+    const uint64_t sequence = packet->sequence;
+    uint64_t t = packet->t;
+
+    struct xsk_player_t * player = map_get( worker->player_map, session_id );
+    if ( !player )
+    {
+        if ( worker->num_players == worker->max_players )
+        {
+            const int max_players = worker->max_players ? worker->max_players * 2 : PLAYERS_PER_CPU;
+            uint64_t * player_session_ids = realloc( worker->player_session_ids, max_players * sizeof(uint64_t) );
+            if ( !player_session_ids )
+                return 0;
+            worker->player_session_ids = player_session_ids;
+            worker->max_players = max_players;
+        }
+        player = map_insert( worker->player_map, session_id );
+        if ( !player )
+            return 0;
+        player->next_input_sequence = 1000;
+        worker->player_session_ids[worker->num_players++] = session_id;
+    }
+
+    player->last_input_time = time( NULL );
+
+    if ( sequence < player->next_input_sequence )
+        return 0;
+
+    uint64_t n = ( sequence - player->next_input_sequence ) + 1;
+    if ( n > (uint64_t) inputs_decoded )
+    {
+        n = inputs_decoded;
+    }
+
+    // inputs are most recent first, so walk t back to the oldest input then step forward, as the Go worker does
+
+    struct input_data * inputs = packet->inputs;
+
+    struct player_state * state = &player->state;
+
+    uint8_t * state_bytes = (uint8_t*) state;
+
+    for ( int j = 1; j < (int) n; j++ )
+    {
+        t -= inputs[j].dt;
+    }
+
+    for ( int j = (int) n - 1; j >= 0; j-- )
+    {
+        for ( int i = 0; i < (int) sizeof(struct player_state); i++ )
+        {
+            state_bytes[i] ^= (uint8_t) t + (uint8_t) i;
+        }
+
+        t += inputs[j].dt;
+
+        state->t = t;
+    }
+
+    player->next_input_sequence = sequence + 1;
+
+    xsk_inputs_processed[worker->queue] += n;
+
+    // write the player state packet back into the same frame, acking the newest input. it can be bigger than the input packet, but fits in the frame.
+    // we keep no state history here, so the state is always sent in full (baseline 0, see shared.h)
+
+    payload[0] = PLAYER_STATE_PACKET;
+
+    memcpy( payload + 1, &sequence, 8 );
+
+    memset( payload + 1 + 8, 0, 8 );
+
+    memcpy( payload + 1 + 8 + 8, state, sizeof(struct player_state) );
+
+    reflect_packet( frame, PLAYER_STATE_PACKET_SIZE );
+
+    return header_bytes + PLAYER_STATE_PACKET_SIZE;
+}
+
+static void xsk_expire_players( struct xsk_worker_t * worker )
+{
+    // once a second, remove players that have sent no input for XSK_PLAYER_TIMEOUT seconds, like PlayerTimeout in the Go worker
+
+    const uint64_t current_time = time( NULL );
+    if ( current_time == worker->last_expire_time )
+        return;
+
+    worker->last_expire_time = current_time;
+
+    int i = 0;
+    while ( i < worker->num_players )
+    {
+        const uint64_t session_id = worker->player_session_ids[i];
+        struct xsk_player_t * player = map_get( worker->player_map, session_id );
+        if ( player && player->last_input_time + XSK_PLAYER_TIMEOUT >= current_time )
+        {
+            i++;
+            continue;
+        }
+        map_delete( worker->player_map, session_id );
+        worker->player_session_ids[i] = worker->player_session_ids[--worker->num_players];
+    }
+}
+
+static void xsk_recycle_frames( struct xsk_worker_t * worker, const uint64_t * frames, int num_frames )
+{
+    if ( num_frames == 0 )
+        return;
+
+    uint32_t fill_index = 0;
+    while ( xsk_ring_prod__reserve( &worker->fill, num_frames, &fill_index ) != num_frames )
+    {
+        // can't happen: every frame fits in the fill ring
+    }
+
+    for ( int i = 0; i < num_frames; i++ )
+    {
+        *xsk_ring_prod__fill_addr( &worker->fill, fill_index++ ) = frames[i];
+    }
+
+    xsk_ring_prod__submit( &worker->fill, num_frames );
+}
+
+void * xsk_worker_thread_function( void * context )
+{
+    struct xsk_worker_t * worker = (struct xsk_worker_t*) context;
+
+    pin_thread_to_cpu( worker->queue );
+
+    int xsk_fd = xsk_socket__fd( worker->xsk );
+
+    struct pollfd fds;
+    fds.fd = xsk_fd;
+    fds.events = POLLIN;
+
+    uint64_t frames[XSK_BATCH_SIZE];
+    struct xdp_desc replies[XSK_BATCH_SIZE];
+
+    while ( !quit )
+    {
+        xsk_expire_players( worker );
+
+        // frames the kernel has finished sending go back to the fill ring
+
+        uint32_t comp_index = 0;
+        int completed = xsk_ring_cons__peek( &worker->comp, XSK_BATCH_SIZE, &comp_index );
+        if ( completed > 0 )
+        {
+            for ( int i = 0; i < completed; i++ )
+            {
+                frames[i] = *xsk_ring_cons__comp_addr( &worker->comp, comp_index++ );
+            }
+            xsk_ring_cons__release( &worker->comp, completed );
+            xsk_recycle_frames( worker, frames, completed );
+        }
+
+        // receive input packets
+
+        uint32_t rx_index = 0;
+        int received = xsk_ring_cons__peek( &worker->rx, XSK_BATCH_SIZE, &rx_index );
+        if ( received == 0 )
+        {
+            poll( &fds, 1, completed > 0 ? 0 : 1000 );
+            continue;
+        }
+
+        int num_replies = 0;
+        int num_dropped = 0;
+
+        for ( int i = 0; i < received; i++ )
+        {
+            const struct xdp_desc * desc = xsk_ring_cons__rx_desc( &worker->rx, rx_index++ );
+            uint8_t * frame = xsk_umem__get_data( worker->umem_area, desc->addr );
+            int reply_bytes = xsk_process_input( worker, frame, desc->len );
+            if ( reply_bytes > 0 )
+            {
+                replies[num_replies].addr = desc->addr;
+                replies[num_replies].len = reply_bytes;
+                replies[num_replies].options = 0;
+                num_replies++;
+            }
+            else
+            {
+                frames[num_dropped++] = desc->addr;
+            }
+        }
+
+        xsk_ring_cons__release( &worker->rx, received );
+
+        // send player state packets back out of the same frames
+
+        if ( num_replies > 0 )
+        {
+            uint32_t tx_index = 0;
+            if ( xsk_ring_prod__reserve( &worker->tx, num_replies, &tx_index ) == num_replies )
+            {
+                for ( int i = 0; i < num_replies; i++ )
+                {
+                    *xsk_ring_prod__tx_desc( &worker->tx, tx_index++ ) = replies[i];
+                }
+                xsk_ring_prod__submit( &worker->tx, num_replies );
+                xsk_player_state_packets_sent[worker->queue] += num_replies;
+                for ( int i = 0; i < num_replies; i++ )
+                {
+                    xsk_player_state_bytes_sent[worker->queue] += replies[i].len - ( sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) );
+                }
+                if ( xsk_ring_prod__needs_wakeup( &worker->tx ) )
+                {
+                    sendto( xsk_fd, NULL, 0, MSG_DONTWAIT, NULL, 0 );
+                }
+            }
+            else
+            {
+                // tx ring is full. drop the replies
+                for ( int i = 0; i < num_replies; i++ )
+                {
+                    frames[num_dropped++] = replies[i].addr;
+                }
+            }
+        }
+
+        xsk_recycle_frames( worker, frames, num_dropped );
+    }
+
+    return NULL;
+}
+
+// ----------------------------------------------------------------------------------------------------------------------
+
+static uint64_t latency_histogram_value( int bucket )
+{
+    // lowest value in nanoseconds that goes in this bucket. see struct latency_histograms
+
+    if ( bucket < ( 1 << LATENCY_HISTOGRAM_SUB_BITS ) )
+        return bucket;
+
+    const int magnitude = ( bucket >> LATENCY_HISTOGRAM_SUB_BITS ) + LATENCY_HISTOGRAM_SUB_BITS - 1;
+
+    const uint64_t sub_bucket = ( bucket & ( ( 1 << LATENCY_HISTOGRAM_SUB_BITS ) - 1 ) ) + ( 1 << LATENCY_HISTOGRAM_SUB_BITS );
+
+    return sub_bucket << ( magnitude - LATENCY_HISTOGRAM_SUB_BITS );
+}
+
+static double latency_histogram_percentile( const uint64_t * histogram, uint64_t count, double percentile )
+{
+    // in microseconds
+
+    const uint64_t target = (uint64_t) ( count * percentile );
+    uint64_t sum = 0;
+    for ( int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++ )
+    {
+        sum += histogram[i];
+        if ( sum > target )
+        {
+            return latency_histogram_value( i ) / 1000.0;
+        }
+    }
+    return 0.0;
+}
+
+static uint64_t latency_histogram_delta( const __u64 * current, __u64 * previous, uint64_t * delta )
+{
+    // counts since the last call. returns the total
+
+    uint64_t count = 0;
+    for ( int i = 0; i < LATENCY_HISTOGRAM_BUCKETS; i++ )
+    {
+        const uint64_t value = __atomic_load_n( &current[i], __ATOMIC_RELAXED );
+        delta[i] = value - previous[i];
+        previous[i] = value;
+        count += delta[i];
+    }
+    return count;
+}
+
+// ----------------------------------------------------------------------------------------------------------------------
+
+static const char * packet_type_names[NUM_PACKET_TYPES] = { "other", "join request", "join response", "input", "stats request", "stats response", "player state", "join challenge" };
+
+static const char * drop_reason_names[NUM_DROP_REASONS] =
+{
+    "session not found",
+    "old input",
+    "no input buffer",
+    "ring buffer full",
+    "no player state map",
+    "player state not found",
+    "player state not ready",
+    "player state changed",
+    "packet too small",
+    "internal error",
+    "no player state slot",
+    "bad join cookie",
+    "blocked",
+    "rate limited",
+    "bad input packet",
+};
+
+static void print_packet_counters( const struct packet_counters * current, struct packet_counters * previous, int num_cpus )
+{
+    // totals over all cpus since the last call, then bandwidth per-cpu. zero counts are left out, so we only see what is happening
+
+    struct packet_counters delta;
+    memset( &delta, 0, sizeof(delta) );
+
+    printf( "xdp bandwidth per-cpu (mbps in/out):" );
+
+    for ( int i = 0; i < num_cpus; i++ )
+    {
+        for ( int j = 0; j < NUM_PACKET_TYPES; j++ )
+        {
+            delta.received[j] += current[i].received[j] - previous[i].received[j];
+            delta.sent[j] += current[i].sent[j] - previous[i].sent[j];
+        }
+
+        for ( int j = 0; j < NUM_DROP_REASONS; j++ )
+        {
+            delta.dropped[j] += current[i].dropped[j] - previous[i].dropped[j];
+        }
+
+        const uint64_t bytes_in = current[i].bytes_in - previous[i].bytes_in;
+        const uint64_t bytes_out = current[i].bytes_out - previous[i].bytes_out;
+
+        if ( bytes_in != 0 || bytes_out != 0 )
+        {
+            printf( " %d: %.1f/%.1f", i, bytes_in * 8 / 1000000.0, bytes_out * 8 / 1000000.0 );
+        }
+
+        previous[i] = current[i];
+    }
+
+    printf( "\nxdp packets received:" );
+    for ( int j = 0; j < NUM_PACKET_TYPES; j++ )
+    {
+        if ( delta.received[j] != 0 )
+            printf( " %s %" PRId64, packet_type_names[j], (uint64_t) delta.received[j] );
+    }
+
+    printf( "\nxdp packets sent:" );
+    for ( int j = 0; j < NUM_PACKET_TYPES; j++ )
+    {
+        if ( delta.sent[j] != 0 )
+            printf( " %s %" PRId64, packet_type_names[j], (uint64_t) delta.sent[j] );
+    }
+
+    printf( "\nxdp packets dropped:" );
+    for ( int j = 0; j < NUM_DROP_REASONS; j++ )
+    {
+        if ( delta.dropped[j] != 0 )
+            printf( " %s %" PRId64, drop_reason_names[j], (uint64_t) delta.dropped[j] );
+    }
+
+    printf( "\n" );
+}
+
+// ----------------------------------------------------------------------------------------------------------------------
+
+int main( int argc, char *argv[] )
+{
+    signal( SIGINT,  interrupt_handler );
+    signal( SIGTERM, clean_shutdown_handler );
+    signal( SIGHUP,  clean_shutdown_handler );
+
+    // by default, use every online cpu up to MAX_CPUS
+
+    const int num_online_cpus = sysconf( _SC_NPROCESSORS_ONLN );
+    if ( num_online_cpus > 0 && num_online_cpus < config.max_cpus )
+    {
+        config.max_cpus = num_online_cpus;
+    }
+
+    const bool has_mode = argc >= 3 && ( strcmp( argv[2], "ringbuf" ) == 0 || strcmp( argv[2], "xsk" ) == 0 );
+
+    if ( argc < 2 || !parse_config( argc, argv, has_mode ? 3 : 2, &config ) )
+    {
+        printf( "\nusage: server <interface name> [ringbuf|xsk] [max_cpus=N] [max_sessions=N] [players_per_cpu=N] [input_buffer_ms=N] [port=N] [inputs_per_packet=N] [rate_limit=N] [rate_limit_burst=N] [rate_limit_sources=N] [block=a.b.c.d/n ...] [join_cookies=0|1] [state_send_rate=N] [debug=0|1]\n\n" );
+        return 1;
+    }
+
+    const char * interface_name = argv[1];
+
+    const bool use_xsk = has_mode && strcmp( argv[2], "xsk" ) == 0;
+
+    if ( use_xsk && config.state_send_rate > 0 )
+    {
+        printf( "\nerror: state_send_rate only works in ringbuf mode\n\n" );
+        return 1;
+    }
+
+    if ( bpf_init( &bpf, interface_name, &config ) != 0 )
+    {
+        cleanup();
+        return 1;
+    }
+
+    pthread_t xsk_thread_id[MAX_CPUS];
+
+    if ( use_xsk )
+    {
+        // bind an xsk socket to each rx queue and process inputs on worker threads
+
+        num_xsk_workers = get_num_rx_queues( interface_name );
+        if ( num_xsk_workers > config.max_cpus )
+        {
+            num_xsk_workers = config.max_cpus;
+        }
+        if ( num_xsk_workers == 0 )
+        {
+            printf( "\nerror: could not find any rx queues for '%s'\n\n", interface_name );
+            cleanup();
+            return 1;
+        }
+
+        for ( int i = 0; i < num_xsk_workers; i++ )
+        {
+            if ( xsk_worker_init( &xsk_worker[i], interface_name, i, bpf.xsk_map_fd, config.players_per_cpu ) != 0 )
+            {
+                for ( int j = 0; j <= i; j++ )
+                {
+                    xsk_worker_shutdown( &xsk_worker[j] );
+                }
+                cleanup();
+                return 1;
+            }
+        }
+
+        for ( int i = 0; i < num_xsk_workers; i++ )
+        {
+            printf( "starting xsk worker thread on cpu #%d\n", i );
+            pthread_create( &xsk_thread_id[i], NULL, xsk_worker_thread_function, &xsk_worker[i] );
+        }
+    }
+    else
+    {
+        // fork workers
+
+        for ( int i = 0; i < config.max_cpus; i++ )
+        {   
+            pid_t c = fork();
+            if ( c == 0 )
+            { 
+                // child worker process
+                printf( "starting player server worker on cpu #%d\n", i );
+                fflush( stdout );
+                char cpu_string[64];
+                sprintf( cpu_string, "%d", i );
+                char state_send_rate_string[64];
+                sprintf( state_send_rate_string, "%d", config.state_send_rate );
+                char port_string[64];
+                sprintf( port_string, "%d", config.port );
+                char * args[] = { "taskset", "-c", cpu_string, "./player_server_worker", cpu_string, state_send_rate_string, port_string, 0 };
+                execv( "/usr/bin/taskset", args );
+                exit(0); 
+            } 
+        }
+    }
+
+    // main loop
+
+    unsigned int num_cpus = libbpf_num_possible_cpus();
+
+    uint64_t previous_inputs_processed = 0;
+    uint64_t previous_player_state_packets_sent = 0;
+    uint64_t previous_cpu_inputs_processed[MAX_CPUS];
+    memset( previous_cpu_inputs_processed, 0, sizeof(previous_cpu_inputs_processed) );
+    uint64_t previous_cpu_replies[MAX_CPUS];
+    uint64_t previous_cpu_reply_bytes[MAX_CPUS];
+    memset( previous_cpu_replies, 0, sizeof(previous_cpu_replies) );
+    memset( previous_cpu_reply_bytes, 0, sizeof(previous_cpu_reply_bytes) );
+#if PLAYER_STATE_USER_RINGBUF
+    uint64_t previous_cpu_commits[MAX_CPUS];
+    memset( previous_cpu_commits, 0, sizeof(previous_cpu_commits) );
+#endif // #if PLAYER_STATE_USER_RINGBUF
+
+    // the workers never reset their histograms, so start from whatever is there from a previous run
+
+    static struct latency_histograms previous_latency[MAX_CPUS];
+    memcpy( previous_latency, bpf.latency, sizeof(previous_latency) );
+
+    // same for the packet counters, which live as long as the pinned map
+
+    int key = 0;
+
+    struct packet_counters previous_packet_counters[num_cpus];
+    memset( previous_packet_counters, 0, sizeof(previous_packet_counters) );
+    bpf_map_lookup_elem( bpf.packet_counters_fd, &key, previous_packet_counters );
+
+    while ( !quit )
     {
         usleep( 1000000 );
 
         // track inputs processed
 
         uint64_t current_inputs_processed = 0;
+        uint64_t cpu_inputs_processed[MAX_CPUS];
 
-        for ( int i = 0; i < MAX_CPUS; i++ )
+        for ( int i = 0; i < config.max_cpus; i++ )
         {
             uint64_t value = 0;
-            bpf_map_lookup_elem( bpf.inputs_processed_fd, &i, &value );
+            if ( use_xsk )
+            {
+                value = __atomic_load_n( &xsk_inputs_processed[i], __ATOMIC_RELAXED );
+            }
+            else
+            {
+                bpf_map_lookup_elem( bpf.inputs_processed_fd, &i, &value );
+            }
+            cpu_inputs_processed[i] = value;
             current_inputs_processed += value;
         }
 
@@ -287,14 +1537,25 @@ int main( int argc, char *argv[] )
         struct counters values[num_cpus];
         memset( &values, 0, sizeof(values) );
 
-        int key = 0;
         bpf_map_lookup_elem( bpf.counters_fd, &key, values );
 
         uint64_t current_player_state_packets_sent = 0;
+        uint64_t cpu_replies[MAX_CPUS];
+        uint64_t cpu_reply_bytes[MAX_CPUS];
 
-        for ( int i = 0; i < MAX_CPUS; i++ )
+        for ( int i = 0; i < config.max_cpus; i++ )
         {
-            current_player_state_packets_sent += values[i].player_state_packets_sent;
+            if ( use_xsk )
+            {
+                cpu_replies[i] = __atomic_load_n( &xsk_player_state_packets_sent[i], __ATOMIC_RELAXED );
+                cpu_reply_bytes[i] = __atomic_load_n( &xsk_player_state_bytes_sent[i], __ATOMIC_RELAXED );
+            }
+            else
+            {
+                cpu_replies[i] = ( i < (int) num_cpus ) ? values[i].player_state_packets_sent : 0;
+                cpu_reply_bytes[i] = ( i < (int) num_cpus ) ? values[i].player_state_bytes_sent : 0;
+            }
+            current_player_state_packets_sent += cpu_replies[i];
         }
 
         // print out important stats
@@ -304,9 +1565,83 @@ int main( int argc, char *argv[] )
 
         printf( "inputs processed delta: %" PRId64 ", player state delta: %" PRId64 "\n", inputs_processed_delta, player_state_delta );
 
+        printf( "inputs processed per-cpu (%s):", use_xsk ? "xsk" : "ringbuf" );
+        for ( int i = 0; i < config.max_cpus; i++ )
+        {
+            printf( " %" PRId64, cpu_inputs_processed[i] - previous_cpu_inputs_processed[i] );
+            previous_cpu_inputs_processed[i] = cpu_inputs_processed[i];
+        }
+        printf( "\n" );
+
+        // player state replies are deltas against the state the client acked when the worker still has it, so bytes per reply shows how well that works
+
+        printf( "player state replies per-cpu (replies/sec, bytes per reply):" );
+        for ( int i = 0; i < config.max_cpus; i++ )
+        {
+            const uint64_t replies = cpu_replies[i] - previous_cpu_replies[i];
+            const uint64_t reply_bytes = cpu_reply_bytes[i] - previous_cpu_reply_bytes[i];
+            if ( replies > 0 )
+            {
+                printf( " cpu %d: %" PRId64 ", %.1f", i, replies, reply_bytes / (double) replies );
+            }
+            previous_cpu_replies[i] = cpu_replies[i];
+            previous_cpu_reply_bytes[i] = cpu_reply_bytes[i];
+        }
+        printf( "\n" );
+
+#if PLAYER_STATE_USER_RINGBUF
+
+        // workers commit player state through their cpu's user ring buffer, and xdp drains it on that cpu
+
+        printf( "player state commits per-cpu (commits/sec):" );
+        for ( int i = 0; i < config.max_cpus; i++ )
+        {
+            const uint64_t commits = ( i < (int) num_cpus ) ? values[i].player_state_commits : 0;
+            printf( " %" PRId64, commits - previous_cpu_commits[i] );
+            previous_cpu_commits[i] = commits;
+        }
+        printf( "\n" );
+
+#endif // #if PLAYER_STATE_USER_RINGBUF
+
         previous_inputs_processed = current_inputs_processed;
         previous_player_state_packets_sent = current_player_state_packets_sent;
 
+        // packets and bytes through xdp, and why packets were dropped
+
+        struct packet_counters packet_counters[num_cpus];
+        memset( packet_counters, 0, sizeof(packet_counters) );
+        bpf_map_lookup_elem( bpf.packet_counters_fd, &key, packet_counters );
+
+        print_packet_counters( packet_counters, previous_packet_counters, num_cpus );
+
+        // input latency percentiles over the last second, for each cpu with inputs
+
+        if ( !use_xsk )
+        {
+            printf( "input latency (us): receive -> simulate | simulate -> commit\n" );
+
+            for ( int i = 0; i < config.max_cpus; i++ )
+            {
+                uint64_t receive_to_simulate[LATENCY_HISTOGRAM_BUCKETS];
+                uint64_t simulate_to_commit[LATENCY_HISTOGRAM_BUCKETS];
+
+                const uint64_t receive_count = latency_histogram_delta( bpf.latency[i].receive_to_simulate, previous_latency[i].receive_to_simulate, receive_to_simulate );
+                const uint64_t commit_count = latency_histogram_delta( bpf.latency[i].simulate_to_commit, previous_latency[i].simulate_to_commit, simulate_to_commit );
+
+                if ( receive_count == 0 && commit_count == 0 )
+                    continue;
+
+                printf( "    cpu %2d: p50 %.1f, p99 %.1f, p999 %.1f | p50 %.1f, p99 %.1f, p999 %.1f\n", i,
+                    latency_histogram_percentile( receive_to_simulate, receive_count, 0.5 ),
+                    latency_histogram_percentile( receive_to_simulate, receive_count, 0.99 ),
+                    latency_histogram_percentile( receive_to_simulate, receive_count, 0.999 ),
+                    latency_histogram_percentile( simulate_to_commit, commit_count, 0.5 ),
+                    latency_histogram_percentile( simulate_to_commit, commit_count, 0.99 ),
+                    latency_histogram_percentile( simulate_to_commit, commit_count, 0.999 ) );
+            }
+        }
+
         // upload stats to the xdp program to be sent down to clients
 
         struct server_stats stats;
@@ -323,6 +1658,18 @@ int main( int argc, char *argv[] )
         }
     }
 
+    // clean up
+
+    for ( int i = 0; i < num_xsk_workers; i++ )
+    {
+        pthread_join( xsk_thread_id[i], NULL );
+    }
+
+    for ( int i = 0; i < num_xsk_workers; i++ )
+    {
+        xsk_worker_shutdown( &xsk_worker[i] );
+    }
+
     cleanup();
 
     return 0;
@@ -1,6 +1,7 @@
 package main
 
 import (
+	"errors"
 	"fmt"
 	"time"
 	"os"
@@ -9,33 +10,333 @@ import (
 	"strconv"
 	"syscall"
 	"encoding/binary"
+	"sort"
+	"sync"
+	"sync/atomic"
+	"math/bits"
+	"unsafe"
+    "path/filepath"
     "bufio"
     "net"
     "strings"
 
 	"github.com/cilium/ebpf"
 	"github.com/cilium/ebpf/ringbuf"
+	"golang.org/x/sys/unix"
 )
 
 const PlayerInputChanSize = 100000
 const PlayerStateSize = 8 + 1000
 const PlayerTimeout = 15
-const InputSize = 8 + 8 + 8 + 100
+const InputHeaderSize = 8 + 8 + 8 + 8 + 8 + 8 + 8 + 4 + 2 + 2
+const InputDataSize = 8 + 100
+const PlayerStateGroups = (PlayerStateSize - 8 + 7) / 8
+const PlayerStateGroupMaskBytes = (PlayerStateGroups + 7) / 8
+const PlayerStateReplyMaxSize = 8 + PlayerStateSize
+const PlayerStateReplySize = 8 + PlayerStateReplyMaxSize
+const PlayerStateHistory = 16
+const PlayerStateSlotSize = 8 + 8 + 8*2 + PlayerStateReplySize*2
+const PlayerArenaChunkSize = 2 * 1024 * 1024
+const PlayerStateCommitSize = 8 + PlayerStateReplySize
+const RingbufHeaderSize = 8
+const PlayerStatePacket = 6
+const PlayerStatePacketMaxSize = 1 + 8 + PlayerStateReplyMaxSize
+
+// TickRate is 0 to step each player as soon as its inputs arrive. Set it to a rate in Hz (eg. 100) to drain the input
+// ring buffer once per tick instead, and step and commit every player with queued inputs in one pass
+
+const TickRate = 0
+
+// PollMode is how the worker waits for inputs when TickRate is 0. PollEpoll blocks in epoll until xdp wakes it up.
+// PollBusy spins on the ring buffer and is never woken. PollAdaptive spins for PollSpinTime after the last input, and
+// then blocks in epoll. While it spins, it tells xdp not to send wakeups
+
+const (
+	PollEpoll = iota
+	PollBusy
+	PollAdaptive
+)
+
+const PollMode = PollEpoll
+const PollSpinTime = 50 * time.Microsecond
+
+var pollModeNames = []string{"epoll", "busy", "adaptive"}
+
+const WorkerPollStateDefault = 0
+const WorkerPollStateSpinning = 1
+const WorkerPollStateSleeping = 2
+const WorkerPollStateSize = 64
+
+const LatencyHistogramSubBits = 4
+const LatencyHistogramMaxBits = 36
+const LatencyHistogramBuckets = (LatencyHistogramMaxBits - LatencyHistogramSubBits + 1) << LatencyHistogramSubBits
+const LatencyHistogramsSize = 2 * LatencyHistogramBuckets * 8
+
+const (
+	ReceiveToSimulate = iota
+	SimulateToCommit
+)
+
+// With state_send_rate=N, player_server passes N and the server port down to us, and we send every player's latest
+// player state reply N times a second instead of xdp replying to each input. Each tick is split into StateSendSlices,
+// and each slice sends its share of the players in sendmmsg batches of up to StateSendBatchSize
+
+const StateSendSlices = 10
+const StateSendBatchSize = 64
+const StateSendSocketBufferSize = 4 * 1024 * 1024
+
+const CLOCK_MONOTONIC = 1
+
+const MPOL_BIND = 2
+const MPOL_F_NODE = 1
+const MPOL_F_ADDR = 2
+
+// Player state lives in 2MB chunks that are mmapped with huge pages when available and bound to the numa node of
+// our cpu, instead of being scattered across the go heap
+
+type PlayerArena struct {
+	mutex     sync.Mutex
+	numaNode  int
+	hugePages bool
+	chunks    [][]byte
+	free      [][]byte
+}
+
+func cpuNumaNode(cpu int) int {
+	matches, _ := filepath.Glob(fmt.Sprintf("/sys/devices/system/cpu/cpu%d/node*", cpu))
+	if len(matches) == 0 {
+		return -1
+	}
+	node, err := strconv.Atoi(strings.TrimPrefix(filepath.Base(matches[0]), "node"))
+	if err != nil {
+		return -1
+	}
+	return node
+}
+
+func memoryNumaNode(memory []byte) int {
+	node := int32(-1)
+	_, _, errno := syscall.Syscall6(syscall.SYS_GET_MEMPOLICY, uintptr(unsafe.Pointer(&node)), 0, 0, uintptr(unsafe.Pointer(&memory[0])), MPOL_F_NODE|MPOL_F_ADDR, 0)
+	if errno != 0 {
+		return -1
+	}
+	return int(node)
+}
+
+func (arena *PlayerArena) allocateChunk() {
+
+	// explicit huge pages need /proc/sys/vm/nr_hugepages, so fall back to regular pages with a transparent huge page hint
+
+	chunk, err := syscall.Mmap(-1, 0, PlayerArenaChunkSize, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_PRIVATE|syscall.MAP_ANONYMOUS|syscall.MAP_HUGETLB)
+	arena.hugePages = err == nil
+	if err != nil {
+		chunk, err = syscall.Mmap(-1, 0, PlayerArenaChunkSize, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_PRIVATE|syscall.MAP_ANONYMOUS)
+		if err != nil {
+			fmt.Printf("error: could not allocate player arena: %v\n", err)
+			os.Exit(1)
+		}
+		syscall.Madvise(chunk, syscall.MADV_HUGEPAGE)
+	}
+
+	// bind to our numa node before anything touches the chunk
+
+	if arena.numaNode >= 0 {
+		var nodeMask [16]uint64
+		nodeMask[arena.numaNode/64] = 1 << (arena.numaNode % 64)
+		_, _, errno := syscall.Syscall6(syscall.SYS_MBIND, uintptr(unsafe.Pointer(&chunk[0])), uintptr(len(chunk)), MPOL_BIND, uintptr(unsafe.Pointer(&nodeMask[0])), uintptr(len(nodeMask)*64), 0)
+		if errno != 0 {
+			fmt.Printf("warning: could not bind player arena to numa node %d: %v\n", arena.numaNode, errno)
+		}
+	}
+
+	pageSize := os.Getpagesize()
+	for i := 0; i < len(chunk); i += pageSize {
+		chunk[i] = 0
+	}
+
+	arena.chunks = append(arena.chunks, chunk)
+
+	for i := 0; i+PlayerStateSize <= len(chunk); i += PlayerStateSize {
+		arena.free = append(arena.free, chunk[i:i+PlayerStateSize:i+PlayerStateSize])
+	}
+}
+
+func (arena *PlayerArena) Alloc() []byte {
+	arena.mutex.Lock()
+	defer arena.mutex.Unlock()
+	if len(arena.free) == 0 {
+		arena.allocateChunk()
+	}
+	state := arena.free[len(arena.free)-1]
+	arena.free = arena.free[:len(arena.free)-1]
+	for i := range state {
+		state[i] = 0
+	}
+	return state
+}
+
+func (arena *PlayerArena) Free(state []byte) {
+	arena.mutex.Lock()
+	arena.free = append(arena.free, state)
+	arena.mutex.Unlock()
+}
 
 type PlayerData struct {
 	lastInputTime uint64
 	sessionId     uint64
 	inputChan     chan []byte
 	state         []byte
+	history       [PlayerStateHistory][]byte
+	historyIndex  int
+	baseline      uint64
+	reply         []byte
 	conn          net.Conn
 	reader        *bufio.Reader
+	queuedInputs  [][]byte
+	ack           uint64
+	address       syscall.RawSockaddrInet4
+	send          *StateSend
+}
+
+// StateSend is the player state packet the state sender sends for a player, along with where to send it. The player's
+// goroutine fills it in under stateSendMutex each time it encodes a reply
+
+type StateSend struct {
+	address syscall.RawSockaddrInet4
+	packet  []byte
+	bytes   int
+	index   int
+}
+
+// CommitBuffer is our cpu's player state commit buffer, a BPF_MAP_TYPE_USER_RINGBUF that xdp drains into the player
+// state map (PLAYER_STATE_USER_RINGBUF, see shared.h). We are its only producer, so committing is a copy and two
+// stores, with no syscall
+
+type CommitBuffer struct {
+	mutex    sync.Mutex
+	consumer []byte
+	producer []byte
+	data     []byte
+	size     uint64
+	dropped  uint64
+}
+
+// mmsghdr is struct mmsghdr for sendmmsg. go pads it out to the alignment of Msghdr, as the kernel expects
+
+type mmsghdr struct {
+	hdr syscall.Msghdr
+	len uint32
+}
+
+// InputRing is the consumer and producer positions of our input ring buffer, mapped read only, so a spinning worker
+// can see whether there are records without a syscall
+
+type InputRing struct {
+	consumer []byte
+	producer []byte
 }
 
 var cpu int
 var playerMap map[uint64]*PlayerData
 var playerStateMap *ebpf.Map
+var playerStateSlots []byte
+var playerArena PlayerArena
 var inputsProcessed uint64
 var inputsProcessedMap *ebpf.Map
+var workerPoll []byte
+var inputRing *InputRing
+var workerWakeups uint64
+var latencyHistograms []byte
+var monotonicBase uint64
+var monotonicStart time.Time
+var stateSendRate int
+var stateSendMutex sync.Mutex
+var stateSends []*StateSend
+var commitBuffer *CommitBuffer
+
+func newPlayer(sessionId uint64) *PlayerData {
+
+	// fmt.Printf("player %x create\n", sessionId)
+
+	player := &PlayerData{}
+	playerMap[sessionId] = player
+	player.sessionId = sessionId
+	player.state = playerArena.Alloc()
+	for i := range player.history {
+		player.history[i] = playerArena.Alloc()
+	}
+	player.reply = make([]byte, PlayerStateReplySize)
+	conn, err := net.Dial("tcp", "127.0.0.1:50000")
+	if err != nil {
+		fmt.Printf("\nerror: could not connect to zone database: %v\n\n", err)
+		os.Exit(1)
+	}
+	player.conn = conn
+	player.reader = bufio.NewReader(conn)
+	return player
+}
+
+func freePlayer(player *PlayerData) {
+	if player.send != nil {
+		stateSendMutex.Lock()
+		last := stateSends[len(stateSends)-1]
+		last.index = player.send.index
+		stateSends[last.index] = last
+		stateSends = stateSends[:len(stateSends)-1]
+		stateSendMutex.Unlock()
+	}
+	playerArena.Free(player.state)
+	for i := range player.history {
+		playerArena.Free(player.history[i])
+	}
+}
+
+func stepPlayer(player *PlayerData, input []byte) (numInputs int, playerStateSlot int, ok bool) {
+
+	t := binary.LittleEndian.Uint64(input[16:])
+
+	numInputs = int(binary.LittleEndian.Uint64(input[24:]))
+
+	playerStateSlot = int(binary.LittleEndian.Uint64(input[32:]))
+
+	if len(input) != InputHeaderSize+numInputs*InputDataSize {
+		fmt.Printf("error: input record has bad size (%d bytes)\n", len(input))
+		return 0, 0, false
+	}
+
+	player.ack = binary.LittleEndian.Uint64(input[8:])
+
+	player.baseline = binary.LittleEndian.Uint64(input[48:])
+
+	// the source port is in network byte order, which is how it goes in a sockaddr as well
+
+	player.address.Family = syscall.AF_INET
+	copy(player.address.Addr[:], input[56:60])
+	player.address.Port = *(*uint16)(unsafe.Pointer(&input[60]))
+
+	// inputs are most recent first, so walk t back to the oldest input then step forward
+
+	for j := 1; j < numInputs; j++ {
+		t -= binary.LittleEndian.Uint64(input[InputHeaderSize+j*InputDataSize:])
+	}
+
+	for j := numInputs - 1; j >= 0; j-- {
+
+		dt := binary.LittleEndian.Uint64(input[InputHeaderSize+j*InputDataSize:])
+
+		// fmt.Printf("player %x process input: t = %x, dt = %x [cpu #%d]\n", player.sessionId, t, dt, cpu)
+
+		for i := range player.state {
+			player.state[i] ^= byte(t) + byte(i)
+		}
+
+		t += dt
+
+		binary.LittleEndian.PutUint64(player.state[0:8], t)
+	}
+
+	return numInputs, playerStateSlot, true
+}
 
 func processInput(input []byte) {
 
@@ -45,20 +346,9 @@ func processInput(input []byte) {
 
 	if player == nil {
 
-		// fmt.Printf("player %x create\n", sessionId)
-
-		player = &PlayerData{}
-		playerMap[sessionId] = player
-		player.sessionId = sessionId
+		player = newPlayer(sessionId)
 		player.inputChan = make(chan []byte, PlayerInputChanSize)
-		player.state = make([]byte, PlayerStateSize)
-        conn, err := net.Dial("tcp", "127.0.0.1:50000")
-        if err != nil {
-            fmt.Printf("\nerror: could not connect to zone database: %v\n\n", err)
-            os.Exit(1)
-        }
-        player.conn = conn
-        player.reader = bufio.NewReader(conn)
+		conn := player.conn
 
 		go func() {
 
@@ -66,22 +356,20 @@ func processInput(input []byte) {
 				input := <-player.inputChan
 				if len(input) == 1 {
 					// fmt.Printf("player %x destroy\n", sessionId)
+					freePlayer(player)
 					return
 				}
 
 				player.lastInputTime = uint64(time.Now().Unix())
 
-				t := binary.LittleEndian.Uint64(input[8:])
+				simulateTime := monotonicNanoseconds()
 
-				dt := binary.LittleEndian.Uint64(input[16:])
-
-				// fmt.Printf("player %x process input: t = %x, dt = %x [cpu #%d]\n", player.sessionId, t, dt, cpu)
-
-				for i := range player.state {
-					player.state[i] ^= byte(t) + byte(i)
+				numInputs, playerStateSlot, ok := stepPlayer(player, input)
+				if !ok {
+					continue
 				}
 
-				binary.LittleEndian.PutUint64(player.state[0:8], t+dt)
+				recordLatency(ReceiveToSimulate, binary.LittleEndian.Uint64(input[40:]), simulateTime)
 
 	            player.conn.Write([]byte(string("ping\n")))
 
@@ -96,12 +384,24 @@ func processInput(input []byte) {
 		        	panic("expected pong")
 		        }
 
-				err = playerStateMap.Put(sessionId, player.state)
-				if err != nil {
-					panic(err)
+				reply := encodePlayerStateReply(player)
+
+				if stateSendRate > 0 {
+					queueStateSend(player, reply)
+				} else if playerStateSlots != nil {
+					publishPlayerState(playerStateSlot, sessionId, reply)
+				} else if commitBuffer != nil {
+					commitBuffer.commit(sessionId, reply)
+				} else {
+					err = playerStateMap.Put(sessionId, player.reply)
+					if err != nil {
+						panic(err)
+					}
 				}
 
-				inputsProcessed++
+				recordLatency(SimulateToCommit, simulateTime, monotonicNanoseconds())
+
+				inputsProcessed += uint64(numInputs)
 
 				runtime.Gosched()
 			}
@@ -117,10 +417,577 @@ func processInput(input []byte) {
 	runtime.Gosched()
 }
 
+func monotonicNanoseconds() uint64 {
+	// same clock as bpf_ktime_get_ns. it is read once at startup, then advanced with the go monotonic clock, which doesn't need a syscall
+	return monotonicBase + uint64(time.Since(monotonicStart))
+}
+
+func latencyHistogramBucket(nanoseconds uint64) int {
+	// see struct latency_histograms in shared.h
+	if nanoseconds < 1<<LatencyHistogramSubBits {
+		return int(nanoseconds)
+	}
+	magnitude := 63 - bits.LeadingZeros64(nanoseconds)
+	if magnitude >= LatencyHistogramMaxBits {
+		return LatencyHistogramBuckets - 1
+	}
+	return (magnitude-LatencyHistogramSubBits+1)<<LatencyHistogramSubBits + int(nanoseconds>>(magnitude-LatencyHistogramSubBits)) - 1<<LatencyHistogramSubBits
+}
+
+func recordLatency(histogram int, start uint64, finish uint64) {
+	// player_server reads our histograms from the latency map once per-second and prints percentiles
+	if finish < start {
+		return
+	}
+	offset := cpu*LatencyHistogramsSize + (histogram*LatencyHistogramBuckets+latencyHistogramBucket(finish-start))*8
+	atomic.AddUint64((*uint64)(unsafe.Pointer(&latencyHistograms[offset])), 1)
+}
+
+func setWorkerPollState(state uint64) {
+	// atomic, so it is ordered before the ring buffer reads that follow it
+	atomic.StoreUint64((*uint64)(unsafe.Pointer(&workerPoll[cpu*WorkerPollStateSize])), state)
+}
+
+func readInput(inputBuffer *ringbuf.Reader, deadline time.Time) []byte {
+
+	// returns nil if there is no input record before the deadline. the reader still returns records that are already
+	// in the ring buffer when the deadline has passed, which is how it sees records xdp submitted without a wakeup
+
+	inputBuffer.SetDeadline(deadline)
+	record, err := inputBuffer.Read()
+	if errors.Is(err, os.ErrDeadlineExceeded) {
+		return nil
+	}
+	if err != nil {
+		fmt.Printf("error: failed to read from ring buffer: %v\n", err)
+		os.Exit(1)
+	}
+	return record.RawSample
+}
+
+func mapInputRing(inputBufferMap *ebpf.Map) (*InputRing, error) {
+
+	// a ring buffer's consumer position is on its first page and the producer position is on the second
+
+	pageSize := os.Getpagesize()
+
+	consumer, err := syscall.Mmap(inputBufferMap.FD(), 0, pageSize, syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, err
+	}
+
+	producer, err := syscall.Mmap(inputBufferMap.FD(), int64(pageSize), pageSize, syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		syscall.Munmap(consumer)
+		return nil, err
+	}
+
+	return &InputRing{consumer: consumer, producer: producer}, nil
+}
+
+func (ring *InputRing) empty() bool {
+	return atomic.LoadUint64((*uint64)(unsafe.Pointer(&ring.consumer[0]))) == atomic.LoadUint64((*uint64)(unsafe.Pointer(&ring.producer[0])))
+}
+
+func pollInputs(inputBuffer *ringbuf.Reader) {
+
+	noWait := time.Unix(1, 0)
+
+	if PollMode == PollBusy || PollMode == PollAdaptive {
+		setWorkerPollState(WorkerPollStateSpinning)
+	}
+
+	lastInputTime := time.Now()
+
+	for {
+		// while spinning, look at the ring buffer positions instead of calling the reader, which does an epoll_wait
+		// each time it finds the ring empty. the reader is only called when there is a record to read
+
+		if PollMode == PollBusy || (PollMode == PollAdaptive && time.Since(lastInputTime) < PollSpinTime) {
+			if inputRing.empty() {
+				runtime.Gosched()
+				continue
+			}
+			input := readInput(inputBuffer, noWait)
+			if input != nil {
+				processInput(input)
+				lastInputTime = time.Now()
+			}
+			continue
+		}
+
+		// block in epoll until xdp wakes us up. in adaptive mode, tell xdp we are going to sleep, then look once more,
+		// because xdp may have seen we were spinning just before and submitted without a wakeup. the short deadline
+		// bounds how long a record that slipped past both can wait
+
+		deadline := time.Time{}
+
+		if PollMode == PollAdaptive {
+			setWorkerPollState(WorkerPollStateSleeping)
+			deadline = time.Now().Add(10 * time.Millisecond)
+		}
+
+		input := readInput(inputBuffer, noWait)
+
+		if input == nil {
+			input = readInput(inputBuffer, deadline)
+			if input != nil {
+				atomic.AddUint64(&workerWakeups, 1)
+			}
+		}
+
+		if PollMode == PollAdaptive {
+			setWorkerPollState(WorkerPollStateSpinning)
+		}
+
+		if input != nil {
+			processInput(input)
+		}
+
+		lastInputTime = time.Now()
+	}
+}
+
+func runTicks(inputBuffer *ringbuf.Reader) {
+
+	tickRate := TickRate
+
+	tickInterval := time.Second / time.Duration(tickRate)
+
+	tickDurations := make([]float64, 0, tickRate)
+
+	queuedPlayers := make([]*PlayerData, 0, 1024)
+
+	keys := make([]uint64, 0, 1024)
+	values := make([]byte, 0, 1024*PlayerStateReplySize)
+
+	nextTickTime := time.Now()
+	lastCleanupTime := time.Now()
+
+	for {
+
+		nextTickTime = nextTickTime.Add(tickInterval)
+		if wait := time.Until(nextTickTime); wait > 0 {
+			time.Sleep(wait)
+		} else {
+			// we fell behind. don't try to catch up with a burst of ticks
+			nextTickTime = time.Now()
+		}
+
+		tickStartTime := time.Now()
+
+		// drain the ring buffer into per-player input queues
+
+		inputBuffer.SetDeadline(tickStartTime)
+
+		for {
+			record, err := inputBuffer.Read()
+			if errors.Is(err, os.ErrDeadlineExceeded) {
+				break
+			}
+			if err != nil {
+				fmt.Printf("error: failed to read from ring buffer: %v\n", err)
+				os.Exit(1)
+			}
+			sessionId := binary.LittleEndian.Uint64(record.RawSample[:])
+			player := playerMap[sessionId]
+			if player == nil {
+				player = newPlayer(sessionId)
+			}
+			if len(player.queuedInputs) == 0 {
+				queuedPlayers = append(queuedPlayers, player)
+			}
+			player.queuedInputs = append(player.queuedInputs, record.RawSample)
+		}
+
+		// do the zone database round trip for all queued players at once: send every ping, then read every pong
+
+		for _, player := range queuedPlayers {
+			player.conn.Write([]byte(string("ping\n")))
+		}
+
+		for _, player := range queuedPlayers {
+			response, err := player.reader.ReadString('\n')
+			if err != nil {
+				panic(err)
+			}
+			if strings.TrimSpace(response) != "pong" {
+				panic("expected pong")
+			}
+		}
+
+		// step every queued player in one pass
+
+		currentTime := uint64(tickStartTime.Unix())
+
+		keys = keys[:0]
+		values = values[:0]
+
+		simulateTime := monotonicNanoseconds()
+		numSimulated := 0
+
+		for _, player := range queuedPlayers {
+			playerStateSlot := -1
+			for _, input := range player.queuedInputs {
+				numInputs, slot, ok := stepPlayer(player, input)
+				if ok {
+					inputsProcessed += uint64(numInputs)
+					playerStateSlot = slot
+					recordLatency(ReceiveToSimulate, binary.LittleEndian.Uint64(input[40:]), simulateTime)
+					numSimulated++
+				}
+			}
+			player.queuedInputs = player.queuedInputs[:0]
+			player.lastInputTime = currentTime
+			if playerStateSlot < 0 {
+				continue
+			}
+			reply := encodePlayerStateReply(player)
+			if stateSendRate > 0 {
+				queueStateSend(player, reply)
+			} else if playerStateSlots != nil {
+				publishPlayerState(playerStateSlot, player.sessionId, reply)
+			} else if commitBuffer != nil {
+				commitBuffer.commit(player.sessionId, reply)
+			} else {
+				keys = append(keys, player.sessionId)
+				values = append(values, player.reply...)
+			}
+		}
+
+		queuedPlayers = queuedPlayers[:0]
+
+		// commit all player states together
+
+		if len(keys) > 0 {
+			_, err := playerStateMap.BatchUpdate(keys, values, nil)
+			if err != nil {
+				panic(err)
+			}
+		}
+
+		commitTime := monotonicNanoseconds()
+		for i := 0; i < numSimulated; i++ {
+			recordLatency(SimulateToCommit, simulateTime, commitTime)
+		}
+
+		// clean up timed out players once per-second
+
+		if time.Since(lastCleanupTime) >= time.Second {
+			lastCleanupTime = time.Now()
+			for k, v := range playerMap {
+				if v.lastInputTime+PlayerTimeout < currentTime {
+					v.conn.Close()
+					freePlayer(v)
+					delete(playerMap, k)
+				}
+			}
+		}
+
+		// report tick duration percentiles once per-second
+
+		tickDurations = append(tickDurations, float64(time.Since(tickStartTime).Microseconds())/1000.0)
+
+		if len(tickDurations) == tickRate {
+			sort.Float64s(tickDurations)
+			fmt.Printf("tick duration (ms): p50 %.3f, p90 %.3f, p99 %.3f, max %.3f\n", tickDurations[tickRate*50/100], tickDurations[tickRate*90/100], tickDurations[tickRate*99/100], tickDurations[tickRate-1])
+			tickDurations = tickDurations[:0]
+		}
+	}
+}
+
+// encodePlayerStateReply writes the reply sent with each input ack into player.reply, and returns the part of it
+// that is used. The reply is the state as a delta against the baseline the client last acked, if it is still in our
+// history and the delta is smaller, otherwise the full state. See shared.h for the layout
+
+func encodePlayerStateReply(player *PlayerData) []byte {
+
+	reply := player.reply
+	data := reply[8:]
+	state := player.state
+
+	var baseline []byte
+	if player.baseline != 0 {
+		for _, previous := range player.history {
+			if binary.LittleEndian.Uint64(previous) == player.baseline {
+				baseline = previous
+				break
+			}
+		}
+	}
+
+	bytes := 0
+
+	if baseline != nil {
+		binary.LittleEndian.PutUint64(data[0:], player.baseline)
+		copy(data[8:16], state[0:8])
+		groupMask := data[16 : 16+PlayerStateGroupMaskBytes]
+		for i := range groupMask {
+			groupMask[i] = 0
+		}
+		bytes = 16 + PlayerStateGroupMaskBytes
+		for g := 0; g < PlayerStateGroups; g++ {
+			if bytes+1+8 > PlayerStateReplyMaxSize {
+				baseline = nil
+				break
+			}
+			changed := byte(0)
+			for k := 0; k < 8 && 8+g*8+k < PlayerStateSize; k++ {
+				if state[8+g*8+k] != baseline[8+g*8+k] {
+					changed |= 1 << k
+				}
+			}
+			if changed == 0 {
+				continue
+			}
+			groupMask[g/8] |= 1 << (g % 8)
+			data[bytes] = changed
+			bytes++
+			for k := 0; k < 8; k++ {
+				if changed&(1<<k) != 0 {
+					data[bytes] = state[8+g*8+k]
+					bytes++
+				}
+			}
+		}
+	}
+
+	if baseline == nil {
+		binary.LittleEndian.PutUint64(data[0:], 0)
+		copy(data[8:], state)
+		bytes = PlayerStateReplyMaxSize
+	}
+
+	binary.LittleEndian.PutUint64(reply[0:], uint64(bytes))
+
+	// this state is the baseline for a later reply once the client acks it
+
+	copy(player.history[player.historyIndex], state)
+	player.historyIndex = (player.historyIndex + 1) % PlayerStateHistory
+
+	return reply[:8+bytes]
+}
+
+func publishPlayerState(slot int, sessionId uint64, reply []byte) {
+
+	// latch: while the sequence is odd xdp reads reply[1], while it is even xdp reads reply[0], so xdp never sees a torn reply.
+	// xdp owns the slot's session id. each copy of the reply records the session it belongs to, and is only written inside
+	// the latch, so when a slot passes to a new session xdp can't send it the previous session's state
+
+	if slot < 0 || (slot+1)*PlayerStateSlotSize > len(playerStateSlots) {
+		fmt.Printf("error: player state slot %d is out of range\n", slot)
+		return
+	}
+
+	base := slot * PlayerStateSlotSize
+
+	if binary.LittleEndian.Uint64(playerStateSlots[base:]) != sessionId {
+		return
+	}
+
+	sequence := (*uint64)(unsafe.Pointer(&playerStateSlots[base+8]))
+
+	atomic.AddUint64(sequence, 1)
+
+	binary.LittleEndian.PutUint64(playerStateSlots[base+16:], sessionId)
+	copy(playerStateSlots[base+32:], reply)
+
+	atomic.AddUint64(sequence, 1)
+
+	binary.LittleEndian.PutUint64(playerStateSlots[base+24:], sessionId)
+	copy(playerStateSlots[base+32+PlayerStateReplySize:], reply)
+}
+
+func openCommitBuffer(commitMap *ebpf.Map) (*CommitBuffer, error) {
+
+	// same layout as libbpf's user ring buffers: a read only page with the consumer position, then a page with the
+	// producer position followed by the data pages, which the kernel maps twice so a commit can run off the end
+
+	pageSize := os.Getpagesize()
+	size := int(commitMap.MaxEntries())
+
+	consumer, err := syscall.Mmap(commitMap.FD(), 0, pageSize, syscall.PROT_READ, syscall.MAP_SHARED)
+	if err != nil {
+		return nil, err
+	}
+
+	producer, err := syscall.Mmap(commitMap.FD(), int64(pageSize), pageSize+2*size, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		syscall.Munmap(consumer)
+		return nil, err
+	}
+
+	return &CommitBuffer{consumer: consumer, producer: producer, data: producer[pageSize:], size: uint64(size)}, nil
+}
+
+func (buffer *CommitBuffer) commit(sessionId uint64, reply []byte) bool {
+
+	// returns false if the buffer is full. the record is 8 byte aligned, and xdp won't look at it until the producer
+	// position moves past it, so the header doesn't need the busy bit
+
+	const recordBytes = (RingbufHeaderSize + PlayerStateCommitSize + 7) &^ 7
+
+	buffer.mutex.Lock()
+	defer buffer.mutex.Unlock()
+
+	consumerPosition := atomic.LoadUint64((*uint64)(unsafe.Pointer(&buffer.consumer[0])))
+	producerPosition := atomic.LoadUint64((*uint64)(unsafe.Pointer(&buffer.producer[0])))
+
+	if producerPosition-consumerPosition+recordBytes > buffer.size {
+		buffer.dropped++
+		return false
+	}
+
+	record := buffer.data[producerPosition&(buffer.size-1):]
+
+	binary.LittleEndian.PutUint64(record[RingbufHeaderSize:], sessionId)
+	copy(record[RingbufHeaderSize+8:RingbufHeaderSize+PlayerStateCommitSize], reply)
+
+	atomic.StoreUint32((*uint32)(unsafe.Pointer(&record[0])), PlayerStateCommitSize)
+	atomic.StoreUint64((*uint64)(unsafe.Pointer(&buffer.producer[0])), producerPosition+recordBytes)
+
+	return true
+}
+
+func queueStateSend(player *PlayerData, reply []byte) {
+
+	// reply is the length, then the reply data. the packet is the type, our ack, then the reply data
+
+	stateSendMutex.Lock()
+	send := player.send
+	if send == nil {
+		send = &StateSend{packet: make([]byte, PlayerStatePacketMaxSize), index: len(stateSends)}
+		stateSends = append(stateSends, send)
+		player.send = send
+	}
+	send.address = player.address
+	send.packet[0] = PlayerStatePacket
+	binary.LittleEndian.PutUint64(send.packet[1:], player.ack)
+	send.bytes = 1 + 8 + copy(send.packet[1+8:], reply[8:])
+	stateSendMutex.Unlock()
+}
+
+func sendPlayerStates(port int) {
+
+	// bind to the server port, so player state comes from the address the client sends its inputs to. xdp consumes
+	// everything sent to the port before it gets here, so nothing is ever read from this socket
+
+	fd, err := syscall.Socket(syscall.AF_INET, syscall.SOCK_DGRAM, 0)
+	if err != nil {
+		fmt.Printf("error: could not create state send socket: %v\n", err)
+		os.Exit(1)
+	}
+	defer syscall.Close(fd)
+
+	syscall.SetsockoptInt(fd, syscall.SOL_SOCKET, unix.SO_REUSEPORT, 1)
+	syscall.SetsockoptInt(fd, syscall.SOL_SOCKET, syscall.SO_SNDBUF, StateSendSocketBufferSize)
+
+	err = syscall.Bind(fd, &syscall.SockaddrInet4{Port: port})
+	if err != nil {
+		fmt.Printf("error: could not bind state send socket to port %d: %v\n", port, err)
+		os.Exit(1)
+	}
+
+	var messages [StateSendBatchSize]mmsghdr
+	var iovecs [StateSendBatchSize]syscall.Iovec
+	var addresses [StateSendBatchSize]syscall.RawSockaddrInet4
+	var packets [StateSendBatchSize][PlayerStatePacketMaxSize]byte
+
+	for i := range messages {
+		iovecs[i].Base = &packets[i][0]
+		messages[i].hdr.Name = (*byte)(unsafe.Pointer(&addresses[i]))
+		messages[i].hdr.Namelen = syscall.SizeofSockaddrInet4
+		messages[i].hdr.Iov = &iovecs[i]
+		messages[i].hdr.Iovlen = 1
+	}
+
+	sliceInterval := time.Second / time.Duration(stateSendRate) / StateSendSlices
+
+	lateness := make([]float64, 0, stateSendRate*StateSendSlices)
+
+	packetsSent := 0
+	syscalls := 0
+	sendErrors := 0
+
+	nextSliceTime := time.Now()
+	lastReportTime := time.Now()
+
+	for slice := 0; ; slice = (slice + 1) % StateSendSlices {
+
+		nextSliceTime = nextSliceTime.Add(sliceInterval)
+		if wait := time.Until(nextSliceTime); wait > 0 {
+			time.Sleep(wait)
+		}
+
+		// how late the slice starts is the jitter we add to each player's state delivery interval
+
+		lateness = append(lateness, float64(time.Since(nextSliceTime).Microseconds())/1000.0)
+
+		if time.Since(nextSliceTime) > sliceInterval {
+			// we fell behind. don't try to catch up with a burst of slices
+			nextSliceTime = time.Now()
+		}
+
+		// copy a batch of packets out under the lock, then send it without holding the lock
+
+		for next := 0; ; {
+
+			count := 0
+
+			stateSendMutex.Lock()
+			first := len(stateSends) * slice / StateSendSlices
+			last := len(stateSends) * (slice + 1) / StateSendSlices
+			for i := first + next; i < last && count < StateSendBatchSize; i++ {
+				send := stateSends[i]
+				addresses[count] = send.address
+				copy(packets[count][:], send.packet[:send.bytes])
+				iovecs[count].SetLen(send.bytes)
+				count++
+			}
+			next += count
+			stateSendMutex.Unlock()
+
+			if count == 0 {
+				break
+			}
+
+			for sent := 0; sent < count; {
+				n, _, errno := syscall.Syscall6(unix.SYS_SENDMMSG, uintptr(fd), uintptr(unsafe.Pointer(&messages[sent])), uintptr(count-sent), 0, 0, 0)
+				syscalls++
+				if errno != 0 {
+					// skip the packet sendmmsg stopped at
+					sendErrors++
+					sent++
+					continue
+				}
+				sent += int(n)
+				packetsSent += int(n)
+			}
+		}
+
+		// report once per-second
+
+		if time.Since(lastReportTime) >= time.Second {
+			lastReportTime = time.Now()
+			sort.Float64s(lateness)
+			packetsPerSyscall := 0.0
+			if syscalls > 0 {
+				packetsPerSyscall = float64(packetsSent) / float64(syscalls)
+			}
+			fmt.Printf("state send: %d packets/sec, %.1f packets per sendmmsg, %d errors, slice lateness (ms): p50 %.3f, p99 %.3f, max %.3f\n", packetsSent, packetsPerSyscall, sendErrors,
+				lateness[len(lateness)*50/100], lateness[len(lateness)*99/100], lateness[len(lateness)-1])
+			lateness = lateness[:0]
+			packetsSent = 0
+			syscalls = 0
+			sendErrors = 0
+		}
+	}
+}
+
 func main() {
 
-	if len(os.Args) != 2 {
-		fmt.Printf( "\nusage: ./player_server_worker <cpu_index>\n\n")
+	if len(os.Args) != 2 && len(os.Args) != 4 {
+		fmt.Printf( "\nusage: ./player_server_worker <cpu_index> [state_send_rate port]\n\n")
 		os.Exit(0)
 	}
 
@@ -135,10 +1002,34 @@ func main() {
 		os.Exit(1)
 	}
 
+	statePort := 0
+	if len(os.Args) == 4 {
+		stateSendRate, err = strconv.Atoi(os.Args[2])
+		if err == nil {
+			statePort, err = strconv.Atoi(os.Args[3])
+		}
+		if err != nil || stateSendRate < 0 || statePort <= 0 || statePort > 65535 {
+			fmt.Printf("error: could not read state send rate and port\n")
+			os.Exit(1)
+		}
+	}
+
 	fmt.Printf("player server worker running on cpu #%d\n", cpu)
 
 	runtime.GOMAXPROCS(1)
 
+	// allocate the first chunk of the player arena now, so we can report where it landed
+
+	playerArena.numaNode = cpuNumaNode(cpu)
+	playerArena.allocateChunk()
+
+	pageSizeString := "4KB"
+	if playerArena.hugePages {
+		pageSizeString = "2MB"
+	}
+
+	fmt.Printf("player arena is on numa node %d (cpu node is %d), %s pages\n", memoryNumaNode(playerArena.chunks[0]), playerArena.numaNode, pageSizeString)
+
 	// get inputs processed map
 
 	inputsProcessedMap, err = ebpf.LoadPinnedMap("/sys/fs/bpf/inputs_processed_map", nil)
@@ -163,6 +1054,40 @@ func main() {
 		os.Exit(1)
 	}
 
+	// if the player state map is an mmapable array (PLAYER_STATE_MMAP), write player state directly into its memory
+
+	if playerStateMap.Type() == ebpf.Array {
+		pageSize := os.Getpagesize()
+		size := (int(playerStateMap.MaxEntries())*PlayerStateSlotSize + pageSize - 1) / pageSize * pageSize
+		playerStateSlots, err = syscall.Mmap(playerStateMap.FD(), 0, size, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+		if err != nil {
+			fmt.Printf("error: could not mmap player state map for cpu %d: %v\n", cpu, err)
+			os.Exit(1)
+		}
+		defer syscall.Munmap(playerStateSlots)
+		fmt.Printf("player state is memory mapped\n")
+	}
+
+	// if player_server made a player state commit buffer for our CPU (PLAYER_STATE_USER_RINGBUF), commit through it.
+	// player_server unpins the commit map on startup, so it is only there if this build has them
+
+	player_state_commit_outer, err := ebpf.LoadPinnedMap("/sys/fs/bpf/player_state_commit_map", nil)
+	if err == nil {
+		defer player_state_commit_outer.Close()
+		var player_state_commit_inner *ebpf.Map
+		err = player_state_commit_outer.Lookup(uint32(cpu), &player_state_commit_inner)
+		if err != nil {
+			fmt.Printf("error: could not lookup player state commit buffer for cpu %d: %v\n", cpu, err)
+			os.Exit(1)
+		}
+		commitBuffer, err = openCommitBuffer(player_state_commit_inner)
+		if err != nil {
+			fmt.Printf("error: could not mmap player state commit buffer for cpu %d: %v\n", cpu, err)
+			os.Exit(1)
+		}
+		fmt.Printf("player state is committed through a user ring buffer (%dKB)\n", commitBuffer.size/1024)
+	}
+
 	// get input buffer map for our CPU
 
 	input_buffer_outer, err := ebpf.LoadPinnedMap("/sys/fs/bpf/input_buffer_map", nil)
@@ -183,13 +1108,71 @@ func main() {
 
 	input_buffer, err := ringbuf.NewReader(input_buffer_inner)
 
+	// busy and adaptive polling spin on the ring buffer positions
+
+	if PollMode == PollBusy || PollMode == PollAdaptive {
+		inputRing, err = mapInputRing(input_buffer_inner)
+		if err != nil {
+			fmt.Printf("error: could not mmap input buffer positions for cpu %d: %v\n", cpu, err)
+			os.Exit(1)
+		}
+	}
+
+	// map the worker poll states, so we can tell xdp when we need a wakeup. the map is pinned, so ours can still hold
+	// the state of a previous worker that ran in another poll mode
+
+	worker_poll_map, err := ebpf.LoadPinnedMap("/sys/fs/bpf/worker_poll_map", nil)
+	if err != nil {
+		fmt.Printf("error: could not get worker poll map: %v\n", err)
+		os.Exit(1)
+	}
+	defer worker_poll_map.Close()
+
+	workerPollSize := (int(worker_poll_map.MaxEntries())*WorkerPollStateSize + os.Getpagesize() - 1) / os.Getpagesize() * os.Getpagesize()
+	workerPoll, err = syscall.Mmap(worker_poll_map.FD(), 0, workerPollSize, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		fmt.Printf("error: could not mmap worker poll map: %v\n", err)
+		os.Exit(1)
+	}
+	defer syscall.Munmap(workerPoll)
+
+	setWorkerPollState(WorkerPollStateDefault)
+	defer setWorkerPollState(WorkerPollStateDefault)
+
+	// map the latency histograms, so player_server can read ours
+
+	latency_map, err := ebpf.LoadPinnedMap("/sys/fs/bpf/latency_map", nil)
+	if err != nil {
+		fmt.Printf("error: could not get latency map: %v\n", err)
+		os.Exit(1)
+	}
+	defer latency_map.Close()
+
+	latencyHistogramsSize := (int(latency_map.MaxEntries())*LatencyHistogramsSize + os.Getpagesize() - 1) / os.Getpagesize() * os.Getpagesize()
+	latencyHistograms, err = syscall.Mmap(latency_map.FD(), 0, latencyHistogramsSize, syscall.PROT_READ|syscall.PROT_WRITE, syscall.MAP_SHARED)
+	if err != nil {
+		fmt.Printf("error: could not mmap latency map: %v\n", err)
+		os.Exit(1)
+	}
+	defer syscall.Munmap(latencyHistograms)
+
+	// input records are stamped with bpf_ktime_get_ns, so line up our clock with it
+
+	var monotonicTime syscall.Timespec
+	syscall.Syscall(syscall.SYS_CLOCK_GETTIME, CLOCK_MONOTONIC, uintptr(unsafe.Pointer(&monotonicTime)), 0)
+	monotonicStart = time.Now()
+	monotonicBase = uint64(monotonicTime.Nano())
+
 	// create player map
 
 	playerMap = make(map[uint64]*PlayerData)
 
-	// periodically clean up the player map
+	// periodically clean up the player map. in tick mode the tick loop owns the player map and does this itself
 
 	go func() {
+		if TickRate > 0 {
+			return
+		}
 		ticker := time.NewTicker(time.Second)
 	 	for {
 		 	<-ticker.C
@@ -217,19 +1200,56 @@ func main() {
 	 	}
 	}()
 
-	// poll ring buffer to read inputs
+	// player_server prints commits/sec as xdp drains them. we print what didn't fit in the commit buffer
+
+	if commitBuffer != nil {
+		go func() {
+			ticker := time.NewTicker(time.Second)
+			previousDropped := uint64(0)
+			for {
+				<-ticker.C
+				commitBuffer.mutex.Lock()
+				dropped := commitBuffer.dropped
+				commitBuffer.mutex.Unlock()
+				if dropped != previousDropped {
+					fmt.Printf("player state commit buffer full: %d commits dropped/sec\n", dropped-previousDropped)
+				}
+				previousDropped = dropped
+			}
+		}()
+	}
+
+	// send player state at a fixed rate, if xdp isn't replying to inputs with it
+
+	if stateSendRate > 0 {
+		fmt.Printf("sending player state %d times per-second\n", stateSendRate)
+		go sendPlayerStates(statePort)
+	}
+
+	// in tick mode, drain the ring buffer once per tick
+
+	if TickRate > 0 {
+		go runTicks(input_buffer)
+		<-termChan
+		return
+	}
+
+	// print wakeups once per-second. player_server prints input latency for every cpu
 
 	go func() {
-		
+		ticker := time.NewTicker(time.Second)
+		previousWakeups := uint64(0)
 		for {
-			record, err := input_buffer.Read()
-			if err != nil {
-				fmt.Printf("error: failed to read from ring buffer: %v\n", err)
-				os.Exit(1)
-			}
-			processInput(record.RawSample)
+			<-ticker.C
+			wakeups := atomic.LoadUint64(&workerWakeups)
+			fmt.Printf("%s poll: %d wakeups/sec\n", pollModeNames[PollMode], wakeups-previousWakeups)
+			previousWakeups = wakeups
 		}
 	}()
 
+	// poll ring buffer to read inputs
+
+	go pollInputs(input_buffer)
+
 	<- termChan
 }
@@ -4,6 +4,7 @@
     USAGE:
 
         clang -Ilibbpf/src -g -O2 -target bpf -c player_server_xdp.c -o player_server_xdp.o
+        bpftool gen skeleton player_server_xdp.o name player_server_xdp > player_server_xdp.skel.h
         sudo cat /sys/kernel/debug/tracing/trace_pipe
 */
 
@@ -19,6 +20,8 @@
 #include <bpf/bpf_helpers.h>
 
 #include "shared.h"
+#include "join_cookie.h"
+#include "input_encoding.h"
 
 #if defined(__BYTE_ORDER__) && defined(__ORDER_LITTLE_ENDIAN__) && \
     __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
@@ -32,23 +35,84 @@
 # error "Endianness detection needs to be set up for your compiler?!"
 #endif
 
+#ifndef DEBUG
 #define DEBUG 1
+#endif // #ifndef DEBUG
 
-#if DEBUG
-#define debug_printf bpf_printk
-#else // #if DEBUG
-#define debug_printf(...) do { } while (0)
-#endif // #if DEBUG
+/*
+    Deployment parameters. By default they are const volatile globals in .rodata, which player_server sets through
+    the skeleton before the program is loaded. .rodata is frozen before verification, so the verifier knows their
+    values: branches on them are resolved and dead code removed at load time, just like with #defines.
+
+    Build with -DRODATA_CONFIG=0 to bake the defaults in at compile time instead (see bench_xdp).
+
+    INPUT_SIZE and PLAYER_STATE_SIZE stay #defines, since the input records and player state are laid out with them
+    in the worker and the clients as well.
+*/
+
+#ifndef RODATA_CONFIG
+#define RODATA_CONFIG 1
+#endif // #ifndef RODATA_CONFIG
+
+#if RODATA_CONFIG
+#define CONFIG const volatile
+#else // #if RODATA_CONFIG
+#define CONFIG static const
+#endif // #if RODATA_CONFIG
+
+CONFIG __u16 server_port = __constant_htons( SERVER_PORT );     // network byte order
+CONFIG __u32 inputs_per_packet = INPUTS_PER_PACKET;             // most inputs taken from one packet, up to INPUTS_PER_PACKET
+CONFIG __u32 players_per_cpu = PLAYERS_PER_CPU;                 // player state slots per-cpu, the size of each player state map
+CONFIG __u32 rate_limit = RATE_LIMIT_PACKETS_PER_SECOND;         // packets per-second from each source address on each cpu, 0 for no limit
+CONFIG __u32 rate_limit_burst = RATE_LIMIT_BURST;
+CONFIG __u8 join_cookies = JOIN_COOKIES;                        // only create sessions for joins that echo a join cookie (see join_cookie.h)
+CONFIG __u8 state_replies = 1;                                  // reply to each input packet with player state. 0 when the workers send state at a fixed rate instead
+CONFIG __u8 debug = DEBUG;
+
+#define debug_printf(...) do { if ( debug ) bpf_printk( __VA_ARGS__ ); } while (0)
+
+// player_server sizes the session map for the cpus it uses (see configure_maps), this default is only for bench_xdp
 
 struct {
     __uint( type, BPF_MAP_TYPE_LRU_PERCPU_HASH );
     __uint( map_flags, BPF_F_NO_COMMON_LRU );
     __type( key, __u64 );
     __type( value, struct session_data );
-    __uint( max_entries, MAX_SESSIONS / MAX_CPUS );
+    __uint( max_entries, SESSIONS_PER_CPU );
     __uint( pinning, LIBBPF_PIN_BY_NAME );
 } session_map SEC(".maps");
 
+// source addresses we drop before doing anything else. player_server adds the ones it is given on the command line,
+// and since it is pinned, prefixes can be added or removed while running with bpftool
+
+struct {
+    __uint( type, BPF_MAP_TYPE_LPM_TRIE );
+    __uint( map_flags, BPF_F_NO_PREALLOC );
+    __type( key, struct blocklist_key );
+    __type( value, __u8 );
+    __uint( max_entries, BLOCKLIST_SIZE );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} blocklist_map SEC(".maps");
+
+// a token bucket per source address. per-cpu, so there are no atomics, but a source whose flows are spread over
+// several rx queues gets the rate on each of them. player_server sets the size
+
+struct {
+    __uint( type, BPF_MAP_TYPE_LRU_PERCPU_HASH );
+    __type( key, __u32 );
+    __type( value, struct rate_limit_bucket );
+    __uint( max_entries, RATE_LIMIT_SOURCES );
+} rate_limit_map SEC(".maps");
+
+// the key join cookies are signed with. player_server fills it with random bytes once the program is attached
+
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( max_entries, 1 );
+    __type( key, int );
+    __type( value, struct join_cookie_key );
+} join_cookie_key_map SEC(".maps");
+
 struct {
     __uint( type, BPF_MAP_TYPE_ARRAY );
     __uint( max_entries, 1 );
@@ -57,42 +121,33 @@ struct {
     __uint( pinning, LIBBPF_PIN_BY_NAME );
 } server_stats SEC(".maps");
 
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( map_flags, BPF_F_MMAPABLE );
+    __type( key, __u32 );
+    __type( value, struct worker_poll_state );
+    __uint( max_entries, MAX_CPUS );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} worker_poll_map SEC(".maps");
+
+// written by the player server workers and read by player_server. xdp doesn't touch it, it is here to be pinned
+
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( map_flags, BPF_F_MMAPABLE );
+    __type( key, __u32 );
+    __type( value, struct latency_histograms );
+    __uint( max_entries, MAX_CPUS );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} latency_map SEC(".maps");
+
+// each cpu has its own input buffer and player state map. player_server creates them for the cpus it uses and
+// inserts them here, keyed by cpu, so these are only their definitions. it also sets their sizes and the session map size
+
 struct inner_input_buffer_map {
     __uint( type, BPF_MAP_TYPE_RINGBUF );
-    __uint( max_entries, 256 * 1024 * 1024 );
-}
-input_buffer_0 SEC(".maps"),
-input_buffer_1 SEC(".maps"),
-input_buffer_2 SEC(".maps"),
-input_buffer_3 SEC(".maps"),
-input_buffer_4 SEC(".maps"),
-input_buffer_5 SEC(".maps"),
-input_buffer_6 SEC(".maps"),
-input_buffer_7 SEC(".maps"),
-input_buffer_8 SEC(".maps"),
-input_buffer_9 SEC(".maps"),
-input_buffer_10 SEC(".maps"),
-input_buffer_11 SEC(".maps"),
-input_buffer_12 SEC(".maps"),
-input_buffer_13 SEC(".maps"),
-input_buffer_14 SEC(".maps"),
-input_buffer_15 SEC(".maps"),
-input_buffer_16 SEC(".maps"),
-input_buffer_17 SEC(".maps"),
-input_buffer_18 SEC(".maps"),
-input_buffer_19 SEC(".maps"),
-input_buffer_20 SEC(".maps"),
-input_buffer_21 SEC(".maps"),
-input_buffer_22 SEC(".maps"),
-input_buffer_23 SEC(".maps"),
-input_buffer_24 SEC(".maps"),
-input_buffer_25 SEC(".maps"),
-input_buffer_26 SEC(".maps"),
-input_buffer_27 SEC(".maps"),
-input_buffer_28 SEC(".maps"),
-input_buffer_29 SEC(".maps"),
-input_buffer_30 SEC(".maps"),
-input_buffer_31 SEC(".maps");
+    __uint( max_entries, 4 * 1024 * 1024 );
+};
 
 struct {
     __uint( type, BPF_MAP_TYPE_ARRAY_OF_MAPS );
@@ -100,81 +155,28 @@ struct {
     __type( key, __u32 );
     __uint( pinning, LIBBPF_PIN_BY_NAME );
     __array( values, struct inner_input_buffer_map );
-} input_buffer_map SEC(".maps") = {
-    .values = { 
-        &input_buffer_0,
-        &input_buffer_1,
-        &input_buffer_2,
-        &input_buffer_3,
-        &input_buffer_4,
-        &input_buffer_5,
-        &input_buffer_6,
-        &input_buffer_7,
-        &input_buffer_8,
-        &input_buffer_9,
-        &input_buffer_10,
-        &input_buffer_11,
-        &input_buffer_12,
-        &input_buffer_13,
-        &input_buffer_14,
-        &input_buffer_15,
-        &input_buffer_16,
-        &input_buffer_17,
-        &input_buffer_18,
-        &input_buffer_19,
-        &input_buffer_20,
-        &input_buffer_21,
-        &input_buffer_22,
-        &input_buffer_23,
-        &input_buffer_24,
-        &input_buffer_25,
-        &input_buffer_26,
-        &input_buffer_27,
-        &input_buffer_28,
-        &input_buffer_29,
-        &input_buffer_30,
-        &input_buffer_31,
-    }
+} input_buffer_map SEC(".maps");
+
+#if PLAYER_STATE_MMAP
+
+struct inner_player_state_map {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( map_flags, BPF_F_MMAPABLE );
+    __type( key, __u32 );
+    __type( value, struct player_state_slot );
+    __uint( max_entries, PLAYERS_PER_CPU );
 };
 
+#else // #if PLAYER_STATE_MMAP
+
 struct inner_player_state_map {
     __uint( type, BPF_MAP_TYPE_LRU_HASH );
     __type( key, __u64 );
-    __type( value, struct player_state );
+    __type( value, struct player_state_reply );
     __uint( max_entries, PLAYERS_PER_CPU );
-} 
-player_state_0 SEC(".maps"),
-player_state_1 SEC(".maps"),
-player_state_2 SEC(".maps"),
-player_state_3 SEC(".maps"),
-player_state_4 SEC(".maps"),
-player_state_5 SEC(".maps"),
-player_state_6 SEC(".maps"),
-player_state_7 SEC(".maps"),
-player_state_8 SEC(".maps"),
-player_state_9 SEC(".maps"),
-player_state_10 SEC(".maps"),
-player_state_11 SEC(".maps"),
-player_state_12 SEC(".maps"),
-player_state_13 SEC(".maps"),
-player_state_14 SEC(".maps"),
-player_state_15 SEC(".maps"),
-player_state_16 SEC(".maps"),
-player_state_17 SEC(".maps"),
-player_state_18 SEC(".maps"),
-player_state_19 SEC(".maps"),
-player_state_20 SEC(".maps"),
-player_state_21 SEC(".maps"),
-player_state_22 SEC(".maps"),
-player_state_23 SEC(".maps"),
-player_state_24 SEC(".maps"),
-player_state_25 SEC(".maps"),
-player_state_26 SEC(".maps"),
-player_state_27 SEC(".maps"),
-player_state_28 SEC(".maps"),
-player_state_29 SEC(".maps"),
-player_state_30 SEC(".maps"),
-player_state_31 SEC(".maps");
+};
+
+#endif // #if PLAYER_STATE_MMAP
 
 struct {
     __uint( type, BPF_MAP_TYPE_ARRAY_OF_MAPS );
@@ -182,43 +184,37 @@ struct {
     __type( key, __u32 );
     __uint( pinning, LIBBPF_PIN_BY_NAME );
     __array( values, struct inner_player_state_map );
-} player_state_map SEC(".maps") = {
-    .values = { 
-        &player_state_0,
-        &player_state_1,
-        &player_state_2,
-        &player_state_3,
-        &player_state_4,
-        &player_state_5,
-        &player_state_6,
-        &player_state_7,
-        &player_state_8,
-        &player_state_9,
-        &player_state_10,
-        &player_state_11,
-        &player_state_12,
-        &player_state_13,
-        &player_state_14,
-        &player_state_15,
-        &player_state_16,
-        &player_state_17,
-        &player_state_18,
-        &player_state_19,
-        &player_state_20,
-        &player_state_21,
-        &player_state_22,
-        &player_state_23,
-        &player_state_24,
-        &player_state_25,
-        &player_state_26,
-        &player_state_27,
-        &player_state_28,
-        &player_state_29,
-        &player_state_30,
-        &player_state_31,
-    }
+} player_state_map SEC(".maps");
+
+#if PLAYER_STATE_USER_RINGBUF
+
+// workers commit player state replies into their cpu's user ring buffer, and xdp drains them into the player state
+// map on that cpu (see shared.h). like the input buffers, player_server creates one for each cpu it uses
+
+struct inner_player_state_commit_map {
+    __uint( type, BPF_MAP_TYPE_USER_RINGBUF );
+    __uint( max_entries, 4 * 1024 * 1024 );
 };
 
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY_OF_MAPS );
+    __uint( max_entries, MAX_CPUS );
+    __type( key, __u32 );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+    __array( values, struct inner_player_state_commit_map );
+} player_state_commit_map SEC(".maps");
+
+// commits are too big for the stack, so they are read out of the ring buffer into here
+
+struct {
+    __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
+    __uint( max_entries, 1 );
+    __type( key, int );
+    __type( value, struct player_state_commit );
+} player_state_commit_scratch_map SEC(".maps");
+
+#endif // #if PLAYER_STATE_USER_RINGBUF
+
 struct {
     __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
     __uint( max_entries, 1 );
@@ -227,6 +223,40 @@ struct {
     __uint( pinning, LIBBPF_PIN_BY_NAME );
 } counters_map SEC(".maps");
 
+struct {
+    __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
+    __uint( max_entries, 1 );
+    __type( key, int );
+    __type( value, struct packet_counters );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} packet_counters_map SEC(".maps");
+
+// input packets are copied out of the frame and expanded here, see input_encoding.h
+
+struct input_decode_scratch
+{
+    __u8 buffer[INPUT_DECODE_BUFFER_SIZE];
+    struct input_packet packet;
+};
+
+struct {
+    __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
+    __uint( max_entries, 1 );
+    __type( key, int );
+    __type( value, struct input_decode_scratch );
+} input_decode_map SEC(".maps");
+
+#if PLAYER_STATE_MMAP
+
+struct {
+    __uint( type, BPF_MAP_TYPE_PERCPU_ARRAY );
+    __uint( max_entries, 1 );
+    __type( key, int );
+    __type( value, __u32 );
+} next_player_state_slot_map SEC(".maps");
+
+#endif // #if PLAYER_STATE_MMAP
+
 struct {
     __uint( type, BPF_MAP_TYPE_ARRAY );
     __uint( max_entries, MAX_CPUS );
@@ -235,6 +265,34 @@ struct {
     __uint( pinning, LIBBPF_PIN_BY_NAME );
 } inputs_processed_map SEC(".maps");
 
+struct {
+    __uint( type, BPF_MAP_TYPE_XSKMAP );
+    __uint( max_entries, MAX_CPUS );
+    __type( key, __u32 );
+    __type( value, __u32 );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} xsk_map SEC(".maps");
+
+#if CPU_STEERING
+
+struct {
+    __uint( type, BPF_MAP_TYPE_CPUMAP );
+    __uint( max_entries, MAX_CPUS );
+    __type( key, __u32 );
+    __type( value, struct bpf_cpumap_val );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} cpu_map SEC(".maps");
+
+struct {
+    __uint( type, BPF_MAP_TYPE_ARRAY );
+    __uint( max_entries, CPU_STEERING_BUCKETS );
+    __type( key, __u32 );
+    __type( value, __u32 );
+    __uint( pinning, LIBBPF_PIN_BY_NAME );
+} cpu_steering_map SEC(".maps");
+
+#endif // #if CPU_STEERING
+
 static void reflect_packet( void * data, int payload_bytes )
 {
     struct ethhdr * eth = data;
@@ -278,7 +336,136 @@ static __u64 get_server_time()
     return bpf_ktime_get_boot_ns();
 }
 
-SEC("xdp") int server_xdp_filter( struct xdp_md *ctx ) 
+#if PLAYER_STATE_MMAP
+
+static __always_inline struct player_state_slot * find_player_state_slot( void * cpu_player_state_map, __u32 * next_player_state_slot, __u32 * player_state_slot )
+{
+    // slots are handed out round robin, but a slot is only taken once the session it was given to has left the session map,
+    // or has sent no input for PLAYER_STATE_SLOT_TIMEOUT_SECONDS. an idle session is removed when its slot is taken, so it
+    // can't come back to a slot that now belongs to someone else. if the next few slots are all in use, there is no slot
+
+    const __u64 now = get_server_time();
+
+    for ( int i = 0; i < PLAYER_STATE_SLOT_PROBES; i++ )
+    {
+        __u32 index = ( *next_player_state_slot + i ) % players_per_cpu;
+
+        struct player_state_slot * slot = (struct player_state_slot*) bpf_map_lookup_elem( cpu_player_state_map, &index );
+        if ( !slot )
+        {
+            return NULL; // can't happen
+        }
+
+        __u64 owner = slot->session_id;
+
+        struct session_data * owner_session = owner ? (struct session_data*) bpf_map_lookup_elem( &session_map, &owner ) : NULL;
+        if ( owner_session && owner_session->player_state_slot == index )
+        {
+            if ( now - owner_session->last_input_time < PLAYER_STATE_SLOT_TIMEOUT_SECONDS * 1000000000ULL )
+            {
+                continue;
+            }
+
+            debug_printf( "session 0x%llx timed out", owner );
+
+            bpf_map_delete_elem( &session_map, &owner );
+        }
+
+        *player_state_slot = index;
+
+        return slot;
+    }
+
+    *next_player_state_slot += PLAYER_STATE_SLOT_PROBES;
+
+    return NULL;
+}
+
+#endif // #if PLAYER_STATE_MMAP
+
+static __always_inline int drop_packet( struct packet_counters * counters, int reason )
+{
+    // packet counters are per-cpu and xdp doesn't run twice at once on a cpu, so plain increments are fine
+
+    counters->dropped[reason]++;
+    return XDP_DROP;
+}
+
+static __always_inline int send_packet( struct packet_counters * counters, int packet_type, int payload_bytes )
+{
+    counters->sent[packet_type]++;
+    counters->bytes_out += sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) + payload_bytes;
+    return XDP_TX;
+}
+
+#if PLAYER_STATE_USER_RINGBUF
+
+static long commit_player_state( struct bpf_dynptr * dynptr, void * context )
+{
+    // bpf_user_ringbuf_drain callback: copy one commit into this cpu's player state map. returns 0 to keep draining
+
+    int zero = 0;
+    struct player_state_commit * commit = (struct player_state_commit*) bpf_map_lookup_elem( &player_state_commit_scratch_map, &zero );
+    if ( !commit )
+    {
+        return 1; // can't happen
+    }
+
+    if ( bpf_dynptr_read( commit, sizeof(struct player_state_commit), dynptr, 0, 0 ) != 0 )
+    {
+        return 0; // too short. skip it
+    }
+
+    __u32 cpu = bpf_get_smp_processor_id();
+
+    void * cpu_player_state_map = bpf_map_lookup_elem( &player_state_map, &cpu );
+    if ( !cpu_player_state_map )
+    {
+        return 1;
+    }
+
+    bpf_map_update_elem( cpu_player_state_map, &commit->session_id, &commit->reply, BPF_ANY );
+
+    return 0;
+}
+
+#endif // #if PLAYER_STATE_USER_RINGBUF
+
+static __always_inline int submit_inputs( void * input_buffer, struct input_packet * packet, struct session_data * session, struct iphdr * ip, struct udphdr * udp, __u64 wakeup_flags, const int n )
+{
+    // send n decoded inputs down to userspace as one ring buffer record: input header followed by n input data, most recent input first
+
+    __u8 * record = bpf_ringbuf_reserve( input_buffer, INPUT_RECORD_SIZE( n ), 0 );
+    if ( !record )
+    {
+        return 0;
+    }
+
+    struct input_header * header = (struct input_header*) record;
+    header->session_id = packet->session_id;
+    header->sequence = packet->sequence;
+    header->t = packet->t;
+    header->num_inputs = n;
+    header->player_state_slot = session->player_state_slot;
+    header->submit_time = bpf_ktime_get_ns();
+    header->baseline = packet->baseline;
+    header->source_address = ip->saddr;
+    header->source_port = udp->source;
+    header->padding = 0;
+
+    __u8 * input_data = record + sizeof(struct input_header);
+    __u8 * inputs = (__u8*) packet->inputs;
+    for ( int i = 0; i < sizeof(struct input_data) * n; i++ )
+    {
+        input_data[i] = inputs[i];
+    }
+
+    bpf_ringbuf_submit( record, wakeup_flags );
+
+    return 1;
+}
+
+static __always_inline int process_packet( struct xdp_md *ctx, const int steered )
 { 
     void * data = (void*) (long) ctx->data; 
 
@@ -300,25 +487,116 @@ SEC("xdp") int server_xdp_filter( struct xdp_md *ctx )
 
                     if ( (void*)udp + sizeof(struct udphdr) <= data_end )
                     {
-                        if ( udp->dest == __constant_htons(40000) )
+                        if ( udp->dest == server_port )
                         {
+                            int zero = 0;
+                            struct packet_counters * counters = (struct packet_counters*) bpf_map_lookup_elem( &packet_counters_map, &zero );
+                            if ( !counters )
+                            {
+                                return XDP_DROP; // can't happen
+                            }
+
+                            counters->bytes_in += data_end - data;
+
                             __u8 * payload = (void*) udp + sizeof(struct udphdr);
                             int payload_bytes = data_end - (void*)payload;
                             if ( (void*)payload + 1 <= data_end )
                             {
                                 int packet_type = payload[0];
 
+                                counters->received[ packet_type < NUM_PACKET_TYPES ? packet_type : 0 ]++;
+
                                 if ( packet_type == JOIN_REQUEST_PACKET && (void*) payload + sizeof(struct join_request_packet) <= data_end )
                                 {
                                     debug_printf( "received join request packet" );
 
                                     struct join_request_packet * request = (struct join_request_packet*) payload;
 
+                                    if ( join_cookies )
+                                    {
+                                        // no state until the client shows it receives packets at its address: a join without a cookie only gets a challenge
+
+                                        struct join_cookie_key * key = (struct join_cookie_key*) bpf_map_lookup_elem( &join_cookie_key_map, &zero );
+                                        if ( !key )
+                                        {
+                                            return drop_packet( counters, DROP_REASON_INTERNAL_ERROR ); // can't happen
+                                        }
+
+                                        const __u64 bucket = join_cookie_bucket( get_server_time() );
+
+                                        if ( request->cookie == 0 )
+                                        {
+                                            debug_printf( "sent join challenge to session 0x%llx", request->session_id );
+
+                                            const __u64 cookie = join_cookie( key, ip->saddr, udp->source, request->session_id, bucket );
+
+                                            reflect_packet( data, sizeof(struct join_challenge_packet) );
+
+                                            struct join_challenge_packet * challenge = (struct join_challenge_packet*) payload;
+
+                                            challenge->packet_type = JOIN_CHALLENGE_PACKET;
+                                            challenge->cookie = cookie;
+
+                                            bpf_xdp_adjust_tail( ctx, -( JOIN_REQUEST_PACKET_SIZE - JOIN_CHALLENGE_PACKET_SIZE ) );
+
+                                            return send_packet( counters, JOIN_CHALLENGE_PACKET, sizeof(struct join_challenge_packet) );
+                                        }
+
+                                        if ( request->cookie != join_cookie( key, ip->saddr, udp->source, request->session_id, bucket ) &&
+                                             request->cookie != join_cookie( key, ip->saddr, udp->source, request->session_id, bucket - 1 ) )
+                                        {
+                                            debug_printf( "bad join cookie for session 0x%llx", request->session_id );
+                                            return drop_packet( counters, DROP_REASON_BAD_JOIN_COOKIE );
+                                        }
+                                    }
+
                                     struct session_data session;
                                     session.next_input_sequence = 1000;
+                                    session.player_state_slot = 0;
+                                    session.last_input_time = get_server_time();
+
+#if PLAYER_STATE_MMAP
+                                    // give a new session a player state slot on this cpu, or turn the join away if there is none free
+
+                                    struct player_state_slot * slot = NULL;
+
+                                    if ( !bpf_map_lookup_elem( &session_map, &request->session_id ) )
+                                    {
+                                        __u32 * next_player_state_slot = (__u32*) bpf_map_lookup_elem( &next_player_state_slot_map, &zero );
+                                        if ( !next_player_state_slot )
+                                        {
+                                            return drop_packet( counters, DROP_REASON_INTERNAL_ERROR ); // can't happen
+                                        }
+
+                                        int cpu = bpf_get_smp_processor_id();
+
+                                        void * cpu_player_state_map = bpf_map_lookup_elem( &player_state_map, &cpu );
+                                        if ( !cpu_player_state_map )
+                                        {
+                                            debug_printf( "could not find player state map for cpu %d", cpu );
+                                            return drop_packet( counters, DROP_REASON_NO_PLAYER_STATE_MAP );
+                                        }
+
+                                        slot = find_player_state_slot( cpu_player_state_map, next_player_state_slot, &session.player_state_slot );
+                                        if ( !slot )
+                                        {
+                                            debug_printf( "no free player state slot for session 0x%llx", request->session_id );
+                                            return drop_packet( counters, DROP_REASON_NO_PLAYER_STATE_SLOT );
+                                        }
+
+                                        *next_player_state_slot = session.player_state_slot + 1;
+                                    }
+#endif // #if PLAYER_STATE_MMAP
+
                                     if ( bpf_map_update_elem( &session_map, &request->session_id, &session, BPF_NOEXIST ) == 0 )
                                     {
                                         debug_printf( "created session 0x%llx", request->session_id );
+#if PLAYER_STATE_MMAP
+                                        if ( slot )
+                                        {
+                                            slot->session_id = request->session_id;
+                                        }
+#endif // #if PLAYER_STATE_MMAP
                                     }
 
                                     reflect_packet( data, sizeof(struct join_response_packet) );
@@ -330,9 +608,9 @@ SEC("xdp") int server_xdp_filter( struct xdp_md *ctx )
 
                                     bpf_xdp_adjust_tail( ctx, -( JOIN_REQUEST_PACKET_SIZE - JOIN_RESPONSE_PACKET_SIZE ) );
 
-                                    return XDP_TX;
+                                    return send_packet( counters, JOIN_RESPONSE_PACKET, sizeof(struct join_response_packet) );
                                 }
-                                else if ( packet_type == INPUT_PACKET && (void*) payload + INPUT_PACKET_SIZE <= data_end )
+                                else if ( packet_type == INPUT_PACKET && (void*) payload + 1 + 8 <= data_end )
                                 {
                                     __u64 session_id = (__u64) payload[1];
                                     session_id |= ( (__u64) payload[2] ) << 8;
@@ -347,201 +625,254 @@ SEC("xdp") int server_xdp_filter( struct xdp_md *ctx )
                                     if ( session == NULL )
                                     {
                                         debug_printf( "could not find session 0x%llx", session_id );
-                                        return XDP_DROP;
+                                        return drop_packet( counters, DROP_REASON_SESSION_NOT_FOUND );
+                                    }
+
+#if PLAYER_STATE_MMAP
+                                    session->last_input_time = get_server_time();
+#endif // #if PLAYER_STATE_MMAP
+
+                                    // if player_server has bound an AF_XDP socket to this queue, pass the input packet to it instead of the ring buffer
+
+                                    __u32 queue = ctx->rx_queue_index;
+                                    if ( !steered && bpf_map_lookup_elem( &xsk_map, &queue ) )
+                                    {
+                                        return bpf_redirect_map( &xsk_map, queue, XDP_DROP );
                                     }
 
                                     int cpu = bpf_get_smp_processor_id();
 
-                                    // send the input(s) down to userspace via perf buffer
-
-                                    __u64 sequence = (__u64) payload[9];
-                                    sequence |= ( (__u64) payload[10] ) << 8;
-                                    sequence |= ( (__u64) payload[11] ) << 16;
-                                    sequence |= ( (__u64) payload[12] ) << 24;
-                                    sequence |= ( (__u64) payload[13] ) << 32;
-                                    sequence |= ( (__u64) payload[14] ) << 40;
-                                    sequence |= ( (__u64) payload[15] ) << 48;
-                                    sequence |= ( (__u64) payload[16] ) << 56;
-
-                                    __u64 t = (__u64) payload[17];
-                                    t |= ( (__u64) payload[18] ) << 8;
-                                    t |= ( (__u64) payload[19] ) << 16;
-                                    t |= ( (__u64) payload[20] ) << 24;
-                                    t |= ( (__u64) payload[21] ) << 32;
-                                    t |= ( (__u64) payload[22] ) << 40;
-                                    t |= ( (__u64) payload[23] ) << 48;
-                                    t |= ( (__u64) payload[24] ) << 56;
-
-                                    __u64 dt = (__u64) payload[25];
-                                    dt |= ( (__u64) payload[26] ) << 8;
-                                    dt |= ( (__u64) payload[27] ) << 16;
-                                    dt |= ( (__u64) payload[28] ) << 24;
-                                    dt |= ( (__u64) payload[29] ) << 32;
-                                    dt |= ( (__u64) payload[30] ) << 40;
-                                    dt |= ( (__u64) payload[31] ) << 48;
-                                    dt |= ( (__u64) payload[32] ) << 56;
+                                    // expand the compact input packet. the whole payload is copied out first, since the decoder reads at
+                                    // offsets that depend on the packet contents, which the verifier can bound in a map value but not in a packet
+
+                                    struct input_decode_scratch * scratch = (struct input_decode_scratch*) bpf_map_lookup_elem( &input_decode_map, &zero );
+                                    if ( !scratch )
+                                    {
+                                        return drop_packet( counters, DROP_REASON_INTERNAL_ERROR ); // can't happen
+                                    }
+
+                                    if ( payload_bytes < 1 + 8 || payload_bytes > INPUT_DECODE_BUFFER_SIZE ||
+                                         bpf_xdp_load_bytes( ctx, sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr), scratch->buffer, payload_bytes ) != 0 )
+                                    {
+                                        return drop_packet( counters, DROP_REASON_BAD_INPUT_PACKET );
+                                    }
+
+                                    const int inputs_decoded = input_packet_decode( scratch->buffer, payload_bytes, &scratch->packet, inputs_per_packet );
+                                    if ( inputs_decoded <= 0 )
+                                    {
+                                        debug_printf( "bad input packet for session 0x%llx", session_id );
+                                        return drop_packet( counters, DROP_REASON_BAD_INPUT_PACKET );
+                                    }
+
+                                    const __u64 sequence = scratch->packet.sequence;
 
                                     if ( sequence >= session->next_input_sequence )
                                     {
+                                        // clients only send the inputs we haven't acked, so the packet can carry fewer than we are missing
+
                                         __u64 n = ( sequence - session->next_input_sequence ) + 1;
-                                        if ( n > 10 )
+                                        if ( n > inputs_decoded )
                                         {
-                                            n = 10;
+                                            n = inputs_decoded;
                                         }
 
                                         debug_printf( "process input %lld (n=%d)", sequence, n );
 
-                                        session->next_input_sequence = sequence + 1;
-
                                         void * input_buffer = bpf_map_lookup_elem( &input_buffer_map, &cpu );
                                         if ( !input_buffer )
                                         {
                                             debug_printf( "could not find input buffer for cpu %d", cpu );
-                                            return XDP_DROP;
+                                            return drop_packet( counters, DROP_REASON_NO_INPUT_BUFFER );
                                         }
 
-                                        if ( n == 1 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) <= data_end )
-                                        {
-                                            __u8 * event = bpf_ringbuf_reserve( input_buffer, 8 + 8 + 8 + INPUT_SIZE, 0 );
-                                            if ( !event )
-                                            {
-                                                debug_printf( "dropped input :(" );
-                                                return XDP_DROP;
-                                            }
-                                            
-                                            memcpy( event, payload + 1, 8 );
-                                            memcpy( event + 8, payload + 1 + 8 + 8 , 8 + 8 + INPUT_SIZE );
+                                        // if the worker is spinning on the ring buffer it will see the record without a wakeup. if it has
+                                        // gone to sleep in epoll, always wake it, even if it hasn't consumed records we sent while it was spinning
 
-                                            bpf_ringbuf_submit( event, 0 );
-                                        }
-                                        // todo: update these to ringbuf
-                                        /*
-                                        else if ( n == 2 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 2 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 2; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
+                                        __u64 wakeup_flags = 0;
 
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 2 );
-                                        }
-                                        else if ( n == 3 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 3 <= data_end )
+                                        struct worker_poll_state * poll_state = (struct worker_poll_state*) bpf_map_lookup_elem( &worker_poll_map, &cpu );
+                                        if ( poll_state )
                                         {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 3; i++ )
+                                            if ( poll_state->state == WORKER_POLL_STATE_SPINNING )
                                             {
-                                                heap[i] = payload[1+i];
+                                                wakeup_flags = BPF_RB_NO_WAKEUP;
                                             }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 3 );
-                                        }
-                                        else if ( n == 4 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 4 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 4; i++ )
+                                            else if ( poll_state->state == WORKER_POLL_STATE_SLEEPING )
                                             {
-                                                heap[i] = payload[1+i];
+                                                wakeup_flags = BPF_RB_FORCE_WAKEUP;
                                             }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 4 );
                                         }
-                                        else if ( n == 5 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 5 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 5; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
 
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 5 );
-                                        }
-                                        else if ( n == 6 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 6 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 6; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
+                                        // IMPORTANT: the ring buffer reserve size must be a constant for the verifier, so each input count gets its own call site
 
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 6 );
-                                        }
-                                        else if ( n == 7 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 7 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 7; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
+                                        int result = 0;
 
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 7 );
-                                        }
-                                        else if ( n == 8 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 8 <= data_end )
+                                        switch ( n )
                                         {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 8; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 8 );
+                                            case 1:  result = submit_inputs( input_buffer, &scratch->packet, session, ip, udp, wakeup_flags, 1 );  break;
+                                            case 2:  result = submit_inputs( input_buffer, &scratch->packet, session, ip, udp, wakeup_flags, 2 );  break;
+                                            case 3:  result = submit_inputs( input_buffer, &scratch->packet, session, ip, udp, wakeup_flags, 3 );  break;
+                                            case 4:  result = submit_inputs( input_buffer, &scratch->packet, session, ip, udp, wakeup_flags, 4 );  break;
+                                            case 5:  result = submit_inputs( input_buffer, &scratch->packet, session, ip, udp, wakeup_flags, 5 );  break;
+                                            case 6:  result = submit_inputs( input_buffer, &scratch->packet, session, ip, udp, wakeup_flags, 6 );  break;
+                                            case 7:  result = submit_inputs( input_buffer, &scratch->packet, session, ip, udp, wakeup_flags, 7 );  break;
+                                            case 8:  result = submit_inputs( input_buffer, &scratch->packet, session, ip, udp, wakeup_flags, 8 );  break;
+                                            case 9:  result = submit_inputs( input_buffer, &scratch->packet, session, ip, udp, wakeup_flags, 9 );  break;
+                                            case 10: result = submit_inputs( input_buffer, &scratch->packet, session, ip, udp, wakeup_flags, 10 ); break;
                                         }
-                                        else if ( n == 9 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 9 <= data_end )
-                                        {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 9; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
 
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 9 );
-                                        }
-                                        else if ( n == 10 && (void*) payload + 1 + 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 10 <= data_end )
+                                        if ( !result )
                                         {
-                                            for ( int i = 0; i < 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 10; i++ )
-                                            {
-                                                heap[i] = payload[1+i];
-                                            }
-
-                                            bpf_perf_event_output( ctx, &input_buffer, BPF_F_CURRENT_CPU, heap, 8 + 8 + 8 + ( 8 + INPUT_SIZE ) * 10 );
+                                            debug_printf( "dropped input :(" );
+                                            return drop_packet( counters, DROP_REASON_RING_BUFFER_FULL );
                                         }
-                                        */
+
+                                        // only advance once the inputs are in the ring buffer, so a failed reserve is recovered by the next packet
+
+                                        session->next_input_sequence = sequence + 1;
                                     }
                                     else
                                     {
                                         debug_printf( "input packet is old" );
+                                        return drop_packet( counters, DROP_REASON_OLD_INPUT );
+                                    }
+
+                                    if ( !state_replies )
+                                    {
+                                        // the workers send player state on their own schedule, so the input packet is consumed
+
                                         return XDP_DROP;
                                     }
 
                                     // respond with a player state packet for the client's local player
 
+#if PLAYER_STATE_USER_RINGBUF
+
+                                    // bring the player state map up to date with what the worker on this cpu has committed since the last input packet
+
+                                    void * player_state_commits = bpf_map_lookup_elem( &player_state_commit_map, &cpu );
+                                    if ( player_state_commits )
+                                    {
+                                        const long commits = bpf_user_ringbuf_drain( player_state_commits, commit_player_state, NULL, 0 );
+                                        if ( commits > 0 )
+                                        {
+                                            struct counters * commit_counters = (struct counters*) bpf_map_lookup_elem( &counters_map, &zero );
+                                            if ( commit_counters )
+                                            {
+                                                commit_counters->player_state_commits += commits;
+                                            }
+                                        }
+                                    }
+
+#endif // #if PLAYER_STATE_USER_RINGBUF
+
                                     void * cpu_player_state_map = bpf_map_lookup_elem( &player_state_map, &cpu );
                                     if ( !cpu_player_state_map )
                                     {
                                         debug_printf( "could not find player state map for cpu %d", cpu );
-                                        return XDP_DROP;
+                                        return drop_packet( counters, DROP_REASON_NO_PLAYER_STATE_MAP );
                                     }
 
-                                    __u8 * player_state = (__u8*) bpf_map_lookup_elem( cpu_player_state_map, &session_id );
-                                    if ( !player_state )
+#if PLAYER_STATE_MMAP
+
+                                    __u32 player_state_slot = session->player_state_slot;
+
+                                    struct player_state_slot * slot = (struct player_state_slot*) bpf_map_lookup_elem( cpu_player_state_map, &player_state_slot );
+                                    if ( !slot || slot->session_id != session_id )
                                     {
                                         debug_printf( "could not find player state for session 0x%llx", session_id );
-                                        return XDP_DROP;
+                                        return drop_packet( counters, DROP_REASON_PLAYER_STATE_NOT_FOUND );
                                     }
 
-                                    payload[0] = PLAYER_STATE_PACKET;
+                                    // the worker writes reply[0] while the latch sequence is odd and reply[1] while it is even, so we always read the copy that is not being written.
+                                    // each copy holds the session it was written for, which is the previous owner of the slot until the worker has stepped this session
 
-                                    for ( int i = 0; i < 8 + PLAYER_STATE_SIZE; i++ )
+                                    __u64 latch_sequence = *( (volatile __u64*) &slot->sequence );
+                                    const int latch_copy = latch_sequence & 1;
+                                    if ( latch_sequence < 2 || *( (volatile __u64*) &slot->owner[latch_copy] ) != session_id )
                                     {
-                                        payload[1+i] = player_state[i];
+                                        debug_printf( "no player state yet for session 0x%llx", session_id );
+                                        return drop_packet( counters, DROP_REASON_PLAYER_STATE_NOT_READY );
                                     }
-  
-                                    int zero = 0;
-                                    struct counters * counters = (struct counters*) bpf_map_lookup_elem( &counters_map, &zero );
-                                    if ( !counters ) 
+
+                                    struct player_state_reply * reply = &slot->reply[latch_copy];
+
+#else // #if PLAYER_STATE_MMAP
+
+                                    struct player_state_reply * reply = (struct player_state_reply*) bpf_map_lookup_elem( cpu_player_state_map, &session_id );
+                                    if ( !reply )
                                     {
-                                        return XDP_DROP; // can't happen
+                                        debug_printf( "could not find player state for session 0x%llx", session_id );
+                                        return drop_packet( counters, DROP_REASON_PLAYER_STATE_NOT_FOUND );
                                     }
 
-                                    __sync_fetch_and_add( &counters->player_state_packets_sent, 1 );
+#endif // #if PLAYER_STATE_MMAP
 
-                                    reflect_packet( data, PLAYER_STATE_PACKET_SIZE );
+                                    // the worker has already encoded the reply, in full or as a delta against the state the client last acked
+
+                                    const __u32 reply_bytes = reply->bytes;
+                                    if ( reply_bytes < 8 + 8 || reply_bytes > PLAYER_STATE_REPLY_MAX_SIZE )
+                                    {
+                                        debug_printf( "no player state reply yet for session 0x%llx", session_id );
+                                        return drop_packet( counters, DROP_REASON_PLAYER_STATE_NOT_READY );
+                                    }
 
-                                    bpf_xdp_adjust_tail( ctx, -( INPUT_PACKET_SIZE - PLAYER_STATE_PACKET_SIZE ) );
+                                    const int player_state_packet_bytes = 1 + 8 + reply_bytes;
 
-                                    return XDP_TX;
+                                    // the reply can be bigger than the input packet, so resize the packet for it first.
+                                    // that invalidates our packet pointers, so find the payload again
+
+                                    if ( bpf_xdp_adjust_tail( ctx, player_state_packet_bytes - payload_bytes ) != 0 )
+                                    {
+                                        debug_printf( "could not resize packet for player state" );
+                                        return drop_packet( counters, DROP_REASON_INTERNAL_ERROR );
+                                    }
+
+                                    data = (void*) (long) ctx->data;
+                                    data_end = (void*) (long) ctx->data_end;
+                                    payload = data + sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr);
+
+                                    if ( (void*) payload + 1 + 8 > data_end )
+                                    {
+                                        return drop_packet( counters, DROP_REASON_INTERNAL_ERROR ); // can't happen
+                                    }
+
+                                    payload[0] = PLAYER_STATE_PACKET;
+
+                                    // ack the newest input we have taken, so the client stops resending it and everything before it
+
+                                    for ( int i = 0; i < 8; i++ )
+                                    {
+                                        payload[1+i] = (__u8) ( sequence >> ( i * 8 ) );
+                                    }
+
+                                    reflect_packet( data, player_state_packet_bytes );
+
+                                    // the reply is variable length, so let the kernel copy it in instead of looping over packet bytes
+
+                                    if ( bpf_xdp_store_bytes( ctx, sizeof(struct ethhdr) + sizeof(struct iphdr) + sizeof(struct udphdr) + 1 + 8, reply->data, reply_bytes ) != 0 )
+                                    {
+                                        return drop_packet( counters, DROP_REASON_INTERNAL_ERROR ); // can't happen
+                                    }
+
+#if PLAYER_STATE_MMAP
+                                    if ( *( (volatile __u64*) &slot->sequence ) != latch_sequence || *( (volatile __u64*) &slot->owner[latch_copy] ) != session_id )
+                                    {
+                                        debug_printf( "player state changed while being read for session 0x%llx", session_id );
+                                        return drop_packet( counters, DROP_REASON_PLAYER_STATE_CHANGED );
+                                    }
+#endif // #if PLAYER_STATE_MMAP
+  
+                                    struct counters * player_state_counters = (struct counters*) bpf_map_lookup_elem( &counters_map, &zero );
+                                    if ( !player_state_counters ) 
+                                    {
+                                        return drop_packet( counters, DROP_REASON_INTERNAL_ERROR ); // can't happen
+                                    }
+
+                                    __sync_fetch_and_add( &player_state_counters->player_state_packets_sent, 1 );
+                                    __sync_fetch_and_add( &player_state_counters->player_state_bytes_sent, player_state_packet_bytes );
+
+                                    return send_packet( counters, PLAYER_STATE_PACKET, player_state_packet_bytes );
                                 }
                                 else if ( packet_type == STATS_REQUEST_PACKET && (void*) payload + STATS_REQUEST_PACKET_SIZE <= data_end )
                                 {
@@ -549,11 +880,10 @@ SEC("xdp") int server_xdp_filter( struct xdp_md *ctx )
 
                                     struct stats_request_packet * packet = (struct stats_request_packet*) payload;
 
-                                    int zero = 0;
                                     struct server_stats * stats = (struct server_stats*) bpf_map_lookup_elem( &server_stats, &zero );
                                     if ( !stats ) 
                                     {
-                                        return XDP_DROP; // can't happen
+                                        return drop_packet( counters, DROP_REASON_INTERNAL_ERROR ); // can't happen
                                     }
 
                                     packet->packet_type = STATS_RESPONSE_PACKET;
@@ -562,7 +892,7 @@ SEC("xdp") int server_xdp_filter( struct xdp_md *ctx )
 
                                     reflect_packet( data, sizeof(struct stats_request_packet) );
 
-                                    return XDP_TX;
+                                    return send_packet( counters, STATS_RESPONSE_PACKET, sizeof(struct stats_request_packet) );
                                 }
                                 else
                                 {
@@ -570,7 +900,7 @@ SEC("xdp") int server_xdp_filter( struct xdp_md *ctx )
                                 }
                             }
 
-                            return XDP_DROP;
+                            return drop_packet( counters, DROP_REASON_PACKET_TOO_SMALL );
                         }
                     }
                 }
@@ -581,4 +911,198 @@ SEC("xdp") int server_xdp_filter( struct xdp_md *ctx )
     return XDP_PASS;
 }
 
+static __always_inline int rate_limit_source( __u32 address )
+{
+    // returns 1 if the source has a token for this packet. tokens are kept in billionths of a packet
+
+    const __u64 now = bpf_ktime_get_ns();
+
+    struct rate_limit_bucket * bucket = (struct rate_limit_bucket*) bpf_map_lookup_elem( &rate_limit_map, &address );
+    if ( !bucket )
+    {
+        struct rate_limit_bucket new_bucket;
+        new_bucket.tokens = ( rate_limit_burst - 1 ) * 1000000000ULL;
+        new_bucket.last_time = now;
+        bpf_map_update_elem( &rate_limit_map, &address, &new_bucket, BPF_ANY );
+        return 1;
+    }
+
+    // a bucket this cpu hasn't used yet has last_time 0. capping elapsed fills it, and keeps elapsed * rate from overflowing
+
+    __u64 elapsed = now - bucket->last_time;
+    if ( elapsed > 10000000000ULL )
+    {
+        elapsed = 10000000000ULL;
+    }
+
+    __u64 tokens = bucket->tokens + elapsed * rate_limit;
+
+    const __u64 max_tokens = rate_limit_burst * 1000000000ULL;
+    if ( tokens > max_tokens )
+    {
+        tokens = max_tokens;
+    }
+
+    bucket->last_time = now;
+
+    if ( tokens < 1000000000ULL )
+    {
+        bucket->tokens = tokens;
+        return 0;
+    }
+
+    bucket->tokens = tokens - 1000000000ULL;
+
+    return 1;
+}
+
+static __always_inline int filter_packet( struct xdp_md *ctx )
+{
+    // first stage, before we look at the payload: drop packets to the server port from blocklisted sources, or from
+    // sources over their rate limit. returns XDP_DROP, or -1 to process the packet
+
+    void * data = (void*) (long) ctx->data; 
+
+    void * data_end = (void*) (long) ctx->data_end; 
+
+    struct ethhdr * eth = data;
+    struct iphdr  * ip  = data + sizeof(struct ethhdr);
+    struct udphdr * udp = (void*) ip + sizeof(struct iphdr);
+    __u8 * payload = (void*) udp + sizeof(struct udphdr);
+
+    if ( (void*) payload > data_end )
+        return -1;
+
+    if ( eth->h_proto != __constant_htons(ETH_P_IP) || ip->protocol != IPPROTO_UDP || udp->dest != server_port )
+        return -1;
+
+    int reason;
+
+    struct blocklist_key key;
+    key.prefix_length = 32;
+    key.address = ip->saddr;
+
+    if ( bpf_map_lookup_elem( &blocklist_map, &key ) )
+    {
+        reason = DROP_REASON_BLOCKED;
+    }
+    else if ( rate_limit && !rate_limit_source( ip->saddr ) )
+    {
+        reason = DROP_REASON_RATE_LIMITED;
+    }
+    else
+    {
+        return -1;
+    }
+
+    int zero = 0;
+    struct packet_counters * counters = (struct packet_counters*) bpf_map_lookup_elem( &packet_counters_map, &zero );
+    if ( !counters )
+    {
+        return XDP_DROP; // can't happen
+    }
+
+    counters->bytes_in += data_end - data;
+
+    int packet_type = 0;
+    if ( (void*) payload + 1 <= data_end && payload[0] < NUM_PACKET_TYPES )
+    {
+        packet_type = payload[0];
+    }
+
+    counters->received[packet_type]++;
+
+    return drop_packet( counters, reason );
+}
+
+#if CPU_STEERING
+
+static __always_inline int steer_packet( struct xdp_md *ctx )
+{
+    // returns the redirect action if this packet belongs to a session, otherwise -1 to process it on this cpu
+
+    void * data = (void*) (long) ctx->data; 
+
+    void * data_end = (void*) (long) ctx->data_end; 
+
+    struct ethhdr * eth = data;
+    struct iphdr  * ip  = data + sizeof(struct ethhdr);
+    struct udphdr * udp = (void*) ip + sizeof(struct iphdr);
+    __u8 * payload = (void*) udp + sizeof(struct udphdr);
+
+    if ( (void*) payload + 1 + 8 > data_end )
+        return -1;
+
+    if ( eth->h_proto != __constant_htons(ETH_P_IP) || ip->protocol != IPPROTO_UDP || udp->dest != server_port )
+        return -1;
+
+    if ( payload[0] != JOIN_REQUEST_PACKET && payload[0] != INPUT_PACKET )
+        return -1;
+
+    __u64 session_id = (__u64) payload[1];
+    session_id |= ( (__u64) payload[2] ) << 8;
+    session_id |= ( (__u64) payload[3] ) << 16;
+    session_id |= ( (__u64) payload[4] ) << 24;
+    session_id |= ( (__u64) payload[5] ) << 32;
+    session_id |= ( (__u64) payload[6] ) << 40;
+    session_id |= ( (__u64) payload[7] ) << 48;
+    session_id |= ( (__u64) payload[8] ) << 56;
+
+    __u32 bucket = session_id % CPU_STEERING_BUCKETS;
+
+    __u32 * cpu = (__u32*) bpf_map_lookup_elem( &cpu_steering_map, &bucket );
+    if ( !cpu )
+        return -1;
+
+    return bpf_redirect_map( &cpu_map, *cpu, XDP_DROP );
+}
+
+SEC("xdp") int server_xdp_filter( struct xdp_md *ctx ) 
+{
+    // first stage: drop blocklisted and rate limited sources, then send each session's packets to the cpu assigned to
+    // it by player_server, so we aren't limited to the cpus that have rx queues
+
+    int result = filter_packet( ctx );
+    if ( result >= 0 )
+    {
+        return result;
+    }
+
+    result = steer_packet( ctx );
+    if ( result >= 0 )
+    {
+        return result;
+    }
+
+    return process_packet( ctx, 0 );
+}
+
+SEC("xdp/cpumap") int server_xdp_steered( struct xdp_md *ctx ) 
+{
+    // second stage: runs on the assigned cpu. XDP_TX is not available here, so replies are redirected back out the interface they came in on
+
+    int result = process_packet( ctx, 1 );
+    if ( result == XDP_TX )
+    {
+        return bpf_redirect( ctx->ingress_ifindex, 0 );
+    }
+
+    return result;
+}
+
+#else // #if CPU_STEERING
+
+SEC("xdp") int server_xdp_filter( struct xdp_md *ctx ) 
+{
+    int result = filter_packet( ctx );
+    if ( result >= 0 )
+    {
+        return result;
+    }
+
+    return process_packet( ctx, 0 );
+}
+
+#endif // #if CPU_STEERING
+
 char _license[] SEC("license") = "GPL";
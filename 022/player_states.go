@@ -0,0 +1,90 @@
+package main
+
+import (
+	"encoding/binary"
+)
+
+// player state replies are the full state, or a delta against an earlier state the client acked. client and bench_client
+// both decode them with this, see shared.h for the layout
+
+const PlayerStateGroups = (PlayerStateSize + 7) / 8
+const PlayerStateGroupMaskBytes = (PlayerStateGroups + 7) / 8
+const PlayerStateHistory = 32
+const PlayerStateReplyHeaderSize = 8 + 8
+
+// PlayerStates holds the player states we have received, so a player state delta can be applied to the state the
+// server used as its baseline. See shared.h for the reply layout
+
+type PlayerStates struct {
+	history [PlayerStateHistory][]byte // t, then the state data
+	index   int
+	next    []byte
+}
+
+func newPlayerStates() *PlayerStates {
+	states := &PlayerStates{next: make([]byte, 8+PlayerStateSize)}
+	for i := range states.history {
+		states.history[i] = make([]byte, 8+PlayerStateSize)
+	}
+	return states
+}
+
+// apply decodes a player state reply and adds the state to the history. It returns the state t, or false if the
+// reply is malformed or its baseline is older than anything we still have
+
+func (states *PlayerStates) apply(reply []byte) (uint64, bool) {
+	if len(reply) < PlayerStateReplyHeaderSize {
+		return 0, false
+	}
+	baselineT := binary.LittleEndian.Uint64(reply[0:])
+	t := binary.LittleEndian.Uint64(reply[8:])
+	next := states.next
+	if baselineT == 0 {
+		if len(reply) != PlayerStateReplyHeaderSize+PlayerStateSize {
+			return 0, false
+		}
+		copy(next, reply[8:])
+	} else {
+		var baseline []byte
+		for _, previous := range states.history {
+			if binary.LittleEndian.Uint64(previous) == baselineT {
+				baseline = previous
+				break
+			}
+		}
+		if baseline == nil || len(reply) < PlayerStateReplyHeaderSize+PlayerStateGroupMaskBytes {
+			return 0, false
+		}
+		copy(next, baseline)
+		binary.LittleEndian.PutUint64(next, t)
+		groupMask := reply[PlayerStateReplyHeaderSize : PlayerStateReplyHeaderSize+PlayerStateGroupMaskBytes]
+		index := PlayerStateReplyHeaderSize + PlayerStateGroupMaskBytes
+		for g := 0; g < PlayerStateGroups; g++ {
+			if groupMask[g/8]&(1<<(g%8)) == 0 {
+				continue
+			}
+			if index >= len(reply) {
+				return 0, false
+			}
+			changed := reply[index]
+			index++
+			for k := 0; k < 8; k++ {
+				if changed&(1<<k) == 0 {
+					continue
+				}
+				if index >= len(reply) || g*8+k >= PlayerStateSize {
+					return 0, false
+				}
+				next[8+g*8+k] = reply[index]
+				index++
+			}
+		}
+		if index != len(reply) {
+			return 0, false
+		}
+	}
+	states.next = states.history[states.index]
+	states.history[states.index] = next
+	states.index = (states.index + 1) % PlayerStateHistory
+	return t, true
+}
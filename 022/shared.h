@@ -11,27 +11,100 @@
 #define STATS_REQUEST_PACKET                                                                4
 #define STATS_RESPONSE_PACKET                                                               5
 #define PLAYER_STATE_PACKET                                                                 6
+#define JOIN_CHALLENGE_PACKET                                                               7
+
+#define SERVER_PORT                                                                     40000
 
 #define INPUT_SIZE                                                                        100
 #define INPUTS_PER_PACKET                                                                  10
-#define INPUT_PACKET_SIZE            ( 1 + 8 + 8 + 8 + (INPUT_SIZE + 8) * INPUTS_PER_PACKET )
 
 #define PLAYER_DATA_SIZE                                                                 1024
 
 #define PLAYER_STATE_SIZE                                                                1000
 
-#define JOIN_REQUEST_PACKET_SIZE                             ( 1 + 8 + 8 + PLAYER_DATA_SIZE )
+#define JOIN_REQUEST_PACKET_SIZE                         ( 1 + 8 + 8 + 8 + PLAYER_DATA_SIZE )
 #define JOIN_RESPONSE_PACKET_SIZE                                           ( 1 + 8 + 8 + 8 )
+#define JOIN_CHALLENGE_PACKET_SIZE                                          ( 1 + 8 + 8 + 8 )
 #define STATS_REQUEST_PACKET_SIZE                                               ( 1 + 8 + 8 )
 #define STATS_RESPONSE_PACKET_SIZE                                              ( 1 + 8 + 8 )
 
-#define MAX_SESSIONS                                                                   100000
+// defaults for player_server's load time parameters. MAX_CPUS is the most cpus it can use, the default is every online cpu
+
+#define SESSIONS_PER_CPU                                                                 1000
 
-#define MAX_CPUS                                                                           32
+#define MAX_CPUS                                                                          256
 
 #define PLAYERS_PER_CPU                                                                   500
 
-#define PLAYER_STATE_PACKET_SIZE                                ( 1 + 8 + PLAYER_STATE_SIZE )
+#define INPUT_PACKETS_PER_SECOND                                                          100
+
+#define INPUT_BUFFER_MILLISECONDS                                                         250
+
+#define JOIN_COOKIES                                                                        1
+
+#define JOIN_COOKIE_SECONDS                                                                10
+
+#define RATE_LIMIT_PACKETS_PER_SECOND                                                    1000
+#define RATE_LIMIT_BURST                                                                 1000
+#define RATE_LIMIT_SOURCES                                                              65536
+
+#define BLOCKLIST_SIZE                                                                   1024
+
+#define PLAYER_STATE_GROUPS                                       ( ( PLAYER_STATE_SIZE + 7 ) / 8 )
+#define PLAYER_STATE_GROUP_MASK_BYTES                           ( ( PLAYER_STATE_GROUPS + 7 ) / 8 )
+#define PLAYER_STATE_REPLY_MAX_SIZE                                 ( 8 + 8 + PLAYER_STATE_SIZE )
+#define PLAYER_STATE_PACKET_SIZE                                ( 1 + 8 + PLAYER_STATE_REPLY_MAX_SIZE )
+
+#define PLAYER_STATE_HISTORY                                                               16
+
+#define STATE_SEND_RATE                                                                     0
+#define STATE_SEND_SLICES                                                                  10
+#define STATE_SEND_BATCH_SIZE                                                              64
+
+#define PLAYER_STATE_MMAP                                                                   0
+
+#define PLAYER_STATE_SLOT_PROBES                                                            8
+
+#define PLAYER_STATE_SLOT_TIMEOUT_SECONDS                                                  15
+
+#define PLAYER_STATE_USER_RINGBUF                                                           0
+
+#define PLAYER_STATE_COMMITS_PER_PLAYER                                                     4
+
+#if PLAYER_STATE_MMAP && PLAYER_STATE_USER_RINGBUF
+#error "PLAYER_STATE_USER_RINGBUF commits into the player state hash, so it can't be used with PLAYER_STATE_MMAP"
+#endif // #if PLAYER_STATE_MMAP && PLAYER_STATE_USER_RINGBUF
+
+#define CPU_STEERING                                                                        0
+
+#define CPU_STEERING_BUCKETS                                                             4096
+
+#define WORKER_POLL_STATE_DEFAULT                                                           0
+#define WORKER_POLL_STATE_SPINNING                                                          1
+#define WORKER_POLL_STATE_SLEEPING                                                          2
+
+#define LATENCY_HISTOGRAM_SUB_BITS                                                          4
+#define LATENCY_HISTOGRAM_MAX_BITS                                                         36
+#define LATENCY_HISTOGRAM_BUCKETS   ( ( LATENCY_HISTOGRAM_MAX_BITS - LATENCY_HISTOGRAM_SUB_BITS + 1 ) << LATENCY_HISTOGRAM_SUB_BITS )
+
+#define NUM_PACKET_TYPES                                                                    8
+
+#define DROP_REASON_SESSION_NOT_FOUND                                                       0
+#define DROP_REASON_OLD_INPUT                                                               1
+#define DROP_REASON_NO_INPUT_BUFFER                                                         2
+#define DROP_REASON_RING_BUFFER_FULL                                                        3
+#define DROP_REASON_NO_PLAYER_STATE_MAP                                                     4
+#define DROP_REASON_PLAYER_STATE_NOT_FOUND                                                  5
+#define DROP_REASON_PLAYER_STATE_NOT_READY                                                  6
+#define DROP_REASON_PLAYER_STATE_CHANGED                                                    7
+#define DROP_REASON_PACKET_TOO_SMALL                                                        8
+#define DROP_REASON_INTERNAL_ERROR                                                          9
+#define DROP_REASON_NO_PLAYER_STATE_SLOT                                                   10
+#define DROP_REASON_BAD_JOIN_COOKIE                                                        11
+#define DROP_REASON_BLOCKED                                                                12
+#define DROP_REASON_RATE_LIMITED                                                           13
+#define DROP_REASON_BAD_INPUT_PACKET                                                       14
+#define NUM_DROP_REASONS                                                                   15
 
 #pragma pack(push, 1)
 
@@ -40,6 +113,7 @@ struct join_request_packet
     __u8 packet_type;
     __u64 session_id;
     __u64 send_time;
+    __u64 cookie;                           // 0 asks for a join challenge, otherwise the cookie from the challenge
     __u8 player_data[PLAYER_STATE_SIZE];
 };
 
@@ -51,6 +125,14 @@ struct join_response_packet
     __u64 server_time;
 };
 
+struct join_challenge_packet
+{
+    __u8 packet_type;
+    __u64 session_id;
+    __u64 send_time;
+    __u64 cookie;                           // echo this in the next join request
+};
+
 struct stats_request_packet
 {
     __u8 packet_type;
@@ -64,9 +146,29 @@ struct server_stats
     __u64 player_state_packets_sent;
 };
 
+struct join_cookie_key
+{
+    __u64 k0;
+    __u64 k1;
+};
+
+struct blocklist_key
+{
+    __u32 prefix_length;                    // lpm trie keys start with the prefix length in bits
+    __u32 address;                          // network byte order
+};
+
+struct rate_limit_bucket
+{
+    __u64 tokens;                           // in billionths of a packet, so a refill of rate * elapsed ns is exact
+    __u64 last_time;
+};
+
 struct session_data 
 {
     __u64 next_input_sequence;
+    __u32 player_state_slot;
+    __u64 last_input_time;                  // only kept up to date with PLAYER_STATE_MMAP, an idle session gives up its slot
 };
 
 struct player_state
@@ -75,11 +177,38 @@ struct player_state
     __u8 data[PLAYER_STATE_SIZE];
 };
 
+struct player_state_reply
+{
+    __u64 bytes;                            // of data. 0 until the worker has stepped the player
+    __u8 data[PLAYER_STATE_REPLY_MAX_SIZE];
+};
+
+struct player_state_slot
+{
+    __u64 session_id;                       // the session xdp gave the slot to when it joined
+    __u64 sequence;                         // latch: readers use reply[sequence&1], the writer updates reply[0] then reply[1]
+    __u64 owner[2];                         // the session each copy of the reply was written for
+    struct player_state_reply reply[2];
+};
+
+struct player_state_commit
+{
+    __u64 session_id;
+    struct player_state_reply reply;
+};
+
 struct input_header
 {
     __u64 session_id;
     __u64 sequence;
     __u64 t;
+    __u64 num_inputs;
+    __u64 player_state_slot;
+    __u64 submit_time;                      // bpf_ktime_get_ns when xdp received the input packet and submitted the record
+    __u64 baseline;                         // t of the newest player state the client has received, or 0
+    __u32 source_address;                   // where the input packet came from, network byte order
+    __u16 source_port;
+    __u16 padding;
 };
 
 struct input_data
@@ -88,9 +217,89 @@ struct input_data
     __u8 input[INPUT_SIZE];
 };
 
+/*
+    Input packets carry a session id, sequence and t, then one to INPUTS_PER_PACKET inputs, most recent first, in the
+    compact encoding described in input_encoding.h. Clients only resend inputs newer than the last sequence acked in
+    a player state packet, so with no loss an input packet carries a single input.
+
+    Input packets also carry the t of the newest player state the client has received. Workers keep the last
+    PLAYER_STATE_HISTORY states of each player, and encode the next player state reply as a delta against that
+    baseline if they still have it.
+
+    Player state packets are packet type, ack (the newest input sequence the server has taken), then the reply:
+
+        u64     baseline t, or 0 if the state is sent in full
+        u64     t
+
+    then in full, the PLAYER_STATE_SIZE bytes of state data, or as a delta:
+
+        u8      group mask[PLAYER_STATE_GROUP_MASK_BYTES]: bit g is set if any of data bytes 8g to 8g+7 changed
+        then for each group that changed, a byte mask of which of its bytes changed, followed by those bytes
+
+    so a reply for a state that hasn't changed since the baseline is just the header and group mask. Workers send
+    the state in full whenever the delta would be bigger.
+
+    By default xdp sends the player state packet as the reply to each input packet, so no input means no state. With
+    state_send_rate=N, xdp only consumes input packets, and each worker sends the latest reply of every one of its
+    players N times a second with sendmmsg, to the address its last input came from. Each tick is split into
+    STATE_SEND_SLICES, and each slice sends its share of the players, so a worker doesn't burst every player's state
+    out at once.
+
+    With PLAYER_STATE_USER_RINGBUF, workers don't update the player state map with a syscall for each reply. They
+    write a player_state_commit into their cpu's BPF_MAP_TYPE_USER_RINGBUF instead, and xdp drains it into the player
+    state map with bpf_user_ringbuf_drain before it reads a reply on that cpu. The commit buffer holds
+    PLAYER_STATE_COMMITS_PER_PLAYER commits for each player on the cpu. If it is full, because no input packets have
+    arrived on the cpu to drain it, the commit is dropped and counted by the worker. The reply that goes out for the
+    player's next input packet may then be a little old, until the commit for that input lands.
+*/
+
+#define INPUT_RECORD_SIZE(n) ( sizeof(struct input_header) + sizeof(struct input_data) * (n) )
+
+/*
+    Latency histograms are HDR style: values below 2^SUB_BITS ns get a bucket each, then every power of two up to
+    2^MAX_BITS ns is split into 2^SUB_BITS linear buckets, so any value is within ~6% of its bucket. Slower goes in
+    the last bucket.
+
+    receive_to_simulate ends when the worker starts stepping the player. simulate_to_commit ends when the worker has
+    written the new state to the player state map or slot, so the next reply xdp sends carries it. What it covers
+    depends on the worker mode:
+
+        per input: the step, the zone DB round trip and the commit of that one player
+        tick: every step of the tick and the commit of all the players stepped, so each player's sample is the whole tick
+
+    With state_send_rate, xdp sends no replies and simulate_to_commit ends when the reply is queued for the worker's
+    next send slice, not when it goes out. The slice lateness the worker prints covers the rest.
+
+    With PLAYER_STATE_USER_RINGBUF, simulate_to_commit ends when the commit is in the commit buffer. xdp only applies it
+    when the next input packet arrives on the cpu, and that wait is not counted.
+*/
+
+struct latency_histograms
+{
+    __u64 receive_to_simulate[LATENCY_HISTOGRAM_BUCKETS];   // from xdp receiving an input to the worker stepping the player with it
+    __u64 simulate_to_commit[LATENCY_HISTOGRAM_BUCKETS];    // from stepping the player to the worker committing its new state
+};
+
+struct worker_poll_state
+{
+    __u64 state;                            // WORKER_POLL_STATE_*, written by the worker that consumes the ring buffer for this cpu
+    __u8 padding[56];
+};
+
 struct counters
 {
     __u64 player_state_packets_sent;
+    __u64 player_state_bytes_sent;          // payload bytes of the player state packets sent
+    __u64 player_state_commits;             // drained from this cpu's player state commit buffer (PLAYER_STATE_USER_RINGBUF)
+};
+
+struct packet_counters
+{
+    __u64 received[NUM_PACKET_TYPES];       // by packet type. types we don't know are counted as 0
+    __u64 sent[NUM_PACKET_TYPES];
+    __u64 dropped[NUM_DROP_REASONS];        // DROP_REASON_*
+    __u64 bytes_in;                         // whole frames, for packets to the server port only
+    __u64 bytes_out;
 };
 
 #pragma pack(pop)